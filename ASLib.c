@@ -7,6 +7,7 @@
  *        Alexander Nähring         *
  ************************************/
 
+#define _GNU_SOURCE // accept4(), pipe2()
 #include "ASLib.h"
 
 #include <stdlib.h>
@@ -21,19 +22,314 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 
 #include <fcntl.h>  // non blocking
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
 
 //////////////////////////////
 //        STRUCTURES        //
 //////////////////////////////
 
+typedef struct AS_IdMap_s { // open addressing hash map: id (>= 0) -> pointer
+  int *keys;      // AS_IdMapEmpty / AS_IdMapDeleted for unused slots
+  void **values;
+  int size;       // number of slots (power of two)
+  int num;        // number of stored ids
+  int used;       // number of stored ids + deleted slots
+} AS_IdMap_t;
+
+typedef struct AS_IdSet_s { // set of ids with O(1) add/remove and a compact array for sending
+  int *ids;
+  int num;
+  int size;
+  AS_IdMap_t index; // id -> position in ids + 1
+} AS_IdSet_t;
+
+typedef struct AS_PresenceBatch_s { // one presence delta, kept for versioned client lists
+  int toVersion;  // version reached with this delta (0: slot unused)
+  int *ids;       // leaves followed by joins
+  int leaveNum;
+  int joinNum;
+} AS_PresenceBatch_t;
+
+typedef struct AS_Timer_s { // timer wheel entry, embedded in connection structures
+  unsigned long long expires; // tick
+  void *data;
+  struct AS_Timer_s *prev;
+  struct AS_Timer_s *next;    // NULL: not scheduled
+} AS_Timer_t;
+
+#define AS_WheelLevels 4
+#define AS_WheelBits 6
+#define AS_WheelSlots (1 << AS_WheelBits)
+
+typedef struct AS_TimerWheel_s { // hierarchical timer wheel: 64 slots per level, level n slot = 64^n ticks
+  unsigned long long now;  // last processed tick
+  AS_Timer_t slots[AS_WheelLevels][AS_WheelSlots]; // list heads
+} AS_TimerWheel_t;
+
+#define AS_HistSubBits 5    // linear sub-buckets per power of two: 32 (about 3% resolution)
+#define AS_HistMaxBits 40   // values up to 2^40 ns (about 18 minutes)
+#define AS_HistBuckets ((AS_HistMaxBits - AS_HistSubBits + 2) << AS_HistSubBits)
+
+typedef struct AS_Histogram_s { // HDR style latency histogram: log-linear buckets, constant relative error
+  long long counts[AS_HistBuckets];
+  long long count;
+  long long min;
+  long long max;
+  long long sum;
+} AS_Histogram_t;
+
+#define AS_PAYLOAD_MAX (INT_MAX - 65536) // no payload is larger (AS_OptMaxPayload 0): with headers and '\0' its size fits into an int
+
+typedef struct AS_InBuffer_s { // receive state of a non-blocking connection
+  char *data;     // bytes received but not parsed yet: data[start] .. data[end-1]
+  int size;
+  int start;
+  int end;
+  AS_MessageHeader_t header;  // header of frame in progress
+  int haveHeader;
+  char *payload;              // payload of frame in progress
+  unsigned int payloadHave;
+  long long frameStart;       // time when first byte of frame in progress arrived, 0: none
+  long long lastRecv;         // time of last received byte
+  unsigned int maxPayload;    // see AS_OptMaxPayload, at most AS_PAYLOAD_MAX
+  long long admit;            // payload bytes a frame may allocate (AS_OptClientMemory minus receive buffer), -1: unlimited
+  long long *account;         // memory is also counted here (server), NULL: none
+  int quickAck;               // see AS_OptQuickAck
+} AS_InBuffer_t;
+
+typedef struct AS_Buffer_s { // reference counted frame (header + payload), shared between recipients
+  int refs;
+  int len;
+  char data[];
+} AS_Buffer_t;
+
+typedef struct AS_OutFrame_s {
+  AS_Buffer_t *buffer;
+  int sent; // bytes of buffer already sent
+  struct AS_OutFrame_s *next;
+} AS_OutFrame_t;
+
+#define AS_PrioControl 0      // administrative frames (AS_Type < AS_TypeMessage)
+#define AS_PrioInteractive 1  // messages, file requests/answers
+#define AS_PrioBulk 2         // file data and fragments
+#define AS_PrioNum 3
+#define AS_WeightInteractive 4  // interactive frames per bulk frame if both are waiting
+#define AS_WireWindow (4*AS_FRAGMENT) // bytes scheduled for sending at once, later frames can still overtake
+
+typedef struct AS_OutLane_s { // frames of one priority, not scheduled yet
+  AS_OutFrame_t *head;
+  AS_OutFrame_t *tail;
+} AS_OutLane_t;
+
+typedef struct AS_OutQueue_s { // frames waiting for a non-blocking socket
+  AS_OutFrame_t *head;  // scheduled frames in wire order, the first one may be sent partially
+  AS_OutFrame_t *tail;
+  int wireBytes;        // bytes of scheduled frames not sent yet
+  AS_OutLane_t lanes[AS_PrioNum];
+  int credit;           // interactive frames scheduled since last bulk frame
+  int bytes;  // bytes not sent yet (scheduled and waiting in lanes)
+  long long *account;   // bytes are also counted here (server), NULL: none
+} AS_OutQueue_t;
+
+typedef struct AS_Handoff_s { // sockets handed over to the server thread
+  int socket;
+  int peer;   // outgoing connection to another server of the federation (AS_ServerPeer)
+  struct AS_Handoff_s *next;
+} AS_Handoff_t;
+
+// handover (AS_SetHandover): records sent by the running server to its successor over <dir>/<port>.sock
+#define AS_HandoverServer 1   // AS_HandoverServer_t, listening socket attached
+#define AS_HandoverDatagram 2 // no data, UDP socket attached
+#define AS_HandoverIds 3      // int (which set, see AS_HandoverSets) followed by ids
+#define AS_HandoverHistory 4  // AS_PresenceDelta_t followed by leaves and joins of one kept presence delta
+#define AS_HandoverDeparted 5 // int ID followed by name
+#define AS_HandoverClient 6   // AS_HandoverClient_t followed by its data, socket attached
+#define AS_HandoverEnd 7      // no data, answered with one byte by the successor when it has taken over
+#define AS_HandoverQueued 8   // int ID followed by a frame queued for a client sent before
+#define AS_HandoverSetNum 5
+
+typedef struct AS_HandoverRecord_s { // followed by len bytes
+  int type;           // AS_Handover...
+  int fd;             // 1: file descriptor attached (SCM_RIGHTS)
+  unsigned int len;
+} AS_HandoverRecord_t;
+
+typedef struct AS_HandoverServer_s {
+  int version;        // AS_VERSION of the running server
+  int node;           // client IDs keep the node they were given
+  int nextId;
+  int presenceVersion;
+} AS_HandoverServer_t;
+
+typedef struct AS_HandoverClient_s { // registry entry of one connection
+  int id;
+  int presence;
+  int peer;
+  char name[AS_NAMELEN];
+  int mailbox;              // frames for this client go to its mailbox, replay continues at the successor
+  unsigned int udpToken;
+  struct sockaddr_storage udpAddr;
+  socklen_t udpAddrLen;
+  int remoteNum;            // ids of the clients of a peer, follow first
+  int haveHeader;           // frame in progress: header below, payloadHave bytes of its payload follow
+  AS_MessageHeader_t header;
+  unsigned int payloadHave;
+  int buffered;             // bytes received but not parsed yet, follow
+  int frames;               // queued frames (AS_HandoverFrame_t + frame), follow in wire order
+} AS_HandoverClient_t;
+
+typedef struct AS_HandoverFrame_s {
+  int len;
+  int sent;       // bytes already written to the socket
+  int scheduled;  // frame was in wire order (see AS_OutQueue_t), 0: waiting in its lane
+} AS_HandoverFrame_t;
+
+typedef struct AS_HandoverOut_s { // record waiting to be written to the successor (header and data)
+  int fd;             // attached socket, -1: none
+  unsigned int len;
+  unsigned int sent;
+  struct AS_HandoverOut_s *next;
+  char data[];
+} AS_HandoverOut_t;
+
+typedef struct AS_MailboxRecord_s { // record in a mailbox segment, followed by the frame (header + payload)
+  unsigned long long seq;
+  long long time;     // wall clock (ms) when stored, retention by age
+  unsigned int len;   // bytes of frame
+} AS_MailboxRecord_t;
+
+typedef struct AS_SegmentHeader_s { // start of each mailbox segment file, records follow
+  unsigned long long firstSeq;
+  unsigned int num;   // records in this segment
+  unsigned int end;   // bytes used (including this header)
+  long long lastTime; // time of newest record
+} AS_SegmentHeader_t;
+
+typedef struct AS_Segment_s { // mapped segment file <firstSeq>.log and its index <firstSeq>.idx
+  unsigned long long firstSeq;
+  AS_SegmentHeader_t *header; // mapped segment
+  unsigned int size;
+  unsigned int *index;        // mapped index: offset of record seq at [seq - firstSeq]
+  unsigned int indexNum;      // capacity of index
+  struct AS_Segment_s *next;
+} AS_Segment_t;
+
+typedef struct AS_Mailbox_s { // frames kept for one client name (used by the mailbox thread only)
+  char *name;
+  char *path;
+  AS_Segment_t *segments;     // oldest first
+  unsigned long long nextSeq;
+  unsigned long long delivered; // all records up to this seq were replayed
+  long long bytes;            // size of all segments
+  struct AS_Mailbox_s *next;
+} AS_Mailbox_t;
+
+#define AS_JobAppend 1    // server -> mailbox thread: store frame
+#define AS_JobReplay 2    // server -> mailbox thread: read next batch
+#define AS_JobAck 3       // server -> mailbox thread: batch was queued for the client
+#define AS_JobReplayed 4  // mailbox thread -> server: batch of frames
+
+typedef struct AS_MailboxJob_s {
+  int type;                 // AS_Job...
+  char name[AS_NAMELEN];
+  int client;               // replay: ID of the client the batch is meant for
+  int appends;              // replay: appends issued for this client before the request
+  AS_Buffer_t *buffer;      // append: copy of the frame
+  AS_Buffer_t **frames;     // replayed: frames of the batch
+  int num;
+  int done;                 // replayed: no more records
+  unsigned long long seq;   // replayed/ack: seq of last frame in batch
+  struct AS_MailboxJob_s *next;
+} AS_MailboxJob_t;
+
+#define AS_DATAGRAM_BATCH 64  // datagrams per sendmmsg()/recvmmsg() call
+#define AS_DATAGRAM_RETRY 100 // ms between hellos of a client until its datagram channel is acknowledged
+
+typedef struct AS_HookJob_s { // frame of a client handled by a hook on a worker thread
+  AS_Hook_t hook;           // NULL: frame only waits for the frames of its client before it (handled by the server thread)
+  int client;               // ID of the connection that sent the frame
+  AS_MessageHeader_t header;
+  void *payload;            // copy, may be replaced by the hook
+  unsigned int size;        // bytes of the copy, counted in server memory until the result is taken
+  int traced;               // frame carries trace
+  AS_Trace_t trace;
+  int unreliable;           // frame may be forwarded as datagram
+  int result;               // AS_Hook...
+  struct AS_HookJob_s *next;
+} AS_HookJob_t;
+
+typedef struct AS_HookWorker_s { // thread running hooks, frames of one client always go to the same worker (order is kept)
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  AS_HookJob_t *jobs;       // server thread -> worker
+  AS_HookJob_t *jobsLast;
+  struct AS_Server_s *server;
+} AS_HookWorker_t;
+
+typedef struct AS_ConnectedClients_s  { // server side: connected clients
+  int socket;   // -1 after connection was closed
+  int id;       // client ID as seen by other clients
+  int presence; // client wants to receive presence frames
+  //struct sockaddr_storage sockaddr;
+  char name[AS_NAMELEN];
+  AS_InBuffer_t in;   // frame in progress
+  AS_OutQueue_t out;  // frames waiting to be sent to this client
+  long long lastSend; // time of last frame queued (heartbeats)
+  AS_Timer_t timer;   // heartbeats and timeouts
+  int epollOut;       // socket is registered for EPOLLOUT
+  int epollPaused;    // socket is not registered for EPOLLIN (run queue or throttled)
+  struct AS_ConnectedClients_s *flushNext; // list of clients with new frames in queue
+  int dirty;          // client is in flush list
+  int dropping;       // frames for this client are dropped (over its memory budget), logged once
+  struct AS_ConnectedClients_s *runNext;  // run queue: clients with work left after their budget
+  int queued;         // client is in run queue
+  long long tokens;   // token bucket (bytes), see AS_OptRateLimit
+  long long tokensTime;   // time of last refill
+  long long throttledUntil; // reading paused until enough tokens are available, 0: not throttled
+  long long throttledSince; // start of the pause, timeouts are shifted by its length
+  int hookJobs;       // frames at a hook worker, later frames of this client are queued behind them
+  long long hookBytes;    // bytes of these frames, counted in the memory budget of this client
+  struct AS_Reassembly_s *fragments; // frames of hooked types arriving in fragments, one per channel
+  long long fragmentBytes;    // bytes allocated for them, counted in the memory budget of this client
+  int mailbox;        // frames for this client go to its mailbox (replay in progress or queue overflow)
+  int appends;        // frames sent to the mailbox thread for this client
+  int replayWanted;   // mailbox has frames for this client, next batch is requested when the queue is short
+  int replayRunning;  // batch requested, not received yet
+  int peer;           // connection to another server: its node, -1: hello not received yet, 0: client
+  int handedOver;     // state was sent to the successor: not read or written anymore, new frames follow it
+  AS_IdSet_t remote;  // peer: clients connected to that node
+  unsigned int udpToken;  // datagram channel offered to this client, 0: none
+  struct sockaddr_storage udpAddr; // UDP endpoint of the client
+  socklen_t udpAddrLen;   // 0: endpoint not known yet (no hello received)
+  int udpWakeup;      // wakeup of the datagram socket the budgets below belong to
+  int udpBytes;       // bytes of datagrams handled in this wakeup, see AS_OptReadBudget
+  int udpFrames;      // datagrams handled in this wakeup, see AS_OptFrameBudget
+  
+  struct AS_ConnectedClients_s *prev;
+  struct AS_ConnectedClients_s *next;
+} AS_ConnectedClients_t;
+
 typedef struct AS_Server_s {  // server side: running servers
   int port;
   int running;
@@ -42,20 +338,207 @@ typedef struct AS_Server_s {  // server side: running servers
   int IPv;
   int clientsNum;
   pthread_t* thread;
+  int backlog;
+  int heartbeat;      // ms, see AS_OptHeartbeat
+  int idleTimeout;    // ms, see AS_OptIdleTimeout
+  int readTimeout;    // ms, see AS_OptReadTimeout
+  int readBudget;     // bytes per client and wakeup, see AS_OptReadBudget
+  int frameBudget;    // frames per client and wakeup, see AS_OptFrameBudget
+  int rateLimit;      // bytes/s per client, see AS_OptRateLimit
+  int rateBurst;      // bytes, see AS_OptRateBurst
+  long long clientMemory; // bytes per connection, see AS_OptClientMemory
+  long long serverMemory; // bytes of all connections, see AS_OptServerMemory
+  long long memory;       // bytes used by all connections now (see AS_ConnectionMemory) and by frames at hook workers
+  long long memoryPeak;
+  long long dropped;      // frames not queued because the recipient was over its budget
+  long long rejected;     // connections closed by admission control
+  AS_Config_t config; // all options the server was started with (socket knobs, limits)
+  AS_TimerWheel_t wheel;
+  int listener;       // listening socket (non-blocking)
+  int udp;            // datagram socket on the same port (AS_OptDatagram), -1: off
+  char *udpBuffer;    // receive buffers of one recvmmsg() batch
+  int udpWakeup;      // counts calls of AS_ServerDatagramReceive, budgets of datagrams apply per wakeup
+  int epoll;
+  AS_ConnectedClients_t *clients; // root element of connected clients
+  AS_IdMap_t clientMap;           // client ID -> client
+  int nextId;                     // next client ID (without node bits)
+  AS_ConnectedClients_t *flushList;   // clients with new frames in queue
+  AS_ConnectedClients_t *closedList;  // clients closed in this loop iteration, freed at the end
+  AS_ConnectedClients_t *runHead;     // run queue (round robin): clients not done after their budget
+  AS_ConnectedClients_t *runTail;
+  int runNum;
+  
+  // optional acceptor thread, hands new sockets over to server thread
+  pthread_t *acceptor;
+  pthread_mutex_t handoffLock;
+  AS_Handoff_t *handoff;
+  int wakePipe[2];  // wakes server thread from epoll_wait()
+  
+  // presence: joins/leaves are collected and sent once per AS_PRESENCE_INTERVAL
+  AS_IdSet_t snapshot;      // client list at presenceVersion
+  AS_IdSet_t pendingJoins;  // joins since last presence frame
+  AS_IdSet_t pendingLeaves; // leaves since last presence frame
+  int presenceVersion;
+  double presenceLast;      // time of last presence frame
+  AS_PresenceBatch_t presenceHistory[AS_PRESENCE_HISTORY];
+  
+  // store-and-forward (AS_SetMailbox): files are only touched by the mailbox thread
+  char *mailboxDir;         // NULL: off
+  pthread_t *mailboxThread;
+  pthread_mutex_t mailboxLock;
+  pthread_cond_t mailboxCond;
+  int mailboxStop;
+  AS_MailboxJob_t *mailboxJobs;     // server thread -> mailbox thread
+  AS_MailboxJob_t *mailboxJobsLast;
+  AS_MailboxJob_t *mailboxResults;  // mailbox thread -> server thread
+  AS_Mailbox_t *mailboxes;          // open mailboxes (mailbox thread)
+  AS_IdMap_t departed;              // ID of disconnected named client -> name
+  int mailboxSegment;
+  int mailboxSize;
+  int mailboxAge;
+  int mailboxQueue;
+  int mailboxBatch;
+  AS_RequestHandler_t handlers[AS_METHODS]; // see AS_SetHandler
+  
+  // hooks (AS_SetHook): frames of clients are passed to the hook of their type before they are forwarded
+  AS_Hook_t hooks[AS_HOOKS];
+  char hooksDirect[AS_HOOKS];     // hook runs in the server thread
+  AS_HookWorker_t *hookWorkers;   // NULL: no hook runs on a worker
+  int hookWorkersNum;
+  AS_HookJob_t *hookResults;      // workers -> server thread (lock-free stack, newest first)
+  
+  // federation (AS_OptNodeId): servers connected in a full mesh, each one forwards frames of its own clients
+  int node;                 // 0: no federation
+  char *peerSecret;         // shared secret of the federation (AS_SetPeerSecret), NULL: accepted connections cannot become peers
+  AS_ConnectedClients_t *peers[AS_NODE_MAX + 1]; // node -> connection to its server
+  AS_IdSet_t peerJoins;     // joins of own clients since last presence frame to peers
+  AS_IdSet_t peerLeaves;    // leaves of own clients since last presence frame to peers
+  
+  // handover (AS_SetHandover): a new server for this port in another process takes over all sockets
+  char *handoverPath;       // <dir>/<port>.sock, NULL: off
+  int handover;             // listening unix socket, -1: none
+  int handedOver;           // handover running or done: acceptor ends, the socket file belongs to the successor
+  int handoverSock;         // connection to the successor while the handover runs, -1: none
+  AS_HandoverOut_t *handoverHead;   // records not written yet (the successor reads them at its pace)
+  AS_HandoverOut_t *handoverTail;
+  AS_ConnectedClients_t *handoverNext; // next client to send, the ones before it are handed over
+  int handoverSealed;       // all clients sent, registry and end record queued
+  int handoverOut;          // handoverSock is registered for EPOLLOUT
+  int handoverHooks;        // hook workers were stopped for the handover
+  long long handoverDeadline; // no progress until then: handover failed
   
   struct AS_Server_s *next;
 } AS_Server_t;
 
-typedef struct AS_ConnectedClients_s  { // server side: connected clients
-  int socket;
-  //struct sockaddr_storage sockaddr;
-  char name[AS_NAMELEN];
-  
-  struct AS_ConnectedClients_s *next;
-} AS_ConnectedClients_t;
+typedef struct AS_QueuedEvent_s { // client side: events waiting to be returned by AS_ClientEvent()
+  AS_ClientEvent_t *event;
+  int traced;         // frame was traced, hops are recorded when the event is returned
+  AS_Trace_t trace;
+  struct AS_QueuedEvent_s *next;
+} AS_QueuedEvent_t;
+
+typedef struct AS_Address_s { // one resolved address
+  int family;
+  socklen_t len;
+  struct sockaddr_storage addr;
+} AS_Address_t;
+
+typedef struct AS_Resolve_s { // getaddrinfo() running in a detached thread
+  pthread_mutex_t lock;
+  int done;       // result is ready
+  int cancelled;  // connection is gone, thread frees this job
+  int error;      // getaddrinfo() return value
+  char *host;
+  char *port;
+  AS_Address_t *addrs;  // alternating address families (happy eyeballs)
+  int addrNum;
+} AS_Resolve_t;
+
+typedef struct AS_Reassembly_s { // fragments of one source collected so far (client, server: frames of hooked types)
+  int source;
+  unsigned int payloadType;
+  unsigned int payloadLength;
+  unsigned int have;
+  char *payload;
+  struct AS_Reassembly_s *next;
+} AS_Reassembly_t;
+
+typedef struct AS_ResolverCache_s { // client side: resolved addresses of host:port, see AS_OptResolverTTL
+  char *host;
+  char *port;
+  AS_Address_t *addrs;
+  int addrNum;
+  long long expires;
+  struct AS_ResolverCache_s *next;
+} AS_ResolverCache_t;
+
+typedef struct AS_Call_s { // client side: request waiting for its response
+  int call;
+  int method;
+  int recipient;
+  struct AS_Connections_s *con;
+  AS_ResponseCallback_t callback; // NULL: response is queued as event
+  void *ctx;
+  AS_Timer_t timer;               // request timeout
+} AS_Call_t;
+
+#define AS_ConResolving 1
+#define AS_ConConnecting 2
+#define AS_ConWelcome 3      // TCP connected, waiting for AS_TypeClientID
+#define AS_ConEstablished 4
+#define AS_ConClosed 5       // lost or failed, conID stays valid until AS_ClientDisconnect
 
 typedef struct AS_Connections_s  {  // client side: outgoing connections
   int conID;
+  int state;                  // AS_Con...
+  int socket;                 // -1 if not connected (yet)
+  int id;                     // own client ID (from welcome message)
+  char *host;
+  char *port;
+  
+  // asynchronous connect
+  AS_Resolve_t *resolve;
+  AS_Address_t *addrs;
+  int addrNum;
+  int addrNext;               // next address to try
+  int *attempts;              // socket per address, -1: not tried / failed
+  long long nextAttempt;      // time to start next attempt in parallel
+  long long deadline;         // connect timeout
+  int connectDelay;           // ms, see AS_OptConnectDelay
+  
+  AS_InBuffer_t in;           // frame in progress
+  AS_OutQueue_t out;          // frames waiting to be sent
+  long long lastSend;         // time of last frame sent (heartbeats)
+  int heartbeat;              // ms, see AS_OptHeartbeat
+  int idleTimeout;            // ms, see AS_OptIdleTimeout
+  int readTimeout;            // ms, see AS_OptReadTimeout
+  AS_Timer_t timer;           // heartbeats and timeouts
+  AS_QueuedEvent_t *events;   // synthesized events (e.g. from presence frames)
+  AS_QueuedEvent_t *eventsLast;
+  AS_QueuedEvent_t *eventsPolled; // first event when AS_ClientPoll() returned this connection
+  AS_IdSet_t clients;         // local copy of the servers client list
+  int clientsVersion;         // version of local copy, -1: unknown (ask for complete list)
+  AS_Reassembly_t *fragments; // frames in progress, one per source
+  long long fragmentBytes;    // payload bytes allocated by fragments, counted against in.admit
+  AS_IdMap_t calls;           // requests waiting for a response: call ID -> AS_Call_t
+  int lastCall;               // call ID of last request
+  int traceSample;            // see AS_OptTraceSample
+  int traceCount;             // frames sent since last traced one
+  AS_Config_t config;         // options of this connection (socket knobs, limits)
+  
+  // datagram channel (AS_OptDatagram), frames flagged AS_TypeUnreliable use it once the server acknowledged the hello
+  int udp;                    // UDP socket connected to the server, -1: none
+  unsigned int udpToken;      // from AS_TypeDatagramOffer
+  int udpReady;               // hello acknowledged
+  long long udpHello;         // time of last hello
+  
+  // pooling: a pooled connection is hidden from the application, its channels share the socket
+  int pool;                   // 1: pooled connection
+  int channelsNum;
+  struct AS_Connections_s *channels[AS_CHANNEL_MAX+1];  // by channel number, [0] is unused
+  long long lingerUntil;      // pooled connection without channels is closed then
+  struct AS_Connections_s *link;  // channel: pooled connection carrying it, NULL otherwise
+  int channel;                // channel: number, 1..AS_CHANNEL_MAX
   
   struct AS_Connections_s *next;
 } AS_Connections_t;
@@ -65,8 +548,57 @@ typedef struct AS_Connections_s  {  // client side: outgoing connections
 //////////////////////////////
 
 int AS_initialized = 0;               // test if initialization is done
+int AS_Options[AS_OptNum] = {         // defaults for servers started afterwards
+  [AS_OptBacklog] = AS_BACKLOG,
+  [AS_OptAcceptThread] = 0,
+  [AS_OptHeartbeat] = 0,
+  [AS_OptIdleTimeout] = 0,
+  [AS_OptReadTimeout] = 0,
+  [AS_OptConnectTimeout] = 10000,
+  [AS_OptConnectDelay] = 250,
+  [AS_OptResolverTTL] = 30000,
+  [AS_OptPool] = 0,
+  [AS_OptPoolLinger] = 5000,
+  [AS_OptReadBudget] = 64*1024,
+  [AS_OptFrameBudget] = 64,
+  [AS_OptRateLimit] = 0,
+  [AS_OptRateBurst] = 0,
+  [AS_OptMailboxSegment] = 1024*1024,
+  [AS_OptMailboxSize] = 64*1024*1024,
+  [AS_OptMailboxAge] = 24*3600*1000,
+  [AS_OptMailboxQueue] = 4*1024*1024,
+  [AS_OptMailboxBatch] = 64,
+  [AS_OptNodeId] = 0,
+  [AS_OptTraceSample] = 0,
+  [AS_OptSendBuffer] = 0,
+  [AS_OptRecvBuffer] = 0,
+  [AS_OptNoDelay] = 0,
+  [AS_OptBusyPoll] = 0,
+  [AS_OptQuickAck] = 0,
+  [AS_OptAffinity] = 0,
+  [AS_OptMaxClients] = 0,
+  [AS_OptMaxPayload] = AS_MAXPAYLOAD,
+  [AS_OptReadBuffer] = AS_BUFFLEN,
+  [AS_OptHookWorkers] = 2,
+  [AS_OptDatagram] = 0,
+  [AS_OptClientMemory] = 0,
+  [AS_OptServerMemory] = 0,
+};
+char *AS_MailboxDir = NULL;           // server side: mailbox directory for servers started afterwards
+char *AS_HandoverDir = NULL;          // server side: handover socket directory for servers started afterwards
+char *AS_PeerSecret = NULL;           // server side: shared secret of the federation for servers started afterwards
+AS_RequestHandler_t AS_Handlers[AS_METHODS]; // server side: request handlers for servers started afterwards
+AS_Hook_t AS_Hooks[AS_HOOKS];         // server side: hooks for servers started afterwards
+char AS_HooksDirect[AS_HOOKS];        // server side: hook runs in the server thread
 AS_Server_t* AS_ServerList;           // server side: global server list (linked list)
 AS_Connections_t* AS_ConnectionList;  // client side: global connection list (linked list)
+AS_TimerWheel_t AS_ClientWheel;       // client side: heartbeats and timeouts of all connections
+AS_TimerWheel_t AS_CallWheel;         // client side: timeouts of requests
+int AS_ClientNextConID = 1;           // client side: conIDs are not reused
+int AS_ClientWakePipe[2];             // client side: wakes AS_ClientPoll() when a resolver thread is done
+AS_ResolverCache_t* AS_ResolverCache; // client side: recently resolved addresses (linked list)
+AS_Histogram_t AS_TraceHist[AS_HopNum]; // client side: latency of received traced frames per hop
+int AS_TraceCounter = 0;              // client side: frames sent since last traced one
 
 //////////////////////////////
 //    SUPPORT FUNCTIONS     //
@@ -84,9 +616,294 @@ double msec() {
   double time;
   
   gettimeofday(&tv, NULL);  // get current time
-  time = (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000;
+  time = tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0; // keep fractions of a millisecond
   return time;
 }
+
+long long AS_monotonicMsec()  { // milliseconds, not affected by changes of system time
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long AS_monotonicNsec()  { // nanoseconds, for tracing
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+unsigned long long AS_TickNow()  {
+  return AS_monotonicMsec() / AS_TICK;
+}
+
+void AS_TimerWheelInit(AS_TimerWheel_t *wheel) {
+  int level, slot;
+  wheel->now = AS_TickNow();
+  for(level = 0; level < AS_WheelLevels; level++)
+    for(slot = 0; slot < AS_WheelSlots; slot++)
+      wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+}
+
+void AS_TimerRemove(AS_Timer_t *timer)  {
+  if(timer->next == NULL)
+    return;
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+void AS_TimerAdd(AS_TimerWheel_t *wheel, AS_Timer_t *timer, unsigned long long expires)  {
+  // O(1): level is chosen by distance to expiry, far timers are moved down when their slot is reached
+  unsigned long long delta;
+  AS_Timer_t *head;
+  int level;
+  
+  AS_TimerRemove(timer);
+  if(expires <= wheel->now)
+    expires = wheel->now + 1;
+  delta = expires - wheel->now;
+  for(level = 0; level < AS_WheelLevels-1; level++)
+    if(delta < 1ULL << (AS_WheelBits * (level+1)))
+      break;
+  if(delta >= 1ULL << (AS_WheelBits * AS_WheelLevels)) // beyond range of wheel
+    expires = wheel->now + (1ULL << (AS_WheelBits * AS_WheelLevels)) - 1;
+  timer->expires = expires;
+  head = &wheel->slots[level][(expires >> (AS_WheelBits * level)) & (AS_WheelSlots-1)];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+void AS_TimerWheelAdvance(AS_TimerWheel_t *wheel, void (*callback)(void *ctx, AS_Timer_t *timer), void *ctx) {
+  // process all ticks up to now, callback may add the timer again
+  unsigned long long target = AS_TickNow();
+  AS_Timer_t list, *timer, *head;
+  int level;
+  
+  while(wheel->now < target) {
+    wheel->now++;
+    // cascade: move timers of higher levels down once their slot is reached
+    for(level = AS_WheelLevels-1; level > 0; level--)  {
+      if(wheel->now & ((1ULL << (AS_WheelBits * level)) - 1))
+        continue;
+      head = &wheel->slots[level][(wheel->now >> (AS_WheelBits * level)) & (AS_WheelSlots-1)];
+      while((timer = head->next) != head)
+        AS_TimerAdd(wheel, timer, timer->expires);
+    }
+    // expire level 0 slot, detach list first (callback may add timers again)
+    head = &wheel->slots[0][wheel->now & (AS_WheelSlots-1)];
+    if(head->next == head)
+      continue;
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = list.prev->next = &list;
+    head->next = head->prev = head;
+    while((timer = list.next) != &list) {
+      AS_TimerRemove(timer);
+      callback(ctx, timer);
+    }
+  }
+}
+
+unsigned long long AS_TimerTick(long long time) { // first tick at or after time (ms)
+  return (time + AS_TICK - 1) / AS_TICK;
+}
+
+unsigned long long AS_TimerNext(long long last, int interval, unsigned long long next) {
+  // earlier one of next and tick at last + interval (interval 0: not used)
+  unsigned long long tick;
+  if(!interval || !last)
+    return next;
+  tick = AS_TimerTick(last + interval);
+  return tick < next ? tick : next;
+}
+
+#define AS_IdMapEmpty INT_MIN
+#define AS_IdMapDeleted (INT_MIN+1)
+
+static unsigned int AS_IdHash(int id) { // spread sequential ids (fds) over the table
+  unsigned int h = (unsigned int)id;
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+int AS_HistIndex(long long value)  {
+  // values below 2^AS_HistSubBits have their own bucket, above each power of two is split linearly
+  int exponent, shift;
+  if(value < (1 << AS_HistSubBits))
+    return value;
+  if(value >= 1LL << AS_HistMaxBits)
+    value = (1LL << AS_HistMaxBits) - 1;
+  exponent = 63 - __builtin_clzll(value);
+  shift = exponent - AS_HistSubBits;
+  return ((shift + 1) << AS_HistSubBits) + (int)(value >> shift) - (1 << AS_HistSubBits);
+}
+
+long long AS_HistValue(int index) {
+  // middle of bucket index
+  int shift;
+  if(index < (1 << AS_HistSubBits))
+    return index;
+  shift = (index >> AS_HistSubBits) - 1;
+  return ((long long)((index & ((1 << AS_HistSubBits) - 1)) + (1 << AS_HistSubBits)) << shift) + (1LL << shift) / 2;
+}
+
+void AS_HistRecord(AS_Histogram_t *hist, long long value) {
+  if(value < 0) // clocks of different hosts
+    return;
+  hist->counts[AS_HistIndex(value)]++;
+  if(!hist->count || value < hist->min)
+    hist->min = value;
+  if(value > hist->max)
+    hist->max = value;
+  hist->count++;
+  hist->sum += value;
+}
+
+long long AS_HistQuantile(AS_Histogram_t *hist, double quantile)  {
+  long long rank, seen = 0;
+  int i;
+  rank = (long long)(quantile * hist->count);
+  if(rank >= hist->count)
+    rank = hist->count - 1;
+  for(i = 0; i < AS_HistBuckets; i++) {
+    seen += hist->counts[i];
+    if(seen > rank)
+      break;
+  }
+  if(i == AS_HistBuckets)
+    return hist->max;
+  return AS_HistValue(i) < hist->max ? AS_HistValue(i) : hist->max;
+}
+
+static void AS_IdMapResize(AS_IdMap_t *map, int size) {
+  int *keys = map->keys;
+  void **values = map->values;
+  int oldSize = map->size;
+  int i, j;
+  
+  map->keys = malloc(size * sizeof(int));
+  map->values = calloc(size, sizeof(void *));
+  for(i = 0; i < size; i++)
+    map->keys[i] = AS_IdMapEmpty;
+  map->size = size;
+  map->num = 0;
+  map->used = 0;
+  for(i = 0; i < oldSize; i++)  { // re-insert old entries, drops deleted slots
+    if(keys[i] < 0)
+      continue;
+    j = AS_IdHash(keys[i]) & (size-1);
+    while(map->keys[j] != AS_IdMapEmpty)
+      j = (j+1) & (size-1);
+    map->keys[j] = keys[i];
+    map->values[j] = values[i];
+    map->num++;
+    map->used++;
+  }
+  free(keys);
+  free(values);
+}
+
+static int AS_IdMapSlot(AS_IdMap_t *map, int id) { // slot of id or -1
+  int i;
+  if(!map->size)
+    return -1;
+  i = AS_IdHash(id) & (map->size-1);
+  while(map->keys[i] != AS_IdMapEmpty)  {
+    if(map->keys[i] == id)
+      return i;
+    i = (i+1) & (map->size-1);
+  }
+  return -1;
+}
+
+void* AS_IdMapGet(AS_IdMap_t *map, int id)  {
+  int i = AS_IdMapSlot(map, id);
+  return i < 0 ? NULL : map->values[i];
+}
+
+void AS_IdMapPut(AS_IdMap_t *map, int id, void *value)  {
+  int i, size;
+  if((i = AS_IdMapSlot(map, id)) >= 0)  { // already present -> overwrite
+    map->values[i] = value;
+    return;
+  }
+  if((map->used+1)*4 >= map->size*3)  { // keep load factor below 0.75
+    for(size = 16; size < (map->num+1)*4; size *= 2);
+    AS_IdMapResize(map, size);
+  }
+  i = AS_IdHash(id) & (map->size-1);
+  while(map->keys[i] >= 0)  // reuse first empty or deleted slot
+    i = (i+1) & (map->size-1);
+  if(map->keys[i] == AS_IdMapEmpty)
+    map->used++;
+  map->keys[i] = id;
+  map->values[i] = value;
+  map->num++;
+}
+
+void AS_IdMapRemove(AS_IdMap_t *map, int id)  {
+  int i = AS_IdMapSlot(map, id);
+  if(i < 0)
+    return;
+  map->keys[i] = AS_IdMapDeleted;
+  map->values[i] = NULL;
+  map->num--;
+}
+
+void AS_IdMapFree(AS_IdMap_t *map)  {
+  free(map->keys);
+  free(map->values);
+  memset(map, 0, sizeof(AS_IdMap_t));
+}
+
+int AS_IdSetContains(AS_IdSet_t *set, int id) {
+  return AS_IdMapGet(&set->index, id) != NULL;
+}
+
+int AS_IdSetAdd(AS_IdSet_t *set, int id)  { // returns 1 if id was added, 0 if already present
+  if(AS_IdSetContains(set, id))
+    return 0;
+  if(set->num == set->size) {
+    set->size = set->size ? set->size*2 : 16;
+    set->ids = realloc(set->ids, set->size * sizeof(int));
+  }
+  set->ids[set->num] = id;
+  set->num++;
+  AS_IdMapPut(&set->index, id, (void *)(intptr_t)set->num);
+  return 1;
+}
+
+int AS_IdSetRemove(AS_IdSet_t *set, int id)  { // returns 1 if id was removed, 0 if not present
+  int pos = (int)(intptr_t)AS_IdMapGet(&set->index, id);
+  if(!pos)
+    return 0;
+  // move last id into the gap
+  set->num--;
+  if(pos-1 != set->num) {
+    set->ids[pos-1] = set->ids[set->num];
+    AS_IdMapPut(&set->index, set->ids[pos-1], (void *)(intptr_t)pos);
+  }
+  AS_IdMapRemove(&set->index, id);
+  return 1;
+}
+
+void AS_IdSetClear(AS_IdSet_t *set) {
+  int i;
+  for(i = 0; i < set->num; i++)
+    AS_IdMapRemove(&set->index, set->ids[i]);
+  set->num = 0;
+}
+
+void AS_IdSetFree(AS_IdSet_t *set)  {
+  free(set->ids);
+  AS_IdMapFree(&set->index);
+  memset(set, 0, sizeof(AS_IdSet_t));
+}
+
 //////////////////////////////
 //        FUNCTIONS         //
 //////////////////////////////
@@ -95,6 +912,10 @@ int AS_init() {
   if(!AS_initialized) {
     AS_ServerList = calloc(1, sizeof(AS_Server_t));
     AS_ConnectionList = calloc(1, sizeof(AS_Connections_t));
+    AS_ResolverCache = calloc(1, sizeof(AS_ResolverCache_t));
+    AS_TimerWheelInit(&AS_ClientWheel);
+    AS_TimerWheelInit(&AS_CallWheel);
+    pipe2(AS_ClientWakePipe, O_NONBLOCK | O_CLOEXEC);
     AS_initialized = 1;
   }
 }
@@ -103,14 +924,127 @@ int AS_version() {
   return AS_VERSION;
 }
 
+int AS_SetOption(int option, int value) {
+  if(option < 0 || option >= AS_OptNum || value < 0) {
+    fprintf(stderr, "error: AS_SetOption(%d, %d): invalid option or value\n", option, value);
+    return 0;
+  }
+  AS_Options[option] = value;
+  return 1;
+}
+
+int AS_SetMailbox(char *dir)  {
+  free(AS_MailboxDir);
+  AS_MailboxDir = dir != NULL ? strdup(dir) : NULL;
+  return 1;
+}
+
+int AS_SetHandover(char *dir)  {
+  free(AS_HandoverDir);
+  AS_HandoverDir = dir != NULL ? strdup(dir) : NULL;
+  return 1;
+}
+
+int AS_SetPeerSecret(char *secret)  {
+  if(secret != NULL && (strlen(secret) == 0 || strlen(secret) > AS_SECRET_MAX))
+    return 0;
+  free(AS_PeerSecret);
+  AS_PeerSecret = secret != NULL ? strdup(secret) : NULL;
+  return 1;
+}
+
+int AS_TraceGet(int hop, AS_TraceStats_t *stats)  {
+  AS_Histogram_t *hist;
+  if(hop < 0 || hop >= AS_HopNum || stats == NULL)
+    return 0;
+  hist = &AS_TraceHist[hop];
+  memset(stats, 0, sizeof(AS_TraceStats_t));
+  if(!hist->count)
+    return 0;
+  stats->count = hist->count;
+  stats->min = hist->min;
+  stats->max = hist->max;
+  stats->mean = hist->sum / hist->count;
+  stats->p50 = AS_HistQuantile(hist, 0.5);
+  stats->p90 = AS_HistQuantile(hist, 0.9);
+  stats->p99 = AS_HistQuantile(hist, 0.99);
+  stats->p999 = AS_HistQuantile(hist, 0.999);
+  return hist->count;
+}
+
+int AS_TraceReset() {
+  memset(AS_TraceHist, 0, sizeof(AS_TraceHist));
+  return 1;
+}
+
+void AS_TraceDeliver(AS_Trace_t *trace) {
+  // traced frame reaches the application, all timestamps are known now
+  long long now = AS_monotonicNsec();
+  if(trace->receive && trace->forward)  { // not set if the frame did not pass a server that traces
+    AS_HistRecord(&AS_TraceHist[AS_HopSend], trace->receive - trace->send);
+    AS_HistRecord(&AS_TraceHist[AS_HopServer], trace->forward - trace->receive);
+    AS_HistRecord(&AS_TraceHist[AS_HopDeliver], now - trace->forward);
+  }
+  AS_HistRecord(&AS_TraceHist[AS_HopTotal], now - trace->send);
+}
+
+int AS_SetHandler(int method, AS_RequestHandler_t handler)  {
+  if(method <= 0 || method >= AS_METHODS) {
+    fprintf(stderr, "error: AS_SetHandler(%d): invalid method\n", method);
+    return 0;
+  }
+  AS_Handlers[method] = handler;
+  return 1;
+}
+
+int AS_SetHook(int type, AS_Hook_t hook, int direct)  {
+  if(type < AS_TypeMessage || type >= AS_HOOKS) { // frames handled by the library itself have no hooks
+    fprintf(stderr, "error: AS_SetHook(%d): invalid type\n", type);
+    return 0;
+  }
+  AS_Hooks[type] = hook;
+  AS_HooksDirect[type] = direct ? 1 : 0;
+  return 1;
+}
+
+int AS_GetOption(int option) {
+  if(option < 0 || option >= AS_OptNum)
+    return -1;
+  return AS_Options[option];
+}
+
+void AS_ConfigInit(AS_Config_t *config) {
+  memcpy(config->option, AS_Options, sizeof(AS_Options));
+}
+
+int AS_ConfigSet(AS_Config_t *config, int option, int value)  {
+  if(option < 0 || option >= AS_OptNum || value < 0) {
+    fprintf(stderr, "error: AS_ConfigSet(%d, %d): invalid option or value\n", option, value);
+    return 0;
+  }
+  config->option[option] = value;
+  return 1;
+}
+
+int AS_waitSocket(int sock, short events)  { // wait until non-blocking socket is ready again
+  struct pollfd pfd;
+  pfd.fd = sock;
+  pfd.events = events;
+  return poll(&pfd, 1, -1);
+}
+
 int AS_sendAll(int sock, void *buf, int len)  { // replaces send(), sends in multiple steps if necessary
   //fprintf(stderr, "send %d bytes to %d\n", len, sock);
   int total = 0;        // bytes sent
   int bytesleft = len;  // bytes left
   int n;                // bytes send per call
   while(total < len) {
-    n = send(sock, buf+total, bytesleft, 0);
-    if (n == -1) { break; } // error
+    n = send(sock, buf+total, bytesleft, MSG_NOSIGNAL);
+    if (n == -1) {
+      if((errno == EAGAIN || errno == EWOULDBLOCK) && AS_waitSocket(sock, POLLOUT) > 0)
+        continue; // non-blocking socket is full
+      break;  // error
+    }
     total += n;
     bytesleft -= n;
   }
@@ -123,624 +1057,4657 @@ int AS_receiveAll(int sock, void *buf, int len)  {
   int n;                // bytes received per call
   while(total < len) {
     n = recv(sock, buf+total, bytesleft, 0);
-    if (n == -1) { break; } // error
+    if (n == -1) {
+      if((errno == EAGAIN || errno == EWOULDBLOCK) && AS_waitSocket(sock, POLLIN) > 0)
+        continue; // non-blocking socket, rest of data not there yet
+      break;  // error
+    }
+    if (n == 0) { break; } // connection closed
     total += n;
     bytesleft -= n;
   }
   return total; // return -1 on failure, 0 on success
 }
 
-//////////////////////////////
-//          SERVER          //
-//////////////////////////////
-
-int AS_ServerIsRunning(int port)  {
-  if(!AS_initialized) AS_init();
-  
-  AS_Server_t* server = AS_ServerList;
-  while(server->next != NULL) {
-    server = server->next;
-    if(server->port == port)  
-      return 1;
+int AS_FramePriority(unsigned int type) {
+  type &= ~(AS_TypeTraced | AS_TypeUnreliable);
+  switch(type)  {
+    case AS_TypeFileData:
+    case AS_TypeFragment:
+      return AS_PrioBulk;
+    case AS_TypeMessage:
+    case AS_TypeFileRequest:
+    case AS_TypeFileAnswer:
+      return AS_PrioInteractive;
   }
-  return 0;
+  return type < AS_TypeMessage ? AS_PrioControl : AS_PrioInteractive;
 }
 
-int AS_ServerPrintRunning() {
-  if(!AS_initialized) AS_init();
+AS_Buffer_t* AS_BufferNew(int len)  {
+  AS_Buffer_t *buffer = malloc(sizeof(AS_Buffer_t) + len);
+  buffer->refs = 1;
+  buffer->len = len;
+  return buffer;
+}
+
+AS_Buffer_t* AS_BufferFrame(AS_MessageHeader_t *header, void *payload)  { // copy header + payload into new buffer
+  AS_Buffer_t *buffer = AS_BufferNew(sizeof(AS_MessageHeader_t) + header->payloadLength);
+  memcpy(buffer->data, header, sizeof(AS_MessageHeader_t));
+  if(header->payloadLength)
+    memcpy(buffer->data + sizeof(AS_MessageHeader_t), payload, header->payloadLength);
+  return buffer;
+}
+
+void AS_BufferRelease(AS_Buffer_t *buffer)  {
+  if(buffer != NULL && --buffer->refs == 0)
+    free(buffer);
+}
+
+AS_Buffer_t* AS_BufferFragment(AS_MessageHeader_t *header, void *payload, unsigned int *offset)  {
+  // next buffer of a frame starting at payload *offset, *offset is advanced
+  // bulk payloads larger than AS_FRAGMENT are split into AS_TypeFragment frames, all others are copied as one buffer
+  AS_MessageHeader_t *fragHeader;
+  AS_Fragment_t *fragment;
+  AS_Buffer_t *buffer;
+  unsigned int len;
   
-  int count = 0;
-  printf("All running AS_Server in this process:\n");
-  AS_Server_t* server = AS_ServerList;
-  while(server->next != NULL) {
-    count++;
-    server = server->next;
-    printf("  server on port %d: running = %d, clientsNum = %d, stop = %d\n", server->port, server->running, server->clientsNum, server->stop);
+  if(header->payloadType == AS_TypeFragment || header->payloadLength <= AS_FRAGMENT || AS_FramePriority(header->payloadType) != AS_PrioBulk)  {
+    *offset = header->payloadLength;
+    return AS_BufferFrame(header, payload);
   }
-  if(!count)
-    printf("  no AS_Server running in this process\n");
-  return 0;
+  len = header->payloadLength - *offset;
+  if(len > AS_FRAGMENT)
+    len = AS_FRAGMENT;
+  buffer = AS_BufferNew(sizeof(AS_MessageHeader_t) + sizeof(AS_Fragment_t) + len);
+  fragHeader = (AS_MessageHeader_t *)buffer->data;
+  *fragHeader = *header;
+  fragHeader->payloadType = AS_TypeFragment;
+  fragHeader->payloadLength = sizeof(AS_Fragment_t) + len;
+  fragment = (AS_Fragment_t *)(fragHeader + 1);
+  fragment->payloadType = header->payloadType;
+  fragment->payloadLength = header->payloadLength;
+  fragment->offset = *offset;
+  memcpy(fragment + 1, payload + *offset, len);
+  *offset += len;
+  return buffer;
 }
 
-void* AS_ServerThread(void *arg) {
-  AS_Server_t* server = arg;
-  fprintf(stderr, "AS_ServerThread(%d)\n", server->port);
+int AS_FragmentValid(AS_MessageHeader_t *header, void *payload)  {
+  // 1: fragment header is in range and carries a part of a bulk data frame (never a control frame or another fragment)
+  AS_Fragment_t *fragment = payload;
+  unsigned int type;
   
-  // start server now
-  struct addrinfo *ai_hints, *ai_res, *ai_p;
-  int rv, sock_server, sockmax, i, sock_remote;
-  char portstr[6];
-  char ipstr[INET6_ADDRSTRLEN]; 
-  fd_set fds_master, fds_read;
-  struct timeval timeout;
-  struct sockaddr_storage sockaddr_remote; // IP agnostic instead of using sockaddr_in
-  socklen_t sockaddr_size;
-  AS_MessageHeader_t *header; // message header pointer
-  AS_ConnectedClients_t *newClient;  // adding new client
-  AS_ConnectedClients_t *AS_ConnectedClientList;  // root element
-  AS_ConnectedClients_t *client, *lastClient; // iteration elements
-  void *buffer;
-  void *payload;
-  int *tmpPI;
-  int len;
+  if(header->payloadLength < sizeof(AS_Fragment_t))
+    return 0;
+  type = fragment->payloadType & ~(AS_TypeTraced | AS_TypeUnreliable);
+  if(type == AS_TypeFragment || AS_FramePriority(type) != AS_PrioBulk || fragment->payloadLength > AS_PAYLOAD_MAX)
+    return 0;
+  return fragment->offset <= fragment->payloadLength && header->payloadLength - sizeof(AS_Fragment_t) <= fragment->payloadLength - fragment->offset;
+}
+
+void AS_OutQueuePush(AS_OutQueue_t *queue, AS_Buffer_t *buffer) { // queue takes an additional reference
+  AS_OutFrame_t *frame = calloc(1, sizeof(AS_OutFrame_t));
+  AS_OutLane_t *lane;
+  buffer->refs++;
+  frame->buffer = buffer;
+  lane = &queue->lanes[AS_FramePriority(((AS_MessageHeader_t *)buffer->data)->payloadType)];
+  if(lane->tail != NULL)
+    lane->tail->next = frame;
+  else
+    lane->head = frame;
+  lane->tail = frame;
+  queue->bytes += buffer->len;
+  if(queue->account != NULL)
+    *queue->account += buffer->len;
+}
+
+AS_OutFrame_t* AS_OutQueueNext(AS_OutQueue_t *queue)  {
+  // take next frame to be scheduled: control first, interactive and bulk weighted
+  AS_OutLane_t *lane;
+  AS_OutFrame_t *frame;
   
-  ai_hints = calloc(1, sizeof(struct addrinfo));
+  if(queue->lanes[AS_PrioControl].head != NULL)  {
+    lane = &queue->lanes[AS_PrioControl];
+  } else if(queue->lanes[AS_PrioInteractive].head != NULL &&
+            (queue->lanes[AS_PrioBulk].head == NULL || queue->credit < AS_WeightInteractive)) {
+    lane = &queue->lanes[AS_PrioInteractive];
+    queue->credit++;
+  } else if(queue->lanes[AS_PrioBulk].head != NULL) {
+    lane = &queue->lanes[AS_PrioBulk];
+    queue->credit = 0;
+  } else  {
+    return NULL;
+  }
+  frame = lane->head;
+  lane->head = frame->next;
+  if(lane->head == NULL)
+    lane->tail = NULL;
+  frame->next = NULL;
+  return frame;
+}
+
+int AS_OutQueueFlush(int sock, AS_OutQueue_t *queue)  {
+  // write as much as possible without blocking
+  // returns -1 on error (connection lost), otherwise 0
+  struct iovec iov[64];
+  struct msghdr msg;
+  AS_OutFrame_t *frame;
+  int num, n;
   
-  ai_hints->ai_socktype = SOCK_STREAM;  // TCP
-  ai_hints->ai_flags    = AI_PASSIVE;   // fill in the IP for me please
-  // AddressFamily:
-  switch(server->IPv) {
-    case AS_IPv4:
-      ai_hints->ai_family = AF_INET;
-      break;
-    case AS_IPv6:
-      ai_hints->ai_family = AF_INET6;
+  while(1)  {
+    // schedule frames by priority, only a small window is fixed in wire order
+    while(queue->wireBytes < AS_WireWindow && (frame = AS_OutQueueNext(queue)) != NULL)  {
+      if(queue->tail != NULL)
+        queue->tail->next = frame;
+      else
+        queue->head = frame;
+      queue->tail = frame;
+      queue->wireBytes += frame->buffer->len;
+    }
+    if(queue->head == NULL)
       break;
-    case AS_IPunspec:
-    default:
-      ai_hints->ai_family = AF_UNSPEC;
+    // gather up to 64 frames into one sendmsg()
+    num = 0;
+    for(frame = queue->head; frame != NULL && num < 64; frame = frame->next)  {
+      iov[num].iov_base = frame->buffer->data + frame->sent;
+      iov[num].iov_len = frame->buffer->len - frame->sent;
+      num++;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = num;
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if(n == -1) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0; // socket full, try again when writable
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    queue->bytes -= n;
+    queue->wireBytes -= n;
+    if(queue->account != NULL)
+      *queue->account -= n;
+    // remove completely sent frames
+    while(n > 0)  {
+      frame = queue->head;
+      if(n < frame->buffer->len - frame->sent)  {
+        frame->sent += n;
+        break;
+      }
+      n -= frame->buffer->len - frame->sent;
+      queue->head = frame->next;
+      if(queue->head == NULL)
+        queue->tail = NULL;
+      AS_BufferRelease(frame->buffer);
+      free(frame);
+    }
+  }
+  return 0;
+}
+
+void AS_OutFramesFree(AS_OutFrame_t *frame) {
+  AS_OutFrame_t *next;
+  while(frame != NULL)  {
+    next = frame->next;
+    AS_BufferRelease(frame->buffer);
+    free(frame);
+    frame = next;
+  }
+}
+
+void AS_OutQueueClear(AS_OutQueue_t *queue) {
+  long long *account = queue->account;
+  int i;
+  AS_OutFramesFree(queue->head);
+  for(i = 0; i < AS_PrioNum; i++)
+    AS_OutFramesFree(queue->lanes[i].head);
+  if(account != NULL)
+    *account -= queue->bytes;
+  memset(queue, 0, sizeof(AS_OutQueue_t));
+  queue->account = account;
+}
+
+void AS_SocketOptions(int sock, int *options)  {
+  // socket knobs of a new connection (AS_Opt...), kernel defaults unless set
+  int value;
+  // keep unsent data in the lanes instead of the kernel, otherwise it is sent first-in first-out
+  value = AS_WireWindow;
+  setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof(value));
+  if(options[AS_OptSendBuffer])
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &options[AS_OptSendBuffer], sizeof(int));
+  if(options[AS_OptRecvBuffer])
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &options[AS_OptRecvBuffer], sizeof(int));
+  if(options[AS_OptNoDelay])  {
+    value = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+  }
+  if(options[AS_OptBusyPoll])
+    setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &options[AS_OptBusyPoll], sizeof(int));
+}
+
+void AS_InBufferInit(AS_InBuffer_t *in, int *options) {
+  // receive buffer is allocated with the first read
+  in->size = options[AS_OptReadBuffer] >= sizeof(AS_MessageHeader_t) ? options[AS_OptReadBuffer] : AS_BUFFLEN;
+  in->maxPayload = options[AS_OptMaxPayload] && options[AS_OptMaxPayload] < AS_PAYLOAD_MAX ? options[AS_OptMaxPayload] : AS_PAYLOAD_MAX;
+  // queued frames are not counted here, the queue of a server connection is limited by dropping frames for it
+  in->admit = -1;
+  if(options[AS_OptClientMemory])
+    in->admit = options[AS_OptClientMemory] > in->size ? options[AS_OptClientMemory] - in->size : 0;
+  in->quickAck = options[AS_OptQuickAck];
+}
+
+long long AS_ConnectionMemory(AS_InBuffer_t *in, AS_OutQueue_t *out) {
+  // bytes used by one connection: receive buffer, frame in progress and queued frames
+  return (in->data != NULL ? in->size : 0) + (in->haveHeader ? in->header.payloadLength : 0) + out->bytes;
+}
+
+void AS_SetAffinity(int mask) {
+  // bind calling thread to the CPUs of mask (AS_OptAffinity)
+  cpu_set_t set;
+  int cpu;
+  if(!mask)
+    return;
+  CPU_ZERO(&set);
+  for(cpu = 0; cpu < 31; cpu++)
+    if(mask & (1 << cpu))
+      CPU_SET(cpu, &set);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    fprintf(stderr, "error: could not set CPU affinity %x\n", mask);
+}
+
+int AS_ReceiveFrame(int sock, AS_InBuffer_t *in, AS_MessageHeader_t *header, void **payload, int *budget) {
+  // read from non-blocking socket until a complete frame is available
+  // budget: bytes recv() may read, decreased by bytes read (NULL: unlimited)
+  // returns 1: frame in header/payload (payload is taken over by caller, NULL if empty, '\0' terminated)
+  //         0: no complete frame yet, -1: connection closed or error, -2: protocol error
+  //         -3: payload larger than allowed (AS_OptMaxPayload or memory budget), nothing was allocated
+  //         2: budget used up, more data might be waiting
+  int n;
+  unsigned int len;
+  
+  if(in->data == NULL)  {
+    if(!in->size)
+      in->size = AS_BUFFLEN;
+    in->data = malloc(in->size);
+    if(in->account != NULL)
+      *in->account += in->size;
+  }
+  while(1)  {
+    if(!in->haveHeader && in->end - in->start >= sizeof(AS_MessageHeader_t)) {
+      memcpy(&in->header, in->data + in->start, sizeof(AS_MessageHeader_t));
+      in->start += sizeof(AS_MessageHeader_t);
+      if(in->header.as_identifier != 144)
+        return -2;
+      if(in->header.payloadLength > in->maxPayload || (in->admit >= 0 && in->header.payloadLength > in->admit))
+        return -3; // refuse to allocate
+      in->haveHeader = 1;
+      in->payloadHave = 0;
+      in->payload = NULL;
+      if(in->header.payloadLength)  {
+        in->payload = malloc(in->header.payloadLength + 1);
+        if(in->payload == NULL)
+          return -2;
+        in->payload[in->header.payloadLength] = '\0';
+        if(in->account != NULL)
+          *in->account += in->header.payloadLength;
+      }
+    }
+    if(in->haveHeader)  {
+      // take payload bytes from buffer
+      len = in->header.payloadLength - in->payloadHave;
+      n = in->end - in->start;
+      if(n > len)
+        n = len;
+      memcpy(in->payload + in->payloadHave, in->data + in->start, n);
+      in->payloadHave += n;
+      in->start += n;
+      if(in->payloadHave == in->header.payloadLength) { // frame complete
+        if(in->account != NULL) // payload belongs to the caller now
+          *in->account -= in->header.payloadLength;
+        *header = in->header;
+        *payload = in->payload;
+        in->haveHeader = 0;
+        in->payload = NULL;
+        in->frameStart = in->start < in->end ? AS_monotonicMsec() : 0;
+        return 1;
+      }
+    }
+    
+    // need more data
+    if(in->start == in->end)
+      in->start = in->end = 0;
+    else if(in->start > in->size/2) { // move rest to front
+      memmove(in->data, in->data + in->start, in->end - in->start);
+      in->end -= in->start;
+      in->start = 0;
+    }
+    if(budget != NULL && *budget <= 0)
+      return 2;
+    if(in->haveHeader && in->header.payloadLength - in->payloadHave >= in->size)  {
+      // large payload: receive directly, no copy
+      len = in->header.payloadLength - in->payloadHave;
+      if(budget != NULL && len > *budget)
+        len = *budget;
+      n = recv(sock, in->payload + in->payloadHave, len, 0);
+      if(n > 0)
+        in->payloadHave += n;
+    } else  {
+      len = in->size - in->end;
+      if(budget != NULL && len > *budget)
+        len = *budget;
+      n = recv(sock, in->data + in->end, len, 0);
+      if(n > 0)
+        in->end += n;
+    }
+    if(n > 0 && budget != NULL)
+      *budget -= n;
+    if(n == 0)
+      return -1; // connection closed
+    if(n == -1) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    if(in->quickAck)  { // reset by the kernel, set again after each read
+      n = 1;
+      setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &n, sizeof(n));
+    }
+    in->lastRecv = AS_monotonicMsec();
+    if(!in->frameStart)
+      in->frameStart = in->lastRecv;
+  }
+}
+
+void AS_InBufferFree(AS_InBuffer_t *in) {
+  if(in->account != NULL)
+    *in->account -= (in->data != NULL ? in->size : 0) + (in->haveHeader ? in->header.payloadLength : 0);
+  free(in->data);
+  free(in->payload);
+  memset(in, 0, sizeof(AS_InBuffer_t));
+}
+
+//////////////////////////////
+//         MAILBOX          //
+//////////////////////////////
+
+// store-and-forward: frames for named clients that are offline (or too slow) are appended to
+// <dir>/<port>/<name>/<firstSeq>.log (mapped segments, index in <firstSeq>.idx) by the mailbox thread
+// and replayed in batches when the client is back
+
+void AS_ServerSend(AS_Server_t *server, AS_ConnectedClients_t *client, AS_Buffer_t *buffer);
+void AS_HandoverForward(AS_Server_t *server, AS_ConnectedClients_t *client, AS_Buffer_t *buffer);
+
+long long AS_wallMsec() { // wall clock in ms, mailbox retention survives restarts
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int AS_MailboxNameValid(char *name, int len)  {
+  int i;
+  if(len < 1 || len >= AS_NAMELEN || name[0] == '.')
+    return 0;
+  for(i = 0; i < len && name[i] != '\0'; i++)
+    if(!((name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') || (name[i] >= '0' && name[i] <= '9') ||
+         name[i] == '_' || name[i] == '-' || name[i] == '.'))
+      return 0;
+  return i > 0;
+}
+
+AS_Segment_t* AS_SegmentMap(AS_Mailbox_t *box, unsigned long long firstSeq, unsigned int size) {
+  // map segment and index files, size 0: existing segment
+  AS_Segment_t *segment;
+  char file[PATH_MAX];
+  struct stat st;
+  int fd, idx;
+  
+  snprintf(file, sizeof(file), "%s/%020llu.log", box->path, firstSeq);
+  fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  snprintf(file, sizeof(file), "%s/%020llu.idx", box->path, firstSeq);
+  idx = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd == -1 || idx == -1 || fstat(fd, &st) == -1)  {
+    perror("mailbox: open");
+    if(fd != -1) close(fd);
+    if(idx != -1) close(idx);
+    return NULL;
+  }
+  if(size == 0)
+    size = st.st_size;
+  if(size < sizeof(AS_SegmentHeader_t) || (st.st_size == 0 && ftruncate(fd, size) == -1))  {
+    close(fd);
+    close(idx);
+    return NULL;
+  }
+  segment = calloc(1, sizeof(AS_Segment_t));
+  segment->firstSeq = firstSeq;
+  segment->size = size;
+  segment->indexNum = size / (sizeof(AS_MailboxRecord_t) + sizeof(AS_MessageHeader_t)) + 1;
+  ftruncate(idx, segment->indexNum * sizeof(unsigned int));
+  segment->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  segment->index = mmap(NULL, segment->indexNum * sizeof(unsigned int), PROT_READ | PROT_WRITE, MAP_SHARED, idx, 0);
+  close(fd);  // mappings stay valid
+  close(idx);
+  if(segment->header == MAP_FAILED || segment->index == MAP_FAILED) {
+    perror("mailbox: mmap");
+    if(segment->header != MAP_FAILED) munmap(segment->header, size);
+    if(segment->index != MAP_FAILED) munmap(segment->index, segment->indexNum * sizeof(unsigned int));
+    free(segment);
+    return NULL;
+  }
+  if(segment->header->end == 0) { // new segment
+    segment->header->firstSeq = firstSeq;
+    segment->header->end = sizeof(AS_SegmentHeader_t);
+  }
+  box->bytes += size;
+  return segment;
+}
+
+void AS_SegmentUnmap(AS_Mailbox_t *box, AS_Segment_t *segment, int delete)  {
+  char file[PATH_MAX];
+  munmap(segment->header, segment->size);
+  munmap(segment->index, segment->indexNum * sizeof(unsigned int));
+  box->bytes -= segment->size;
+  if(delete)  {
+    snprintf(file, sizeof(file), "%s/%020llu.log", box->path, segment->firstSeq);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s/%020llu.idx", box->path, segment->firstSeq);
+    unlink(file);
+  }
+  free(segment);
+}
+
+AS_Mailbox_t* AS_MailboxOpen(AS_Server_t *server, char *name)  {
+  // open mailbox of name, existing segments are mapped again (e.g. after restart)
+  AS_Mailbox_t *box;
+  AS_Segment_t *segment, **insert;
+  struct dirent *entry;
+  char file[PATH_MAX];
+  unsigned long long seq;
+  DIR *dir;
+  int fd;
+  
+  for(box = server->mailboxes; box != NULL; box = box->next)
+    if(strcmp(box->name, name) == 0)
+      return box;
+  
+  box = calloc(1, sizeof(AS_Mailbox_t));
+  box->name = strdup(name);
+  snprintf(file, sizeof(file), "%s/%d", server->mailboxDir, server->port);
+  mkdir(server->mailboxDir, 0755);
+  mkdir(file, 0755);
+  box->path = malloc(strlen(file) + strlen(name) + 2);
+  sprintf(box->path, "%s/%s", file, name);
+  mkdir(box->path, 0755);
+  
+  if((dir = opendir(box->path)) != NULL)  {
+    while((entry = readdir(dir)) != NULL) {
+      if(strlen(entry->d_name) != 24 || strcmp(entry->d_name + 20, ".log") != 0)
+        continue;
+      seq = strtoull(entry->d_name, NULL, 10);
+      if((segment = AS_SegmentMap(box, seq, 0)) == NULL)
+        continue;
+      for(insert = &box->segments; *insert != NULL && (*insert)->firstSeq < seq; insert = &(*insert)->next);
+      segment->next = *insert;
+      *insert = segment;
+    }
+    closedir(dir);
+  }
+  snprintf(file, sizeof(file), "%s/cursor", box->path);
+  if((fd = open(file, O_RDONLY | O_CLOEXEC)) != -1) {
+    if(read(fd, &box->delivered, sizeof(box->delivered)) != sizeof(box->delivered))
+      box->delivered = 0;
+    close(fd);
+  }
+  box->nextSeq = box->delivered + 1;
+  for(segment = box->segments; segment != NULL; segment = segment->next)
+    if(segment->firstSeq + segment->header->num > box->nextSeq)
+      box->nextSeq = segment->firstSeq + segment->header->num;
+  
+  box->next = server->mailboxes;
+  server->mailboxes = box;
+  return box;
+}
+
+void AS_MailboxTrim(AS_Server_t *server, AS_Mailbox_t *box) {
+  // delete segments that are replayed completely, too old or exceed the size limit (oldest first)
+  AS_Segment_t *segment;
+  long long old = server->mailboxAge ? AS_wallMsec() - server->mailboxAge : 0;
+  
+  while((segment = box->segments) != NULL)  {
+    if(segment->firstSeq + segment->header->num > box->delivered + 1 &&  // not replayed yet
+       segment->header->lastTime >= old &&
+       (box->bytes <= server->mailboxSize || segment->next == NULL))
+      break;
+    if(segment->header->num == 0 && segment->next == NULL)
+      break; // empty segment being written
+    box->segments = segment->next;
+    AS_SegmentUnmap(box, segment, 1);
+  }
+}
+
+void AS_MailboxAppend(AS_Server_t *server, AS_Mailbox_t *box, AS_Buffer_t *buffer) {
+  AS_Segment_t *segment, *last;
+  AS_MailboxRecord_t *record;
+  unsigned int need = sizeof(AS_MailboxRecord_t) + buffer->len;
+  
+  for(last = box->segments; last != NULL && last->next != NULL; last = last->next);
+  if(last == NULL || last->header->end + need > last->size || last->header->num >= last->indexNum) {
+    // start new segment, large frames get a segment of their own
+    segment = AS_SegmentMap(box, box->nextSeq, sizeof(AS_SegmentHeader_t) + need > server->mailboxSegment ? sizeof(AS_SegmentHeader_t) + need : server->mailboxSegment);
+    if(segment == NULL) {
+      fprintf(stderr, "server %d: error: mailbox of %s: frame lost\n", server->port, box->name);
+      return;
+    }
+    if(last != NULL)
+      last->next = segment;
+    else
+      box->segments = segment;
+    last = segment;
+  }
+  record = (AS_MailboxRecord_t *)((char *)last->header + last->header->end);
+  record->seq = box->nextSeq++;
+  record->time = AS_wallMsec();
+  record->len = buffer->len;
+  memcpy(record + 1, buffer->data, buffer->len);
+  last->index[last->header->num] = last->header->end;
+  last->header->end += need;
+  last->header->lastTime = record->time;
+  last->header->num++; // record is valid now
+}
+
+void AS_MailboxRead(AS_Server_t *server, AS_Mailbox_t *box, AS_MailboxJob_t *job) {
+  // next batch after the delivered records, job->seq is the last record read
+  AS_Segment_t *segment;
+  AS_MailboxRecord_t *record;
+  unsigned long long seq = box->delivered + 1;
+  
+  job->frames = malloc(server->mailboxBatch * sizeof(AS_Buffer_t *));
+  job->num = 0;
+  job->seq = box->delivered;
+  for(segment = box->segments; segment != NULL && job->num < server->mailboxBatch; segment = segment->next) {
+    if(seq < segment->firstSeq)
+      seq = segment->firstSeq; // records in between were deleted
+    for(; seq < segment->firstSeq + segment->header->num && job->num < server->mailboxBatch; seq++) {
+      record = (AS_MailboxRecord_t *)((char *)segment->header + segment->index[seq - segment->firstSeq]);
+      job->frames[job->num] = AS_BufferNew(record->len);
+      memcpy(job->frames[job->num]->data, record + 1, record->len);
+      job->num++;
+      job->seq = seq;
+    }
+  }
+  job->done = job->seq + 1 >= box->nextSeq;
+}
+
+void AS_MailboxAck(AS_Mailbox_t *box, unsigned long long seq)  {
+  char file[PATH_MAX];
+  int fd;
+  
+  if(seq <= box->delivered)
+    return;
+  box->delivered = seq;
+  snprintf(file, sizeof(file), "%s/cursor", box->path);
+  if((fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) != -1) {
+    pwrite(fd, &box->delivered, sizeof(box->delivered), 0);
+    close(fd);
+  }
+}
+
+void* AS_MailboxThread(void *arg) {
+  // all file work happens here, the server thread only queues jobs
+  AS_Server_t *server = arg;
+  AS_MailboxJob_t *job, *next;
+  AS_Mailbox_t *box;
+  int stop;
+  
+  while(1)  {
+    pthread_mutex_lock(&server->mailboxLock);
+    while(server->mailboxJobs == NULL && !server->mailboxStop)
+      pthread_cond_wait(&server->mailboxCond, &server->mailboxLock);
+    job = server->mailboxJobs;
+    server->mailboxJobs = server->mailboxJobsLast = NULL;
+    stop = server->mailboxStop;
+    pthread_mutex_unlock(&server->mailboxLock);
+    
+    for(; job != NULL; job = next) {
+      next = job->next;
+      box = AS_MailboxOpen(server, job->name);
+      switch(job->type) {
+        case AS_JobAppend:
+          AS_MailboxAppend(server, box, job->buffer);
+          AS_BufferRelease(job->buffer);
+          AS_MailboxTrim(server, box);
+          free(job);
+          break;
+        case AS_JobAck:
+          AS_MailboxAck(box, job->seq);
+          AS_MailboxTrim(server, box);
+          free(job);
+          break;
+        case AS_JobReplay:
+          AS_MailboxTrim(server, box);
+          AS_MailboxRead(server, box, job);
+          job->type = AS_JobReplayed;
+          pthread_mutex_lock(&server->mailboxLock);
+          job->next = server->mailboxResults;
+          server->mailboxResults = job;
+          pthread_mutex_unlock(&server->mailboxLock);
+          write(server->wakePipe[1], "m", 1); // wake server thread
+          break;
+      }
+    }
+    if(stop)
+      break;
+  }
+  return NULL;
+}
+
+void AS_MailboxPost(AS_Server_t *server, AS_MailboxJob_t *job)  {
+  // hand job to mailbox thread, never blocks on file I/O
+  job->next = NULL;
+  pthread_mutex_lock(&server->mailboxLock);
+  if(server->mailboxJobsLast != NULL)
+    server->mailboxJobsLast->next = job;
+  else
+    server->mailboxJobs = job;
+  server->mailboxJobsLast = job;
+  pthread_cond_signal(&server->mailboxCond);
+  pthread_mutex_unlock(&server->mailboxLock);
+}
+
+void AS_MailboxStore(AS_Server_t *server, char *name, AS_Buffer_t *buffer)  {
+  // buffer may be shared with other recipients, the mailbox thread gets a copy
+  AS_MailboxJob_t *job = calloc(1, sizeof(AS_MailboxJob_t));
+  job->type = AS_JobAppend;
+  strncpy(job->name, name, AS_NAMELEN-1);
+  job->buffer = AS_BufferNew(buffer->len);
+  memcpy(job->buffer->data, buffer->data, buffer->len);
+  AS_MailboxPost(server, job);
+}
+
+void AS_MailboxContinue(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // request next replay batch when the client's queue is short enough
+  AS_MailboxJob_t *job;
+  if(!client->replayWanted || client->replayRunning || client->socket == -1 || client->handedOver || client->out.bytes > server->mailboxQueue / 2)
+    return;
+  job = calloc(1, sizeof(AS_MailboxJob_t));
+  job->type = AS_JobReplay;
+  strncpy(job->name, client->name, AS_NAMELEN-1);
+  job->client = client->id;
+  job->appends = client->appends;
+  client->replayWanted = 0;
+  client->replayRunning = 1;
+  AS_MailboxPost(server, job);
+}
+
+void AS_MailboxSpill(AS_Server_t *server, AS_ConnectedClients_t *client)  {
+  // connection of a named client is lost: forwarded frames not sent yet go to its mailbox
+  AS_OutFrame_t *lists[AS_PrioNum+1], *frame;
+  int i;
+  
+  lists[0] = client->out.head;
+  for(i = 0; i < AS_PrioNum; i++)
+    lists[i+1] = client->out.lanes[i].head;
+  for(i = 0; i <= AS_PrioNum; i++)
+    for(frame = lists[i]; frame != NULL; frame = frame->next)
+      if(frame->sent == 0 && AS_FramePriority(((AS_MessageHeader_t *)frame->buffer->data)->payloadType) != AS_PrioControl)
+        AS_MailboxStore(server, client->name, frame->buffer);
+}
+
+void AS_MailboxTakeResults(AS_Server_t *server) {
+  // replayed batches from the mailbox thread: queue frames for their client
+  AS_MailboxJob_t *job, *next;
+  AS_ConnectedClients_t *client;
+  AS_MessageHeader_t *header;
+  int i;
+  
+  pthread_mutex_lock(&server->mailboxLock);
+  job = server->mailboxResults;
+  server->mailboxResults = NULL;
+  pthread_mutex_unlock(&server->mailboxLock);
+  for(; job != NULL; job = next) {
+    next = job->next;
+    client = AS_IdMapGet(&server->clientMap, job->client);
+    if(client != NULL && client->socket != -1 && strcmp(client->name, job->name) == 0) {
+      client->replayRunning = 0;
+      for(i = 0; i < job->num; i++) {
+        header = (AS_MessageHeader_t *)job->frames[i]->data;
+        if(header->clientDestination >= 0) // client ID changed since then, channel is kept
+          header->clientDestination = client->id | (header->clientDestination & AS_CHANNEL_MASK);
+        AS_ServerSend(server, client, job->frames[i]);
+      }
+      if(job->done && client->appends == job->appends) {
+        client->mailbox = 0; // mailbox is empty, back to direct delivery
+        fprintf(stderr, "server %d: mailbox of %s replayed\n", server->port, client->name);
+      } else  {
+        client->replayWanted = 1;
+      }
+    } else  {
+      job->num = 0; // client is gone, batch is replayed next time
+    }
+    for(i = 0; i < job->num; i++)
+      AS_BufferRelease(job->frames[i]);
+    free(job->frames);
+    job->frames = NULL;
+    if(job->num > 0)  {
+      job->type = AS_JobAck;
+      AS_MailboxPost(server, job);
+    } else  {
+      free(job);
+    }
+  }
+}
+
+void AS_MailboxStart(AS_Server_t *server)  {
+  server->mailboxThread = malloc(sizeof(pthread_t));
+  pthread_mutex_init(&server->mailboxLock, NULL);
+  pthread_cond_init(&server->mailboxCond, NULL);
+  pthread_create(server->mailboxThread, NULL, &AS_MailboxThread, server);
+}
+
+void AS_MailboxStop(AS_Server_t *server)  {
+  // remaining jobs are done before the thread ends
+  AS_Mailbox_t *box;
+  AS_Segment_t *segment;
+  AS_MailboxJob_t *job;
+  int i;
+  
+  pthread_mutex_lock(&server->mailboxLock);
+  server->mailboxStop = 1;
+  pthread_cond_signal(&server->mailboxCond);
+  pthread_mutex_unlock(&server->mailboxLock);
+  pthread_join(*server->mailboxThread, NULL);
+  free(server->mailboxThread);
+  pthread_mutex_destroy(&server->mailboxLock);
+  pthread_cond_destroy(&server->mailboxCond);
+  
+  while((job = server->mailboxResults) != NULL) {
+    server->mailboxResults = job->next;
+    for(i = 0; i < job->num; i++)
+      AS_BufferRelease(job->frames[i]);
+    free(job->frames);
+    free(job);
+  }
+  while((box = server->mailboxes) != NULL)  {
+    server->mailboxes = box->next;
+    while((segment = box->segments) != NULL)  {
+      box->segments = segment->next;
+      AS_SegmentUnmap(box, segment, 0);
+    }
+    free(box->name);
+    free(box->path);
+    free(box);
+  }
+}
+
+void AS_DepartedFree(AS_Server_t *server) {
+  int i;
+  for(i = 0; i < server->departed.size; i++)
+    if(server->departed.keys[i] >= 0)
+      free(server->departed.values[i]);
+  AS_IdMapFree(&server->departed);
+}
+
+
+//////////////////////////////
+//          SERVER          //
+//////////////////////////////
+
+int AS_ServerIsRunning(int port)  {
+  if(!AS_initialized) AS_init();
+  
+  AS_Server_t* server = AS_ServerList;
+  while(server->next != NULL) {
+    server = server->next;
+    if(server->port == port && server->running)
+      return 1;
+  }
+  return 0;
+}
+
+int AS_ServerPrintRunning() {
+  if(!AS_initialized) AS_init();
+  
+  int count = 0;
+  printf("All running AS_Server in this process:\n");
+  AS_Server_t* server = AS_ServerList;
+  while(server->next != NULL) {
+    count++;
+    server = server->next;
+    printf("  server on port %d: running = %d, clientsNum = %d, stop = %d\n", server->port, server->running, server->clientsNum, server->stop);
+  }
+  if(!count)
+    printf("  no AS_Server running in this process\n");
+  return 0;
+}
+
+void AS_PresenceApply(AS_IdSet_t *joins, AS_IdSet_t *leaves, int *ids, int leaveNum, int joinNum) {
+  // merge a delta into joins/leaves, a leave cancels a not yet announced join
+  int i;
+  for(i = 0; i < leaveNum; i++) {
+    if(!AS_IdSetRemove(joins, ids[i]))
+      AS_IdSetAdd(leaves, ids[i]);
+  }
+  for(i = leaveNum; i < leaveNum + joinNum; i++)
+    AS_IdSetAdd(joins, ids[i]);
+}
+
+void AS_PresenceLocal(AS_Server_t *server, int id, int joined) {
+  // join/leave of an own client, announced to own clients and to peers with the next presence frame
+  AS_PresenceApply(&server->pendingJoins, &server->pendingLeaves, &id, !joined, joined);
+  if(server->node)
+    AS_PresenceApply(&server->peerJoins, &server->peerLeaves, &id, !joined, joined);
+}
+
+AS_Buffer_t* AS_PresenceBuild(int fromVersion, int toVersion, AS_IdSet_t *leaves, AS_IdSet_t *joins, int type) {
+  // build header + AS_PresenceDelta_t + leaves + joins
+  AS_MessageHeader_t *header;
+  AS_PresenceDelta_t *delta;
+  AS_Buffer_t *frame;
+  void *buffer;
+  int payloadLength;
+  
+  payloadLength = sizeof(AS_PresenceDelta_t) + (leaves->num + joins->num) * sizeof(int);
+  frame = AS_BufferNew(sizeof(AS_MessageHeader_t) + payloadLength);
+  buffer = frame->data;
+  header = buffer;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = -1;    // server
+  header->clientDestination = -2;
+  header->payloadType = type;
+  header->payloadLength = payloadLength;
+  delta = buffer + sizeof(AS_MessageHeader_t);
+  delta->fromVersion = fromVersion;
+  delta->toVersion = toVersion;
+  delta->leaveNum = leaves->num;
+  delta->joinNum = joins->num;
+  memcpy(buffer + sizeof(AS_MessageHeader_t) + sizeof(AS_PresenceDelta_t), leaves->ids, leaves->num * sizeof(int));
+  memcpy(buffer + sizeof(AS_MessageHeader_t) + sizeof(AS_PresenceDelta_t) + leaves->num * sizeof(int), joins->ids, joins->num * sizeof(int));
+  return frame;
+}
+
+void AS_ServerSend(AS_Server_t *server, AS_ConnectedClients_t *client, AS_Buffer_t *buffer) {
+  // queue frame for client, it is written at the end of the current loop iteration
+  if(client->socket == -1)
+    return;
+  AS_OutQueuePush(&client->out, buffer);
+  client->lastSend = AS_monotonicMsec();
+  if(client->handedOver)  { // kept for the case the handover fails
+    AS_HandoverForward(server, client, buffer);
+    return;
+  }
+  if(!client->dirty)  {
+    client->dirty = 1;
+    client->flushNext = server->flushList;
+    server->flushList = client;
+  }
+}
+
+void AS_ServerDeliver(AS_Server_t *server, AS_ConnectedClients_t *client, AS_Buffer_t *buffer) {
+  // forwarded frame: queue for client or keep it in the mailbox (frames keep their order while it is replayed)
+  if(server->mailboxDir != NULL && client->name[0] != '\0' && !client->mailbox && !client->handedOver && client->out.bytes > server->mailboxQueue) {
+    fprintf(stderr, "server %d: client %d is slow, frames go to mailbox of %s\n", server->port, client->id, client->name);
+    client->mailbox = 1;
+    client->replayWanted = 1;
+  }
+  if(client->mailbox) {
+    AS_MailboxStore(server, client->name, buffer);
+    client->appends++;
+    return;
+  }
+  if(server->clientMemory && !client->peer && client->socket != -1 && AS_ConnectionMemory(&client->in, &client->out) + buffer->len > server->clientMemory)  {
+    // recipient does not keep up: its queue must not grow beyond its budget
+    if(!client->dropping)
+      fprintf(stderr, "server %d: client %d is over its memory budget, frames for it are dropped\n", server->port, client->id);
+    client->dropping = 1;
+    server->dropped++;
+    return;
+  }
+  client->dropping = 0;
+  AS_ServerSend(server, client, buffer);
+}
+
+void AS_ServerSetName(AS_Server_t *server, AS_ConnectedClients_t *client, char *name, int len) {
+  // named clients get frames that were sent while they were offline
+  AS_ConnectedClients_t *other;
+  
+  if(client->name[0] != '\0' || !AS_MailboxNameValid(name, len)) {
+    fprintf(stderr, "server %d: error: client %d sends invalid name\n", server->port, client->id);
+    return;
+  }
+  for(other = server->clients->next; other != NULL; other = other->next)
+    if(strcmp(other->name, name) == 0)  {
+      fprintf(stderr, "server %d: error: name %s is already used by client %d\n", server->port, name, other->id);
+      return;
+    }
+  strncpy(client->name, name, AS_NAMELEN-1);
+  fprintf(stderr, "server %d: client %d is %s\n", server->port, client->id, client->name);
+  if(server->mailboxDir == NULL)
+    return;
+  client->mailbox = 1; // live frames wait behind the stored ones
+  client->replayWanted = 1;
+  AS_MailboxContinue(server, client);
+}
+
+void AS_ServerWatch(AS_Server_t *server, AS_ConnectedClients_t *client, int out, int paused)  {
+  // (un)register client socket for EPOLLOUT / EPOLLIN
+  struct epoll_event ev;
+  if(client->epollOut == out && client->epollPaused == paused)
+    return;
+  ev.events = (paused ? 0 : EPOLLIN) | (out ? EPOLLOUT : 0);
+  ev.data.ptr = client;
+  epoll_ctl(server->epoll, EPOLL_CTL_MOD, client->socket, &ev);
+  client->epollOut = out;
+  client->epollPaused = paused;
+}
+
+void AS_ServerWatchOut(AS_Server_t *server, AS_ConnectedClients_t *client, int enable)  {
+  AS_ServerWatch(server, client, enable, client->epollPaused);
+}
+
+void AS_ServerRunQueuePush(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // client continues reading after all others had their turn, epoll does not report it meanwhile
+  if(client->queued)
+    return;
+  AS_ServerWatch(server, client, client->epollOut, 1);
+  client->queued = 1;
+  client->runNext = NULL;
+  if(server->runTail != NULL)
+    server->runTail->runNext = client;
+  else
+    server->runHead = client;
+  server->runTail = client;
+  server->runNum++;
+}
+
+AS_ConnectedClients_t* AS_ServerRunQueuePop(AS_Server_t *server) {
+  AS_ConnectedClients_t *client = server->runHead;
+  if(client == NULL)
+    return NULL;
+  server->runHead = client->runNext;
+  if(server->runHead == NULL)
+    server->runTail = NULL;
+  client->queued = 0;
+  server->runNum--;
+  return client;
+}
+
+void AS_ServerRunQueueRemove(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  AS_ConnectedClients_t *last = NULL, *element;
+  if(!client->queued)
+    return;
+  for(element = server->runHead; element != client; element = element->runNext)
+    last = element;
+  if(last != NULL)
+    last->runNext = client->runNext;
+  else
+    server->runHead = client->runNext;
+  if(server->runTail == client)
+    server->runTail = last;
+  client->queued = 0;
+  server->runNum--;
+}
+
+void AS_ServerFragmentsFree(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // frames of hooked types not complete yet are dropped
+  AS_Reassembly_t *part;
+  
+  while((part = client->fragments) != NULL) {
+    client->fragments = part->next;
+    if(part->payload != NULL)
+      server->memory -= part->payloadLength;
+    free(part->payload);
+    free(part);
+  }
+  client->fragmentBytes = 0;
+}
+
+void AS_ServerRemoveClient(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // close connection, remove client from list and announce leave with next presence frame
+  // memory is freed at the end of the loop iteration (there might be more events for this client)
+  if(client->socket == -1)
+    return;
+  epoll_ctl(server->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+  close(client->socket);
+  client->socket = -1;
+  if(server->handoverNext == client)  // handover running: client is not sent
+    server->handoverNext = client->next;
+  if(server->mailboxDir != NULL && client->name[0] != '\0') {
+    // named client: frames not sent yet and frames sent to its ID while it is offline go to its mailbox
+    AS_MailboxSpill(server, client);
+    free(AS_IdMapGet(&server->departed, client->id));
+    AS_IdMapPut(&server->departed, client->id, strdup(client->name));
+  }
+  AS_TimerRemove(&client->timer);
+  AS_ServerRunQueueRemove(server, client);
+  AS_InBufferFree(&client->in);
+  AS_OutQueueClear(&client->out);
+  AS_ServerFragmentsFree(server, client);
+  // delete element from linked list
+  client->prev->next = client->next;
+  if(client->next != NULL)
+    client->next->prev = client->prev;
+  AS_IdMapRemove(&server->clientMap, client->id);
+  if(client->peer > 0)  { // clients of that node are no longer reachable
+    fprintf(stderr, "server %d: lost connection to node %d\n", server->port, client->peer);
+    AS_PresenceApply(&server->pendingJoins, &server->pendingLeaves, client->remote.ids, client->remote.num, 0);
+    AS_IdSetFree(&client->remote);
+    server->peers[client->peer] = NULL;
+  } else if(!client->peer)  {
+    AS_PresenceLocal(server, client->id, 0); // join not announced yet -> nothing to announce
+  }
+  server->clientsNum --; // decrease client counter
+  client->next = server->closedList;
+  server->closedList = client;
+}
+
+void AS_ServerFlush(AS_Server_t *server)  {
+  // write queued frames of all clients that received new frames in this iteration
+  AS_ConnectedClients_t *client;
+  
+  while((client = server->flushList) != NULL) {
+    server->flushList = client->flushNext;
+    client->dirty = 0;
+    if(client->socket == -1 || client->handedOver) // handed over: written by the successor
+      continue;
+    if(AS_OutQueueFlush(client->socket, &client->out) == -1)  {
+      fprintf(stderr, "server %d: error: send to client %d failed\n", server->port, client->id);
+      AS_ServerRemoveClient(server, client);
+      continue;
+    }
+    AS_ServerWatchOut(server, client, client->out.bytes > 0); // rest is sent when socket is writable
+    if(server->mailboxDir != NULL)
+      AS_MailboxContinue(server, client);
+  }
+  // now it is safe to free closed clients
+  while((client = server->closedList) != NULL) {
+    server->closedList = client->next;
+    free(client);
+  }
+}
+
+void AS_PresenceFlush(AS_Server_t *server) {
+  // send collected joins/leaves as one frame to every client interested in presence
+  AS_ConnectedClients_t *client;
+  AS_PresenceBatch_t *batch;
+  AS_Buffer_t *buffer;
+  int i;
+  
+  if(!server->pendingJoins.num && !server->pendingLeaves.num && !server->peerJoins.num && !server->peerLeaves.num)
+    return;
+  if(msec() - server->presenceLast < AS_PRESENCE_INTERVAL || server->handoverSock != -1) // handover: the successor sends them
+    return;
+  server->presenceLast = msec();
+  
+  if(server->peerJoins.num || server->peerLeaves.num) { // changes of own clients -> all peers
+    buffer = AS_PresenceBuild(0, 0, &server->peerLeaves, &server->peerJoins, AS_TypePeerPresence);
+    for(i = 1; i <= AS_NODE_MAX; i++) {
+      if(server->peers[i] != NULL)
+        AS_ServerSend(server, server->peers[i], buffer);
+    }
+    AS_BufferRelease(buffer);
+    AS_IdSetClear(&server->peerLeaves);
+    AS_IdSetClear(&server->peerJoins);
+  }
+  if(!server->pendingJoins.num && !server->pendingLeaves.num)
+    return;
+  buffer = AS_PresenceBuild(server->presenceVersion, server->presenceVersion + 1, &server->pendingLeaves, &server->pendingJoins, AS_TypePresence);
+  server->presenceVersion++;
+  client = server->clients;
+  while(client->next != NULL) {
+    client = client->next;
+    if(client->presence)
+      AS_ServerSend(server, client, buffer); // same buffer for all clients
+  }
+  AS_BufferRelease(buffer);
+  
+  // keep delta for versioned client lists
+  batch = &server->presenceHistory[server->presenceVersion % AS_PRESENCE_HISTORY];
+  free(batch->ids);
+  batch->toVersion = server->presenceVersion;
+  batch->leaveNum = server->pendingLeaves.num;
+  batch->joinNum = server->pendingJoins.num;
+  batch->ids = malloc((batch->leaveNum + batch->joinNum + 1) * sizeof(int));
+  memcpy(batch->ids, server->pendingLeaves.ids, batch->leaveNum * sizeof(int));
+  memcpy(batch->ids + batch->leaveNum, server->pendingJoins.ids, batch->joinNum * sizeof(int));
+  
+  // update snapshot incrementally
+  for(i = 0; i < server->pendingLeaves.num; i++)
+    AS_IdSetRemove(&server->snapshot, server->pendingLeaves.ids[i]);
+  for(i = 0; i < server->pendingJoins.num; i++)
+    AS_IdSetAdd(&server->snapshot, server->pendingJoins.ids[i]);
+  AS_IdSetClear(&server->pendingLeaves);
+  AS_IdSetClear(&server->pendingJoins);
+}
+
+void AS_ServerSendClientList(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *request, void *payload) {
+  // answer AS_TypeAskForClients from snapshot
+  // request without payload: complete list (AS_TypeListOfClients)
+  // request with known version: delta since that version (AS_TypeClientListDelta)
+  AS_MessageHeader_t *header;
+  AS_PresenceBatch_t *batch;
+  AS_IdSet_t joins, leaves;
+  AS_Buffer_t *buffer;
+  int version, known;
+  
+  if(request->payloadLength < sizeof(int)) {
+    buffer = AS_BufferNew(sizeof(AS_MessageHeader_t) + server->snapshot.num * sizeof(int));
+    header = (AS_MessageHeader_t *)buffer->data;
+    header->as_identifier = 144; // mandatory (for checking at receiver)
+    header->clientSource = -1;  // server
+    header->clientDestination = request->clientSource; // client (channel) asking
+    header->payloadType = AS_TypeListOfClients;
+    header->payloadLength = server->snapshot.num * sizeof(int);
+    memcpy(buffer->data + sizeof(AS_MessageHeader_t), server->snapshot.ids, header->payloadLength);
+    AS_ServerSend(server, client, buffer);
+    AS_BufferRelease(buffer);
+    return;
+  }
+  
+  memset(&joins, 0, sizeof(AS_IdSet_t));
+  memset(&leaves, 0, sizeof(AS_IdSet_t));
+  known = *(int *)payload;
+  if(known > 0 && known <= server->presenceVersion && server->presenceVersion - known <= AS_PRESENCE_HISTORY) {
+    // combine all deltas since known version
+    for(version = known + 1; version <= server->presenceVersion; version++) {
+      batch = &server->presenceHistory[version % AS_PRESENCE_HISTORY];
+      if(batch->toVersion != version)
+        break;
+      AS_PresenceApply(&joins, &leaves, batch->ids, batch->leaveNum, batch->joinNum);
+    }
+    if(version <= server->presenceVersion) // history incomplete
+      known = 0;
+  } else  {
+    known = 0;
+  }
+  if(!known)  { // complete list
+    AS_IdSetClear(&leaves);
+    AS_IdSetClear(&joins);
+  }
+  buffer = AS_PresenceBuild(known, server->presenceVersion, &leaves, known ? &joins : &server->snapshot, AS_TypeClientListDelta);
+  ((AS_MessageHeader_t *)buffer->data)->clientDestination = request->clientSource;
+  AS_ServerSend(server, client, buffer);
+  AS_BufferRelease(buffer);
+  AS_IdSetFree(&joins);
+  AS_IdSetFree(&leaves);
+}
+
+void AS_ServerSchedule(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // next check of heartbeat/timeouts, activity only updates timestamps (no timer changes)
+  unsigned long long next = ULLONG_MAX;
+  next = AS_TimerNext(client->in.lastRecv, server->idleTimeout, next);
+  next = AS_TimerNext(client->in.frameStart, server->readTimeout, next);
+  next = AS_TimerNext(client->lastSend, server->heartbeat, next);
+  if(client->throttledUntil && AS_TimerTick(client->throttledUntil) < next)
+    next = AS_TimerTick(client->throttledUntil);
+  if(next != ULLONG_MAX)
+    AS_TimerAdd(&server->wheel, &client->timer, next);
+}
+
+void AS_ServerTimer(void *ctx, AS_Timer_t *timer)  {
+  // heartbeats and timeouts of one client, called by the timer wheel
+  AS_Server_t *server = ctx;
+  AS_ConnectedClients_t *client = timer->data;
+  AS_MessageHeader_t *header;
+  AS_Buffer_t *buffer;
+  long long now = AS_monotonicMsec();
+  
+  if(client->throttledUntil && now >= client->throttledUntil) {
+    client->throttledUntil = 0;
+    // the pause does not count for timeouts: nothing could be received meanwhile
+    client->in.lastRecv += now - client->throttledSince;
+    if(client->in.frameStart)
+      client->in.frameStart += now - client->throttledSince;
+    AS_ServerRunQueuePush(server, client); // enough tokens again
+  }
+  if(client->throttledUntil) { // not reading is our decision, no timeouts meanwhile
+    AS_ServerSchedule(server, client);
+    return;
+  }
+  if(server->idleTimeout && now - client->in.lastRecv >= server->idleTimeout)  {
+    fprintf(stderr, "server %d: client %d timed out (idle)\n", server->port, client->id);
+    AS_ServerRemoveClient(server, client); // other clients are informed with next presence frame
+    return;
+  }
+  if(server->readTimeout && client->in.frameStart && now - client->in.frameStart >= server->readTimeout) {
+    fprintf(stderr, "server %d: client %d timed out (incomplete frame)\n", server->port, client->id);
+    AS_ServerRemoveClient(server, client);
+    return;
+  }
+  if(server->heartbeat && now - client->lastSend >= server->heartbeat) {
+    buffer = AS_BufferNew(sizeof(AS_MessageHeader_t));
+    header = (AS_MessageHeader_t *)buffer->data;
+    header->as_identifier = 144; // mandatory (for checking at receiver)
+    header->clientSource = -1; // server
+    header->clientDestination = client->id;
+    header->payloadType = AS_TypeHeartbeat;
+    header->payloadLength = 0;
+    AS_ServerSend(server, client, buffer);
+    AS_BufferRelease(buffer);
+  }
+  AS_ServerSchedule(server, client);
+}
+
+void AS_ServerSendHello(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // introduce this server to a peer: node, followed by the shared secret
+  AS_MessageHeader_t *header;
+  AS_Buffer_t *buffer;
+  int len;
+  
+  len = server->peerSecret != NULL ? strlen(server->peerSecret) : 0;
+  buffer = AS_BufferNew(sizeof(AS_MessageHeader_t) + sizeof(int) + len);
+  header = (AS_MessageHeader_t *)buffer->data;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = -1; // server
+  header->clientDestination = -1;
+  header->payloadType = AS_TypePeerHello;
+  header->payloadLength = sizeof(int) + len;
+  *(int *)(buffer->data + sizeof(AS_MessageHeader_t)) = server->node;
+  if(len)
+    memcpy(buffer->data + sizeof(AS_MessageHeader_t) + sizeof(int), server->peerSecret, len);
+  AS_ServerSend(server, client, buffer);
+  AS_BufferRelease(buffer);
+}
+
+void AS_ServerDatagramOffer(AS_Server_t *server, AS_ConnectedClients_t *client)  {
+  // tell client where to send datagrams, the token identifies them
+  AS_MessageHeader_t *header;
+  AS_DatagramOffer_t *offer;
+  AS_Buffer_t *buffer;
+  
+  while(!client->udpToken)
+    if(getrandom(&client->udpToken, sizeof(client->udpToken), 0) != sizeof(client->udpToken))
+      client->udpToken = (unsigned int)AS_monotonicNsec() ^ (unsigned int)rand();
+  buffer = AS_BufferNew(sizeof(AS_MessageHeader_t) + sizeof(AS_DatagramOffer_t));
+  header = (AS_MessageHeader_t *)buffer->data;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = -1; // server
+  header->clientDestination = client->id;
+  header->payloadType = AS_TypeDatagramOffer;
+  header->payloadLength = sizeof(AS_DatagramOffer_t);
+  offer = (AS_DatagramOffer_t *)(header + 1);
+  offer->port = server->port;
+  offer->token = client->udpToken;
+  AS_ServerSend(server, client, buffer);
+  AS_BufferRelease(buffer);
+}
+
+int AS_ServerNewId(AS_Server_t *server)  {
+  // IDs are counted (not the socket), they stay unique when sockets are handed over to another process
+  int id;
+  while(1)  {
+    if(server->nextId < 1 || server->nextId >= 1 << AS_NODE_SHIFT)
+      server->nextId = 1;
+    id = server->nextId++ | (server->node << AS_NODE_SHIFT);
+    if(AS_IdMapGet(&server->clientMap, id) == NULL)
+      return id; // unique in the federation
+  }
+}
+
+void AS_ServerAddClient(AS_Server_t *server, int sock, int peer) {
+  // peer: outgoing connection to another server of the federation
+  AS_ConnectedClients_t *newClient;
+  AS_MessageHeader_t *header;
+  AS_Buffer_t *buffer;
+  struct epoll_event ev;
+  
+  if(!peer && server->config.option[AS_OptMaxClients] && server->clientsNum >= server->config.option[AS_OptMaxClients]) {
+    fprintf(stderr, "server %d: error: too many clients, connection closed\n", server->port);
+    close(sock);
+    return;
+  }
+  if(!peer && server->serverMemory && server->memory >= server->serverMemory)  {
+    fprintf(stderr, "server %d: error: memory budget used up, connection closed\n", server->port);
+    server->rejected++;
+    close(sock);
+    return;
+  }
+  
+  // create new Client
+  newClient = calloc(1, sizeof(AS_ConnectedClients_t));
+  // newClient->name is set to '\0\0\0\0...' due to calloc()
+  AS_SocketOptions(sock, server->config.option);
+  AS_InBufferInit(&newClient->in, server->config.option);
+  newClient->in.account = &server->memory;
+  newClient->out.account = &server->memory;
+  newClient->socket = sock;
+  newClient->id = AS_ServerNewId(server);
+  newClient->presence = !peer;
+  newClient->peer = peer ? -1 : 0;
+  if(peer)
+    newClient->in.admit = -1; // peers carry the frames of many clients, their budgets apply at their servers
+  newClient->in.lastRecv = AS_monotonicMsec(); // idle time starts now
+  newClient->tokens = server->rateBurst;
+  newClient->tokensTime = newClient->in.lastRecv;
+  newClient->timer.data = newClient;
+  
+  // now add this new socket to epoll for socket reading
+  ev.events = EPOLLIN;
+  ev.data.ptr = newClient;
+  if(epoll_ctl(server->epoll, EPOLL_CTL_ADD, sock, &ev) == -1)  {
+    perror("epoll_ctl");
+    close(sock);
+    free(newClient);
+    return;
+  }
+  
+  // prepend client object to list
+  newClient->prev = server->clients;
+  newClient->next = server->clients->next;
+  if(newClient->next != NULL)
+    newClient->next->prev = newClient;
+  server->clients->next = newClient;
+  server->clientsNum ++; // increase client counter
+  AS_ServerSchedule(server, newClient);
+  
+  if(peer)  { // no client, the other server answers with its own hello
+    AS_ServerSendHello(server, newClient);
+    fprintf(stderr, "server %d: new peer connection %d\n", server->port, newClient->id);
+    return;
+  }
+  
+  // queue clientID for new client, sent at the end of this loop iteration
+  buffer = AS_BufferNew(sizeof(AS_MessageHeader_t));
+  header = (AS_MessageHeader_t *)buffer->data;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = -1; // server
+  header->clientDestination = newClient->id; // this indicates the new clients id
+  header->payloadType = AS_TypeClientID; // inform client that it will receive it's own id
+  header->payloadLength = 0; // no payload needed
+  AS_ServerSend(server, newClient, buffer);
+  AS_BufferRelease(buffer);
+  if(server->udp != -1)
+    AS_ServerDatagramOffer(server, newClient);
+  
+  if(server->mailboxDir != NULL && AS_IdMapGet(&server->departed, newClient->id) != NULL)  {
+    // ID is reused, frames to it are no longer meant for the departed client
+    free(AS_IdMapGet(&server->departed, newClient->id));
+    AS_IdMapRemove(&server->departed, newClient->id);
+  }
+  
+  // "new client" is announced to all clients with the next presence frame
+  AS_PresenceLocal(server, newClient->id, 1);
+  AS_IdMapPut(&server->clientMap, newClient->id, newClient);
+  
+  fprintf(stderr, "server %d: new client %d\n", server->port, newClient->id);
+}
+
+int AS_ServerAcceptOne(int listener, int port) {
+  // accept one waiting connection, returns socket or -1 if listen queue is empty
+  int sock;
+  while(1)  {
+    sock = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(sock >= 0)
+      return sock;
+    if(errno == EINTR || errno == ECONNABORTED)
+      continue; // try next one
+    if(errno != EAGAIN && errno != EWOULDBLOCK)
+      fprintf(stderr, "server %d: error: accept: %s\n", port, strerror(errno));
+    return -1;
+  }
+}
+
+void* AS_ServerAcceptThread(void *arg) {
+  // dedicated acceptor: drains listen queue and hands sockets over to the server thread
+  AS_Server_t* server = arg;
+  AS_Handoff_t *handoff, *first, *last;
+  struct pollfd pfd;
+  int sock;
+  
+  AS_SetAffinity(server->config.option[AS_OptAffinity]);
+  pfd.fd = server->listener;
+  pfd.events = POLLIN;
+  while(!server->stop && !server->handedOver)  {
+    if(poll(&pfd, 1, 10) <= 0)  // timeout in order to react to shutdown
+      continue;
+    first = last = NULL;
+    while((sock = AS_ServerAcceptOne(server->listener, server->port)) != -1) {
+      handoff = calloc(1, sizeof(AS_Handoff_t));
+      handoff->socket = sock;
+      if(last != NULL)
+        last->next = handoff;
+      else
+        first = handoff;
+      last = handoff;
+    }
+    if(first == NULL)
+      continue;
+    pthread_mutex_lock(&server->handoffLock);
+    last->next = server->handoff;
+    server->handoff = first;
+    pthread_mutex_unlock(&server->handoffLock);
+    write(server->wakePipe[1], "a", 1); // wake server thread
+  }
+  return NULL;
+}
+
+void AS_ServerTakeHandoff(AS_Server_t *server) {
+  // add all sockets handed over by other threads
+  AS_Handoff_t *handoff, *next;
+  char drain[64];
+  
+  while(read(server->wakePipe[0], drain, sizeof(drain)) > 0);
+  if(server->handoverSock != -1)
+    return; // handover running: taken afterwards (by this server if it fails)
+  pthread_mutex_lock(&server->handoffLock);
+  handoff = server->handoff;
+  server->handoff = NULL;
+  pthread_mutex_unlock(&server->handoffLock);
+  while(handoff != NULL)  {
+    next = handoff->next;
+    AS_ServerAddClient(server, handoff->socket, handoff->peer);
+    free(handoff);
+    handoff = next;
+  }
+}
+
+int AS_ServerPeerSecret(AS_Server_t *server, AS_ConnectedClients_t *client, char *secret, int len) {
+  // 1: hello may come from this connection, accepted ones need the shared secret, own ones (AS_ServerPeer) only if set
+  unsigned char diff;
+  int i;
+  
+  if(server->peerSecret == NULL)
+    return client->peer == -1;
+  if(len != strlen(server->peerSecret))
+    return 0;
+  diff = 0;
+  for(i = 0; i < len; i++)  // same time for every secret of this length
+    diff |= secret[i] ^ server->peerSecret[i];
+  return diff == 0;
+}
+
+void AS_ServerPeerHello(AS_Server_t *server, AS_ConnectedClients_t *client, void *payload, int len) {
+  // another server of the federation introduces itself, both send the list of their clients afterwards
+  AS_ConnectedClients_t *other;
+  AS_IdSet_t none, own;
+  AS_Buffer_t *buffer;
+  int node;
+  
+  node = len >= sizeof(int) ? *(int *)payload : 0;
+  if(!server->node || client->peer > 0 || node < 1 || node > AS_NODE_MAX || node == server->node || server->peers[node] != NULL)  {
+    fprintf(stderr, "server %d: error: connection %d sends invalid peer hello (node %d)\n", server->port, client->id, node);
+    AS_ServerRemoveClient(server, client);
+    return;
+  }
+  if(!AS_ServerPeerSecret(server, client, (char *)payload + sizeof(int), len - sizeof(int)))  {
+    fprintf(stderr, "server %d: error: connection %d sends peer hello without valid secret, connection closed\n", server->port, client->id);
+    AS_ServerRemoveClient(server, client);
+    return;
+  }
+  if(!client->peer) { // accepted connection: it is no client, take back its join
+    AS_IdMapRemove(&server->clientMap, client->id);
+    AS_PresenceLocal(server, client->id, 0);
+    client->presence = 0;
+    AS_ServerSendHello(server, client);
+  }
+  client->peer = node;
+  client->in.admit = -1; // budgets of clients do not apply to peers
+  server->peers[node] = client;
+  
+  memset(&none, 0, sizeof(AS_IdSet_t));
+  memset(&own, 0, sizeof(AS_IdSet_t));
+  other = server->clients;
+  while(other->next != NULL) {
+    other = other->next;
+    if(!other->peer && other->socket != -1)
+      AS_IdSetAdd(&own, other->id);
+  }
+  buffer = AS_PresenceBuild(0, 0, &none, &own, AS_TypePeerPresence);
+  AS_ServerSend(server, client, buffer);
+  AS_BufferRelease(buffer);
+  AS_IdSetFree(&own);
+  fprintf(stderr, "server %d: connected to node %d\n", server->port, node);
+}
+
+void AS_ServerPeerPresence(AS_Server_t *server, AS_ConnectedClients_t *client, void *payload, int len) {
+  // joins/leaves of the clients of a peer, announced to own clients with the next presence frame
+  AS_PresenceDelta_t *delta = payload;
+  int *ids, i;
+  
+  if(len < sizeof(AS_PresenceDelta_t) || delta->leaveNum < 0 || delta->joinNum < 0 ||
+     len != sizeof(AS_PresenceDelta_t) + (delta->leaveNum + delta->joinNum) * sizeof(int))  {
+    fprintf(stderr, "server %d: error: node %d sends invalid presence\n", server->port, client->peer);
+    return;
+  }
+  ids = payload + sizeof(AS_PresenceDelta_t);
+  for(i = 0; i < delta->leaveNum; i++) {
+    if(AS_IdSetRemove(&client->remote, ids[i]))
+      AS_PresenceApply(&server->pendingJoins, &server->pendingLeaves, &ids[i], 1, 0);
+  }
+  for(i = delta->leaveNum; i < delta->leaveNum + delta->joinNum; i++) {
+    if((ids[i] & AS_NODE_MASK) >> AS_NODE_SHIFT == client->peer && AS_IdSetAdd(&client->remote, ids[i]))
+      AS_PresenceApply(&server->pendingJoins, &server->pendingLeaves, &ids[i], 0, 1);
+  }
+}
+
+void AS_ServerRespond(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *request, void *payload, int status, void *result, int len) {
+  // answer request of client, on behalf of the server or of an unreachable recipient
+  AS_MessageHeader_t *header;
+  AS_Buffer_t *buffer;
+  AS_Rpc_t *rpc;
+  
+  buffer = AS_BufferNew(sizeof(AS_MessageHeader_t) + sizeof(AS_Rpc_t) + len);
+  header = (AS_MessageHeader_t *)buffer->data;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = request->clientDestination;
+  header->clientDestination = request->clientSource; // client (channel) asking
+  header->payloadType = AS_TypeResponse;
+  header->payloadLength = sizeof(AS_Rpc_t) + len;
+  rpc = (AS_Rpc_t *)(header + 1);
+  *rpc = *(AS_Rpc_t *)payload;
+  rpc->status = status;
+  if(len)
+    memcpy(rpc + 1, result, len);
+  AS_ServerSend(server, client, buffer);
+  AS_BufferRelease(buffer);
+}
+
+void AS_ServerRequest(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload) {
+  // request to the server: registered handler or built-in method
+  AS_ConnectedClients_t *other;
+  AS_Rpc_t *rpc = payload;
+  void *args, *result;
+  int len, status;
+  
+  args = rpc + 1;
+  len = header->payloadLength - sizeof(AS_Rpc_t);
+  fprintf(stderr, "server %d: client %d calls method %d\n", server->port, client->id, rpc->method);
+  if(rpc->method > 0 && rpc->method < AS_METHODS && server->handlers[rpc->method] != NULL) {
+    result = NULL;
+    len = 0;
+    status = server->handlers[rpc->method](server->port, header->clientSource, args, header->payloadLength - sizeof(AS_Rpc_t), &result, &len);
+    AS_ServerRespond(server, client, header, payload, status, result, result != NULL ? len : 0);
+    free(result);
+    return;
+  }
+  switch(rpc->method) {
+    case AS_MethodPing:
+      AS_ServerRespond(server, client, header, payload, AS_RpcOk, args, len);
+      break;
+    case AS_MethodClients:
+      AS_ServerRespond(server, client, header, payload, AS_RpcOk, server->snapshot.ids, server->snapshot.num * sizeof(int));
+      break;
+    case AS_MethodFind: // own clients only (payload is terminated by AS_ReceiveFrame)
+      other = server->clients;
+      while((other = other->next) != NULL)
+        if(!other->peer && other->socket != -1 && other->name[0] != '\0' && strcmp(other->name, args) == 0)
+          break;
+      if(other != NULL)
+        AS_ServerRespond(server, client, header, payload, AS_RpcOk, &other->id, sizeof(int));
+      else
+        AS_ServerRespond(server, client, header, payload, AS_RpcUnreachable, NULL, 0);
+      break;
+    default:
+      AS_ServerRespond(server, client, header, payload, AS_RpcNoHandler, NULL, 0);
+      break;
+  }
+}
+
+void AS_ServerDatagramFlush(AS_Server_t *server, struct mmsghdr *msgs, int num)  {
+  int sent, rv;
+  for(sent = 0; sent < num; sent += rv)
+    if((rv = sendmmsg(server->udp, msgs + sent, num - sent, MSG_DONTWAIT)) <= 0)
+      break; // socket buffer full: the rest is lost like any datagram
+}
+
+void AS_ServerDatagramSend(AS_Server_t *server, AS_ConnectedClients_t *client, AS_ConnectedClients_t *destination, AS_Buffer_t *buffer) {
+  // unreliable frame to destination (NULL: broadcast): batched datagrams to all recipients with a datagram endpoint, TCP to all others
+  struct mmsghdr msgs[AS_DATAGRAM_BATCH];
+  struct iovec iovs[AS_DATAGRAM_BATCH][2];
+  AS_Datagram_t prefixes[AS_DATAGRAM_BATCH];
+  AS_ConnectedClients_t *next;
+  int num = 0, fits;
+  
+  fits = server->udp != -1 && sizeof(AS_Datagram_t) + buffer->len <= AS_DATAGRAM;
+  memset(msgs, 0, sizeof(msgs));
+  next = destination != NULL ? destination : server->clients->next;
+  while(next != NULL) {
+    if(destination == NULL && next->peer && (next->peer < 0 || client->peer))  { // same recipients as broadcasts over TCP
+      next = next->next;
+      continue;
+    }
+    if(!fits || !next->udpAddrLen || next->socket == -1)  {
+      AS_ServerDeliver(server, next, buffer);
+    } else  {
+      prefixes[num].client = -1;
+      prefixes[num].token = next->udpToken;
+      iovs[num][0].iov_base = &prefixes[num];
+      iovs[num][0].iov_len = sizeof(AS_Datagram_t);
+      iovs[num][1].iov_base = buffer->data;
+      iovs[num][1].iov_len = buffer->len;
+      msgs[num].msg_hdr.msg_name = &next->udpAddr;
+      msgs[num].msg_hdr.msg_namelen = next->udpAddrLen;
+      msgs[num].msg_hdr.msg_iov = iovs[num];
+      msgs[num].msg_hdr.msg_iovlen = 2;
+      if(++num == AS_DATAGRAM_BATCH)  {
+        AS_ServerDatagramFlush(server, msgs, num);
+        num = 0;
+      }
+    }
+    next = destination != NULL ? NULL : next->next;
+  }
+  if(num)
+    AS_ServerDatagramFlush(server, msgs, num);
+}
+
+void AS_ServerDispatch(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload, AS_Trace_t *trace, int unreliable) {
+  // frame (without trace) after hooks: forward it or handle it here
+  AS_ConnectedClients_t *destination;
+  AS_Buffer_t *buffer;
+  unsigned int offset;
+  char *name, *copy = NULL;
+  int node, source;
+  
+  source = client->peer ? header->clientSource : client->id;
+  
+  switch(header->payloadType) {
+    // all typed that are forwarded to other clients and handled the same way:
+    case AS_TypeMessage:
+    case AS_TypeFileRequest:
+    case AS_TypeFileAnswer:
+    case AS_TypeFileData:
+    case AS_TypeFragment:
+    case AS_TypeRequest:
+    case AS_TypeResponse:
+      if((header->payloadType == AS_TypeRequest || header->payloadType == AS_TypeResponse) && header->payloadLength < sizeof(AS_Rpc_t)) {
+        fprintf(stderr, "error: server %d: client %d sends unexpected data\n", server->port, client->id);
+        break;
+      }
+      if(header->payloadType == AS_TypeRequest && header->clientDestination == -1) {
+        if(!client->peer)
+          AS_ServerRequest(server, client, header, payload);
+        break;
+      }
+      if(header->clientDestination == -1 || (header->payloadType == AS_TypeFragment &&
+         (!AS_FragmentValid(header, payload) || ((AS_Fragment_t *)payload)->payloadLength > client->in.maxPayload))) {
+        fprintf(stderr, "error: server %d: client %d sends unexpected data\n", server->port, client->id);
+        break;
+      }
+      destination = NULL; // broadcast
+      name = NULL;
+      node = header->clientDestination >= 0 ? (header->clientDestination & AS_NODE_MASK) >> AS_NODE_SHIFT : server->node;
+      if(node != server->node)  { // client of another node: the server of the sender forwards to its server
+        if(client->peer || (destination = server->peers[node]) == NULL) {
+          fprintf(stderr, "server %d: error: client %d sends to unreachable client %d\n", server->port, client->id, header->clientDestination);
+          if(header->payloadType == AS_TypeRequest)
+            AS_ServerRespond(server, client, header, payload, AS_RpcUnreachable, NULL, 0);
+          break;
+        }
+      } else if(header->clientDestination != -2 &&
+         (header->clientDestination < 0 || (destination = AS_IdMapGet(&server->clientMap, header->clientDestination & AS_ID_MASK)) == NULL))  {
+        if(header->clientDestination < 0 || server->mailboxDir == NULL ||
+           (name = AS_IdMapGet(&server->departed, header->clientDestination & AS_ID_MASK)) == NULL) {
+          fprintf(stderr, "server %d: error: client %d sends to unknown client %d\n", server->port, client->id, header->clientDestination);
+          if(header->payloadType == AS_TypeRequest)
+            AS_ServerRespond(server, client, header, payload, AS_RpcUnreachable, NULL, 0);
+          break;
+        }
+      }
+      // forward message to user(s)
+      // header already present, sourceID was set above
+      // large bulk payloads (of clients not fragmenting themselves) are forwarded as fragments
+      if(trace != NULL) {
+        if(!trace->forward)
+          trace->forward = AS_monotonicNsec();
+        if(payload != trace + 1)  { // payload was replaced by a hook: trace and payload in one block again
+          copy = malloc(sizeof(AS_Trace_t) + header->payloadLength);
+          memcpy(copy, trace, sizeof(AS_Trace_t));
+          memcpy(copy + sizeof(AS_Trace_t), payload, header->payloadLength);
+          trace = (AS_Trace_t *)copy;
+        }
+        header->payloadType |= AS_TypeTraced;
+        header->payloadLength += sizeof(AS_Trace_t);
+        payload = trace;
+      }
+      if(unreliable)  // kept over TCP as well, the next server may deliver it as datagram
+        header->payloadType |= AS_TypeUnreliable;
+      offset = 0;
+      do  {
+        buffer = AS_BufferFragment(header, payload, &offset);
+        if(name != NULL)  { // destination is offline -> keep in its mailbox
+          AS_MailboxStore(server, name, buffer);
+        } else if(unreliable) { // datagrams where possible
+          AS_ServerDatagramSend(server, client, destination, buffer);
+        } else if(destination == NULL) { // broadcasting -> send to all clients
+          destination = server->clients;
+          while(destination->next != NULL) {
+            destination = destination->next;
+            if(!destination->peer || (destination->peer > 0 && !client->peer)) // one copy per peer, frames of peers stay here
+              AS_ServerDeliver(server, destination, buffer); // same buffer for all clients
+          }
+          destination = NULL;
+        } else  { // destination specified ->  send only to destination client (channel bits are kept for the receiver)
+          AS_ServerDeliver(server, destination, buffer);
+        }
+        AS_BufferRelease(buffer);
+      } while(offset < header->payloadLength);
+      free(copy);
+      if(header->payloadType == AS_TypeFragment && ((AS_Fragment_t *)payload)->offset > 0)
+        break; // log each message once
+      if(name != NULL)
+        fprintf(stderr, "server %d: data: client %d -> mailbox of %s\n", server->port, source, name);
+      else if(destination == NULL)
+        fprintf(stderr, "server %d: data: client %d -> broadcast\n", server->port, source);
+      else
+        fprintf(stderr, "server %d: data: client %d -> client %d\n", server->port, source, header->clientDestination);
+      break;
+    case AS_TypeAskForClients:
+      // client wants to know who is connected to this server
+      AS_ServerSendClientList(server, client, header, payload);
+      fprintf(stderr, "server %d: sent list of clients to client %d\n", server->port, client->id);
+      break;
+    case AS_TypePresenceSubscribe:
+      // client enables/disables presence frames
+      if(header->payloadLength >= sizeof(int))
+        client->presence = *(int *)payload ? 1 : 0;
+      break;
+    case AS_TypeHeartbeat:
+      // nothing to do, receiving already reset the idle time
+      break;
+    case AS_TypeClientName:
+      if(!client->peer)
+        AS_ServerSetName(server, client, payload, header->payloadLength);
+      break;
+    case AS_TypePeerHello:
+      AS_ServerPeerHello(server, client, payload, header->payloadLength);
+      break;
+    case AS_TypePeerPresence:
+      if(client->peer > 0)
+        AS_ServerPeerPresence(server, client, payload, header->payloadLength);
+      break;
+  }
+}
+
+int AS_HookCall(int port, AS_Hook_t hook, AS_MessageHeader_t *header, void **payload) {
+  // run hook, header fields it must not change are restored afterwards
+  int source = header->clientSource;
+  int result;
+  
+  result = hook(port, header, payload);
+  header->as_identifier = 144;
+  header->clientSource = source;
+  if(*payload == NULL)
+    header->payloadLength = 0;
+  return result;
+}
+
+void* AS_HookThread(void *arg) {
+  // runs hooks of frames queued by the server thread, results go back through a lock-free stack
+  AS_HookWorker_t *worker = arg;
+  AS_Server_t *server = worker->server;
+  AS_HookJob_t *job, *next;
+  void *original;
+  int stop;
+  
+  while(1)  {
+    pthread_mutex_lock(&worker->lock);
+    while(worker->jobs == NULL && !worker->stop)
+      pthread_cond_wait(&worker->cond, &worker->lock);
+    job = worker->jobs;
+    worker->jobs = worker->jobsLast = NULL;
+    stop = worker->stop;
+    pthread_mutex_unlock(&worker->lock);
+    
+    if(job == NULL)
+      break;
+    for(; job != NULL; job = next) {
+      next = job->next;
+      if(job->hook != NULL) {
+        original = job->payload;
+        job->result = AS_HookCall(server->port, job->hook, &job->header, &job->payload);
+        if(job->payload != original)
+          free(original);
+      }
+      do
+        job->next = __atomic_load_n(&server->hookResults, __ATOMIC_RELAXED);
+      while(!__atomic_compare_exchange_n(&server->hookResults, &job->next, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    write(server->wakePipe[1], "h", 1); // wake server thread
+    if(stop)
+      break;
+  }
+  return NULL;
+}
+
+void AS_HookStart(AS_Server_t *server)  {
+  int i;
+  
+  server->hookWorkers = calloc(server->hookWorkersNum, sizeof(AS_HookWorker_t));
+  for(i = 0; i < server->hookWorkersNum; i++) {
+    server->hookWorkers[i].server = server;
+    pthread_mutex_init(&server->hookWorkers[i].lock, NULL);
+    pthread_cond_init(&server->hookWorkers[i].cond, NULL);
+    pthread_create(&server->hookWorkers[i].thread, NULL, &AS_HookThread, &server->hookWorkers[i]);
+  }
+}
+
+int AS_ServerHookFull(AS_Server_t *server, AS_ConnectedClients_t *client)  {
+  // frames waiting for a hook worker count in the memory of their client and the server
+  // checked before each frame is read, so at most the frame being read goes beyond the budget
+  return client->hookJobs && ((server->clientMemory && AS_ConnectionMemory(&client->in, &client->out) + client->hookBytes >= server->clientMemory) ||
+                              (server->serverMemory && server->memory >= server->serverMemory));
+}
+
+void AS_ServerHookPost(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload, AS_Trace_t *trace, int unreliable, AS_Hook_t hook) {
+  // hand a copy of the frame to the worker of its client, never blocks on the hook
+  AS_HookWorker_t *worker;
+  AS_HookJob_t *job;
+  
+  job = calloc(1, sizeof(AS_HookJob_t));
+  job->hook = hook;
+  job->client = client->id;
+  job->header = *header;
+  job->payload = malloc(header->payloadLength + 1);
+  job->size = header->payloadLength;
+  server->memory += job->size;
+  client->hookJobs++;
+  client->hookBytes += job->size;
+  memcpy(job->payload, payload, header->payloadLength);
+  ((char *)job->payload)[header->payloadLength] = '\0'; // terminated like received payloads
+  if(trace != NULL) {
+    job->traced = 1;
+    job->trace = *trace;
+  }
+  job->unreliable = unreliable;
+  worker = &server->hookWorkers[client->id % server->hookWorkersNum];
+  pthread_mutex_lock(&worker->lock);
+  if(worker->jobsLast != NULL)
+    worker->jobsLast->next = job;
+  else
+    worker->jobs = job;
+  worker->jobsLast = job;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+void AS_ServerHookReply(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload) {
+  // hook answers the frame: send it back to the client (channel) it came from
+  AS_Buffer_t *buffer;
+  unsigned int offset;
+  
+  header->clientDestination = header->clientSource;
+  header->clientSource = -1; // server
+  offset = 0;
+  do  {
+    buffer = AS_BufferFragment(header, payload, &offset);
+    AS_ServerSend(server, client, buffer);
+    AS_BufferRelease(buffer);
+  } while(offset < header->payloadLength);
+  fprintf(stderr, "server %d: data: hook -> client %d\n", server->port, client->id);
+}
+
+void AS_ServerHookDone(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload, AS_Trace_t *trace, int unreliable, int result) {
+  switch(result) {
+    case AS_HookForward:
+      AS_ServerDispatch(server, client, header, payload, trace, unreliable);
+      break;
+    case AS_HookReply:
+      AS_ServerHookReply(server, client, header, payload);
+      break;
+    default: // AS_HookDrop
+      break;
+  }
+}
+
+void AS_ServerHookInline(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload, AS_Trace_t *trace, int unreliable) {
+  // frame without a worker hook: direct hook or none, handled in the server thread
+  void *original;
+  int result;
+  
+  if(client->peer || header->payloadType >= AS_HOOKS || server->hooks[header->payloadType] == NULL)  {
+    AS_ServerDispatch(server, client, header, payload, trace, unreliable);
+    return;
+  }
+  original = payload;
+  result = AS_HookCall(server->port, server->hooks[header->payloadType], header, &payload);
+  AS_ServerHookDone(server, client, header, payload, trace, unreliable, result);
+  if(payload != original)
+    free(payload);
+}
+
+void AS_ServerHookResults(AS_Server_t *server) {
+  // frames handled by the workers: forward, answer or drop them (in the order the workers finished them)
+  AS_HookJob_t *job, *next, *list = NULL;
+  AS_ConnectedClients_t *client;
+  
+  job = __atomic_exchange_n(&server->hookResults, NULL, __ATOMIC_ACQUIRE);
+  for(; job != NULL; job = next) { // stack is newest first
+    next = job->next;
+    job->next = list;
+    list = job;
+  }
+  for(job = list; job != NULL; job = next) {
+    next = job->next;
+    client = AS_IdMapGet(&server->clientMap, job->client);
+    if(client != NULL)  {
+      client->hookJobs--;
+      client->hookBytes -= job->size;
+    }
+    if(client != NULL && client->socket != -1 && job->hook == NULL)
+      AS_ServerHookInline(server, client, &job->header, job->payload, job->traced ? &job->trace : NULL, job->unreliable);
+    else if(client != NULL && client->socket != -1)
+      AS_ServerHookDone(server, client, &job->header, job->payload, job->traced ? &job->trace : NULL, job->unreliable, job->result);
+    else
+      fprintf(stderr, "server %d: client %d is gone, frame handled by hook is dropped\n", server->port, job->client);
+    server->memory -= job->size;
+    free(job->payload);
+    free(job);
+  }
+}
+
+void AS_HookStop(AS_Server_t *server) {
+  // workers finish their queues, results are applied before the clients are disconnected
+  int i;
+  
+  for(i = 0; i < server->hookWorkersNum; i++) {
+    pthread_mutex_lock(&server->hookWorkers[i].lock);
+    server->hookWorkers[i].stop = 1;
+    pthread_cond_signal(&server->hookWorkers[i].cond);
+    pthread_mutex_unlock(&server->hookWorkers[i].lock);
+  }
+  for(i = 0; i < server->hookWorkersNum; i++) {
+    pthread_join(server->hookWorkers[i].thread, NULL);
+    pthread_mutex_destroy(&server->hookWorkers[i].lock);
+    pthread_cond_destroy(&server->hookWorkers[i].cond);
+  }
+  AS_ServerHookResults(server);
+  free(server->hookWorkers);
+  server->hookWorkers = NULL;
+}
+
+int AS_ServerFragmentHooked(AS_Server_t *server, AS_MessageHeader_t *header, void *payload) {
+  // 1: fragment of a frame whose type has a hook
+  unsigned int type;
+  
+  if(!AS_FragmentValid(header, payload))
+    return 0; // rejected by AS_ServerDispatch
+  type = ((AS_Fragment_t *)payload)->payloadType & ~(AS_TypeTraced | AS_TypeUnreliable);
+  return type < AS_HOOKS && server->hooks[type] != NULL;
+}
+
+void AS_ServerHandleFrame(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload);
+
+void AS_ServerFragment(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload) {
+  // collect a fragment of a hooked type like the receiving client would, the complete frame is handled like any other
+  AS_Fragment_t *fragment = payload;
+  AS_Reassembly_t *part, *last;
+  AS_MessageHeader_t complete;
+  unsigned int len;
+  
+  len = header->payloadLength - sizeof(AS_Fragment_t);
+  for(part = client->fragments; part != NULL && part->source != header->clientSource; part = part->next);
+  if(fragment->offset == 0) { // first fragment, an incomplete frame of this channel is dropped
+    if(fragment->payloadLength > client->in.maxPayload || (client->in.admit >= 0 && client->fragmentBytes + fragment->payloadLength > client->in.admit)) {
+      fprintf(stderr, "server %d: error: frame of %u bytes from client %d exceeds its limits, connection closed\n", server->port, fragment->payloadLength, client->id);
+      AS_ServerRemoveClient(server, client);
+      return;
+    }
+    if(part == NULL)  {
+      part = calloc(1, sizeof(AS_Reassembly_t));
+      part->source = header->clientSource;
+      part->next = client->fragments;
+      client->fragments = part;
+    }
+    if(part->payload != NULL) {
+      client->fragmentBytes -= part->payloadLength;
+      server->memory -= part->payloadLength;
+      free(part->payload);
+    }
+    part->payloadType = fragment->payloadType;
+    part->payloadLength = fragment->payloadLength;
+    part->have = 0;
+    if((part->payload = malloc(part->payloadLength + 1)) != NULL) {
+      part->payload[part->payloadLength] = '\0';
+      client->fragmentBytes += part->payloadLength;
+      server->memory += part->payloadLength;
+    }
+  }
+  if(part == NULL || part->payload == NULL || fragment->offset != part->have || len > part->payloadLength - part->have) {
+    fprintf(stderr, "error: server %d: client %d sends fragment out of order\n", server->port, client->id);
+    return;
+  }
+  memcpy(part->payload + part->have, fragment + 1, len);
+  part->have += len;
+  if(part->have < part->payloadLength)
+    return;
+  
+  // frame complete
+  complete = *header;
+  complete.payloadType = part->payloadType;
+  complete.payloadLength = part->payloadLength;
+  if(client->fragments == part)  {
+    client->fragments = part->next;
+  } else  {
+    for(last = client->fragments; last->next != part; last = last->next);
+    last->next = part->next;
+  }
+  AS_ServerHandleFrame(server, client, &complete, part->payload);
+  client->fragmentBytes -= part->payloadLength;
+  server->memory -= part->payloadLength;
+  free(part->payload);
+  free(part);
+}
+
+void AS_ServerHandleFrame(AS_Server_t *server, AS_ConnectedClients_t *client, AS_MessageHeader_t *header, void *payload) {
+  AS_Trace_t *trace = NULL;
+  int unreliable;
+  
+  // datagram flag: transport of the frame only, handled (and hooked) like the frame without it
+  unreliable = header->payloadType & AS_TypeUnreliable ? 1 : 0;
+  header->payloadType &= ~AS_TypeUnreliable;
+  if(header->payloadType & AS_TypeTraced) {
+    // traced frame: handled without the trace, which is put in front again when forwarding
+    if(header->payloadLength < sizeof(AS_Trace_t))  {
+      fprintf(stderr, "error: server %d: client %d sends unexpected data\n", server->port, client->id);
+      return;
+    }
+    trace = payload;
+    if(!trace->receive) // first server (frames of peers keep the times of the first one)
+      trace->receive = AS_monotonicNsec();
+    header->payloadType &= ~AS_TypeTraced;
+    header->payloadLength -= sizeof(AS_Trace_t);
+    payload = trace + 1;
+  }
+  
+  // source: client ID plus channel of pooled connections (0 for all others), answers are routed back to it
+  // frames forwarded by peers keep the source set by the server of the sender
+  if(!client->peer)
+    header->clientSource = client->id | (header->clientSource > 0 ? header->clientSource & AS_CHANNEL_MASK : 0);
+  
+  // hooks see frames of own clients only, frames of peers were passed to the hooks of their server
+  // a frame of a hooked type sent in fragments is collected first, the hook sees it complete
+  if(!client->peer && header->payloadType == AS_TypeFragment && AS_ServerFragmentHooked(server, header, payload))  {
+    AS_ServerFragment(server, client, header, payload);
+    return;
+  }
+  if(!client->peer && header->payloadType < AS_HOOKS && server->hooks[header->payloadType] != NULL && !server->hooksDirect[header->payloadType] && server->hookWorkers != NULL) {
+    AS_ServerHookPost(server, client, header, payload, trace, unreliable, server->hooks[header->payloadType]);
+  } else if(client->hookJobs > 0)  {
+    AS_ServerHookPost(server, client, header, payload, trace, unreliable, NULL); // keeps its place behind frames at the worker
+  } else  {
+    AS_ServerHookInline(server, client, header, payload, trace, unreliable);
+  }
+}
+
+
+void AS_ServerRefill(AS_Server_t *server, AS_ConnectedClients_t *client)  {
+  // token bucket of the client (AS_OptRateLimit), shared by TCP and datagrams
+  long long now;
+  
+  now = AS_monotonicMsec();
+  client->tokens += (now - client->tokensTime) * server->rateLimit / 1000;
+  client->tokensTime = now;
+  if(client->tokens > server->rateBurst)
+    client->tokens = server->rateBurst;
+}
+
+void AS_ServerDatagram(AS_Server_t *server, char *data, int len, struct sockaddr_storage *addr, socklen_t addrLen) {
+  // one datagram of a client: hello (endpoint of the client) or a frame, handled like frames received over TCP
+  AS_Datagram_t *prefix = (AS_Datagram_t *)data;
+  AS_MessageHeader_t header;
+  AS_ConnectedClients_t *client;
+  AS_Buffer_t *buffer;
+  
+  if(len < sizeof(AS_Datagram_t) + sizeof(AS_MessageHeader_t))
+    return;
+  memcpy(&header, data + sizeof(AS_Datagram_t), sizeof(AS_MessageHeader_t));
+  if(header.as_identifier != 144 || header.payloadLength != len - sizeof(AS_Datagram_t) - sizeof(AS_MessageHeader_t))
+    return;
+  client = AS_IdMapGet(&server->clientMap, prefix->client);
+  if(client == NULL || client->socket == -1 || client->peer || !client->udpToken || prefix->token != client->udpToken)
+    return; // not (or no longer) offered, or forged
+  // endpoint may change (NAT), the latest one is used
+  if(!client->udpAddrLen)
+    fprintf(stderr, "server %d: datagram channel of client %d is ready\n", server->port, client->id);
+  memcpy(&client->udpAddr, addr, addrLen);
+  client->udpAddrLen = addrLen;
+  if(header.payloadType == AS_TypeDatagramHello)  { // acknowledge over TCP, the client retries until then
+    buffer = AS_BufferNew(sizeof(AS_MessageHeader_t));
+    header.clientSource = -1; // server
+    header.clientDestination = client->id;
+    header.payloadLength = 0;
+    memcpy(buffer->data, &header, sizeof(AS_MessageHeader_t));
+    AS_ServerSend(server, client, buffer);
+    AS_BufferRelease(buffer);
+    return;
+  }
+  if((header.payloadType & ~(AS_TypeTraced | AS_TypeUnreliable)) < AS_TypeMessage)
+    return; // data frames only
+  // charged to the limits of frames over TCP, without tokens, budget or memory left the datagram is dropped
+  if(client->udpWakeup != server->udpWakeup)  {
+    client->udpWakeup = server->udpWakeup;
+    client->udpBytes = 0;
+    client->udpFrames = 0;
+  }
+  if(server->rateLimit)
+    AS_ServerRefill(server, client);
+  if((server->rateLimit && client->tokens < len) || len > server->readBudget - client->udpBytes || client->udpFrames >= server->frameBudget ||
+     (server->serverMemory && server->memory >= server->serverMemory) ||
+     (server->clientMemory && AS_ConnectionMemory(&client->in, &client->out) + client->hookBytes + client->fragmentBytes + len > server->clientMemory)) {
+    server->dropped++;
+    return;
+  }
+  client->tokens -= len;
+  client->udpBytes += len;
+  client->udpFrames++;
+  data[len] = '\0'; // terminated like received payloads
+  header.payloadType |= AS_TypeUnreliable;
+  AS_ServerHandleFrame(server, client, &header, data + sizeof(AS_Datagram_t) + sizeof(AS_MessageHeader_t));
+}
+
+void AS_ServerDatagramReceive(AS_Server_t *server)  {
+  // read datagrams in batches, at most a few batches per wakeup (epoll reports the rest again)
+  struct mmsghdr msgs[AS_DATAGRAM_BATCH];
+  struct iovec iovs[AS_DATAGRAM_BATCH];
+  struct sockaddr_storage addrs[AS_DATAGRAM_BATCH];
+  int i, num, rounds;
+  
+  server->udpWakeup++;
+  for(rounds = 0; rounds < 4; rounds++)  {
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < AS_DATAGRAM_BATCH; i++) {
+      iovs[i].iov_base = server->udpBuffer + i * (AS_DATAGRAM + 1);
+      iovs[i].iov_len = AS_DATAGRAM;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    if((num = recvmmsg(server->udp, msgs, AS_DATAGRAM_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+      return;
+    for(i = 0; i < num; i++)
+      if(!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+        AS_ServerDatagram(server, iovs[i].iov_base, msgs[i].msg_len, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+    if(num < AS_DATAGRAM_BATCH)
+      return;
+  }
+}
+
+void AS_ServerReceive(AS_Server_t *server, AS_ConnectedClients_t *client) {
+  // some client sends data, handle complete frames until its budget for this wakeup is used up
+  AS_MessageHeader_t header;
+  void *payload;
+  int rv, budget, frames, start;
+  
+  budget = server->readBudget;
+  frames = server->frameBudget;
+  if(server->rateLimit) {
+    AS_ServerRefill(server, client);
+    if(client->tokens < budget)
+      budget = client->tokens;
+  }
+  start = budget;
+  if(server->serverMemory && server->memory >= server->serverMemory)
+    budget = 0; // memory used up: nothing is read until queued frames are written
+  if(AS_ServerHookFull(server, client))
+    budget = 0; // frames at the hook worker fill the budget of this client
+  if(budget > 0)  {
+    rv = 2;
+    while(client->socket != -1 && frames > 0 && !AS_ServerHookFull(server, client) && (rv = AS_ReceiveFrame(client->socket, &client->in, &header, &payload, &budget)) == 1) {
+      AS_ServerHandleFrame(server, client, &header, payload);
+      free(payload);
+      frames--;
+    }
+    client->tokens -= start - budget; // bytes read
+  } else  {
+    rv = 2;
+  }
+  if(client->socket == -1)
+    return;
+  if(rv == 0) { // everything read, epoll reports new data
+    AS_ServerWatch(server, client, client->epollOut, 0);
+    return;
+  }
+  if(rv == 1 || rv == 2)  { // budget used up
+    if(server->rateLimit && client->tokens <= 0)  {
+      // throttled: reading is paused until the bucket has tokens for one budget again
+      AS_ServerWatch(server, client, client->epollOut, 1);
+      client->throttledSince = AS_monotonicMsec();
+      client->throttledUntil = client->throttledSince + 1 + ((server->rateBurst < AS_BUFFLEN ? server->rateBurst : AS_BUFFLEN) - client->tokens) * 1000 / server->rateLimit;
+      AS_TimerRemove(&client->timer);
+      AS_ServerSchedule(server, client);
+    } else if((server->serverMemory && server->memory >= server->serverMemory) || AS_ServerHookFull(server, client))  {
+      // paused like a throttled client, tried again with the next tick
+      AS_ServerWatch(server, client, client->epollOut, 1);
+      client->throttledSince = AS_monotonicMsec();
+      client->throttledUntil = client->throttledSince + AS_TICK;
+      AS_TimerRemove(&client->timer);
+      AS_ServerSchedule(server, client);
+    } else  {
+      AS_ServerRunQueuePush(server, client);
+    }
+    return;
+  }
+  if(rv == -1)  { // client closes connection (or error)
+    fprintf(stderr, "server %d: client %d closed connection\n", server->port, client->id);
+  } else if(rv == -3) {
+    fprintf(stderr, "server %d: error: frame of %u bytes from client %d exceeds its limits, connection closed\n", server->port, client->in.header.payloadLength, client->id);
+    server->rejected++;
+  } else  {
+    // incorrect header, stream is out of sync
+    fprintf(stderr, "server %d: error: received incorrect header from %d!\n", server->port, client->id);
+  }
+  AS_ServerRemoveClient(server, client); // other clients are informed with next presence frame
+}
+
+//////////////////////////////
+//         HANDOVER         //
+//////////////////////////////
+
+// zero-downtime restart: a server started in another process with the same port and AS_SetHandover directory
+// connects to <dir>/<port>.sock, the running server passes its sockets (SCM_RIGHTS) and the registry of its
+// clients, the new server continues with them and the running one ends without telling its clients
+
+void AS_HandoverAddress(AS_Server_t *server, struct sockaddr_un *addr)  {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, server->handoverPath, sizeof(addr->sun_path) - 1);
+}
+
+void AS_HandoverTimeout(int sock) {
+  // blocking I/O of the successor on the handover socket, a running server that does not answer ends the handover
+  struct timeval tv;
+  tv.tv_sec = AS_HANDOVER_TIMEOUT / 1000;
+  tv.tv_usec = (AS_HANDOVER_TIMEOUT % 1000) * 1000;
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+void AS_HandoverSets(AS_Server_t *server, AS_IdSet_t **sets)  {
+  // presence sets by their number in AS_HandoverIds records
+  sets[0] = &server->snapshot;
+  sets[1] = &server->pendingJoins;
+  sets[2] = &server->pendingLeaves;
+  sets[3] = &server->peerJoins;
+  sets[4] = &server->peerLeaves;
+}
+
+int AS_HandoverRead(int sock, void *data, unsigned int len) { // returns 1 if all bytes were read
+  int n;
+  while(len > 0)  {
+    n = recv(sock, data, len, 0);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return 0; // closed, error or timeout
+    data += n;
+    len -= n;
+  }
+  return 1;
+}
+
+char* AS_HandoverAppend(AS_Server_t *server, int type, int fd, unsigned int len)  {
+  // queue one record, fd (-1: none) is attached to its first byte, returns its data to be filled in
+  AS_HandoverOut_t *out = malloc(sizeof(AS_HandoverOut_t) + sizeof(AS_HandoverRecord_t) + len);
+  AS_HandoverRecord_t *record = (AS_HandoverRecord_t *)out->data;
+  
+  record->type = type;
+  record->fd = fd != -1;
+  record->len = len;
+  out->fd = fd;
+  out->len = sizeof(AS_HandoverRecord_t) + len;
+  out->sent = 0;
+  out->next = NULL;
+  if(server->handoverTail != NULL)
+    server->handoverTail->next = out;
+  else
+    server->handoverHead = out;
+  server->handoverTail = out;
+  return (char *)(record + 1);
+}
+
+void AS_HandoverSend(AS_Server_t *server, int type, int fd, void *data, unsigned int len) {
+  memcpy(AS_HandoverAppend(server, type, fd, len), data, len);
+}
+
+int AS_HandoverWrite(AS_Server_t *server) {
+  // write queued records without blocking: 1 when all are written, 0 when the successor has to read first, -1 on error
+  char control[CMSG_SPACE(sizeof(int))];
+  AS_HandoverOut_t *out;
+  struct cmsghdr *cmsg;
+  struct epoll_event ev;
+  struct msghdr msg;
+  struct iovec iov;
+  int n;
+  
+  while((out = server->handoverHead) != NULL)  {
+    iov.iov_base = out->data + out->sent;
+    iov.iov_len = out->len - out->sent;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(out->fd != -1 && !out->sent) {
+      memset(control, 0, sizeof(control));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &out->fd, sizeof(int));
+    }
+    n = sendmsg(server->handoverSock, &msg, MSG_NOSIGNAL);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(n <= 0)
+      return -1;
+    server->handoverDeadline = AS_monotonicMsec() + AS_HANDOVER_TIMEOUT;
+    out->sent += n;
+    if(out->sent < out->len)
+      continue;
+    server->handoverHead = out->next;
+    free(out);
+  }
+  if(server->handoverHead == NULL)
+    server->handoverTail = NULL;
+  if(server->handoverOut != (server->handoverHead != NULL)) { // woken when the successor has read
+    server->handoverOut = server->handoverHead != NULL;
+    ev.events = EPOLLIN | (server->handoverOut ? EPOLLOUT : 0);
+    ev.data.ptr = &server->handoverSock;
+    epoll_ctl(server->epoll, EPOLL_CTL_MOD, server->handoverSock, &ev);
+  }
+  return server->handoverHead == NULL;
+}
+
+int AS_HandoverReceive(int sock, AS_HandoverRecord_t *record, int *fd, char **data)  {
+  // next record: *fd is the attached socket or -1, *data is malloc()ed (NULL if empty), returns 0 on error
+  char control[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  int n;
+  
+  *fd = -1;
+  *data = NULL;
+  iov.iov_base = record;
+  iov.iov_len = sizeof(AS_HandoverRecord_t);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+  if(n <= 0)
+    return 0;
+  for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  if(AS_HandoverRead(sock, (char *)record + n, sizeof(AS_HandoverRecord_t) - n) && record->fd == (*fd != -1) && record->len <= INT_MAX) {
+    if(!record->len)
+      return 1;
+    if((*data = malloc(record->len)) != NULL && AS_HandoverRead(sock, *data, record->len))
+      return 1;
+  }
+  if(*fd != -1)
+    close(*fd);
+  free(*data);
+  *data = NULL;
+  return 0;
+}
+
+char* AS_HandoverPack(AS_ConnectedClients_t *client, unsigned int *len) {
+  // registry entry, received bytes and queued frames of one client as AS_HandoverClient record
+  AS_HandoverClient_t *state;
+  AS_HandoverFrame_t frame;
+  AS_OutFrame_t *lists[AS_PrioNum+1], *out;
+  char *data, *p;
+  int i;
+  
+  lists[0] = client->out.head; // scheduled frames first, they keep their order on the wire
+  for(i = 0; i < AS_PrioNum; i++)
+    lists[i+1] = client->out.lanes[i].head;
+  *len = sizeof(AS_HandoverClient_t) + client->remote.num * sizeof(int) + client->in.end - client->in.start;
+  if(client->in.haveHeader)
+    *len += client->in.payloadHave;
+  for(i = 0; i <= AS_PrioNum; i++)
+    for(out = lists[i]; out != NULL; out = out->next)
+      *len += sizeof(AS_HandoverFrame_t) + out->buffer->len;
+  
+  data = calloc(1, *len);
+  state = (AS_HandoverClient_t *)data;
+  state->id = client->id;
+  state->presence = client->presence;
+  state->peer = client->peer;
+  memcpy(state->name, client->name, AS_NAMELEN);
+  state->mailbox = client->mailbox;
+  state->udpToken = client->udpToken;
+  state->udpAddr = client->udpAddr;
+  state->udpAddrLen = client->udpAddrLen;
+  state->remoteNum = client->remote.num;
+  state->haveHeader = client->in.haveHeader;
+  state->header = client->in.header;
+  state->payloadHave = client->in.haveHeader ? client->in.payloadHave : 0;
+  state->buffered = client->in.end - client->in.start;
+  p = data + sizeof(AS_HandoverClient_t);
+  memcpy(p, client->remote.ids, client->remote.num * sizeof(int));
+  p += client->remote.num * sizeof(int);
+  if(state->payloadHave)
+    memcpy(p, client->in.payload, state->payloadHave);
+  p += state->payloadHave;
+  if(state->buffered)
+    memcpy(p, client->in.data + client->in.start, state->buffered);
+  p += state->buffered;
+  for(i = 0; i <= AS_PrioNum; i++)  {
+    for(out = lists[i]; out != NULL; out = out->next) {
+      frame.len = out->buffer->len;
+      frame.sent = out->sent;
+      frame.scheduled = i == 0;
+      memcpy(p, &frame, sizeof(frame));
+      p += sizeof(frame);
+      memcpy(p, out->buffer->data, out->buffer->len);
+      p += out->buffer->len;
+      state->frames++;
+    }
+  }
+  return data;
+}
+
+void AS_HandoverSendServer(AS_Server_t *server) {
+  // first record: listening socket, no client is accepted anymore (IDs stay as they are)
+  AS_HandoverServer_t state;
+  
+  state.version = AS_VERSION;
+  state.node = server->node;
+  state.nextId = server->nextId;
+  state.presenceVersion = server->presenceVersion; // presence frames wait for the successor
+  AS_HandoverSend(server, AS_HandoverServer, server->listener, &state, sizeof(state));
+}
+
+void AS_HandoverSendClient(AS_Server_t *server, AS_ConnectedClients_t *client)  {
+  // client goes to the successor: its state is sent as it is now, it is not read or written here anymore
+  unsigned int len;
+  char *data;
+  
+  data = AS_HandoverPack(client, &len);
+  AS_HandoverSend(server, AS_HandoverClient, client->socket, data, len);
+  free(data);
+  client->handedOver = 1;
+  AS_ServerRunQueueRemove(server, client);
+  AS_ServerWatch(server, client, 0, 1);
+  AS_TimerRemove(&client->timer);
+}
+
+void AS_HandoverForward(AS_Server_t *server, AS_ConnectedClients_t *client, AS_Buffer_t *buffer)  {
+  // frame for a client sent before: queued by the successor behind the frames of its state
+  char *data = AS_HandoverAppend(server, AS_HandoverQueued, -1, sizeof(int) + buffer->len);
+  memcpy(data, &client->id, sizeof(int));
+  memcpy(data + sizeof(int), buffer->data, buffer->len);
+}
+
+void AS_HandoverSendRegistry(AS_Server_t *server) {
+  // last records, when all clients are sent: datagram socket, presence and departed clients
+  AS_PresenceDelta_t *delta;
+  AS_PresenceBatch_t *batch;
+  AS_IdSet_t *sets[AS_HandoverSetNum];
+  unsigned int len;
+  char *data;
+  int i;
+  
+  if(server->udp != -1)
+    AS_HandoverSend(server, AS_HandoverDatagram, server->udp, NULL, 0);
+  AS_HandoverSets(server, sets);
+  for(i = 0; i < AS_HandoverSetNum; i++)  {
+    data = AS_HandoverAppend(server, AS_HandoverIds, -1, (sets[i]->num + 1) * sizeof(int));
+    *(int *)data = i;
+    memcpy(data + sizeof(int), sets[i]->ids, sets[i]->num * sizeof(int));
+  }
+  for(i = 0; i < AS_PRESENCE_HISTORY; i++)  {
+    batch = &server->presenceHistory[i];
+    if(!batch->toVersion)
+      continue;
+    len = sizeof(AS_PresenceDelta_t) + (batch->leaveNum + batch->joinNum) * sizeof(int);
+    delta = (AS_PresenceDelta_t *)AS_HandoverAppend(server, AS_HandoverHistory, -1, len);
+    delta->fromVersion = batch->toVersion - 1;
+    delta->toVersion = batch->toVersion;
+    delta->leaveNum = batch->leaveNum;
+    delta->joinNum = batch->joinNum;
+    memcpy(delta + 1, batch->ids, (batch->leaveNum + batch->joinNum) * sizeof(int));
+  }
+  for(i = 0; i < server->departed.size; i++)  {
+    if(server->departed.keys[i] < 0)
+      continue;
+    data = AS_HandoverAppend(server, AS_HandoverDeparted, -1, sizeof(int) + strlen(server->departed.values[i]) + 1);
+    *(int *)data = server->departed.keys[i];
+    strcpy(data + sizeof(int), server->departed.values[i]);
+  }
+  AS_HandoverSend(server, AS_HandoverEnd, -1, NULL, 0);
+}
+
+void AS_HandoverRelease(AS_Server_t *server)  {
+  // drop all clients without a word, their sockets stay open in the other process
+  AS_ConnectedClients_t *client;
+  
+  while((client = server->clients->next) != NULL) {
+    server->clients->next = client->next;
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, client->socket, NULL); // still open elsewhere, close() does not remove it
+    close(client->socket);
+    AS_TimerRemove(&client->timer);
+    AS_InBufferFree(&client->in);
+    AS_OutQueueClear(&client->out);
+    AS_IdSetFree(&client->remote);
+    free(client);
+  }
+  server->clientsNum = 0;
+  server->flushList = NULL;
+  server->runHead = server->runTail = NULL;
+  server->runNum = 0;
+  memset(server->peers, 0, sizeof(server->peers));
+  AS_IdMapFree(&server->clientMap);
+}
+
+int AS_ServerRestoreClient(AS_Server_t *server, int sock, char *data, unsigned int len)  {
+  // client handed over by the server running before: same ID, registry entry and queues, returns 0 if invalid
+  AS_HandoverClient_t *state = (AS_HandoverClient_t *)data;
+  AS_HandoverFrame_t frame;
+  AS_ConnectedClients_t *client;
+  AS_OutFrame_t *out;
+  AS_Buffer_t *buffer;
+  struct epoll_event ev;
+  char *p = data + sizeof(AS_HandoverClient_t), *end = data + len;
+  int i;
+  
+  if(len < sizeof(AS_HandoverClient_t) || state->remoteNum < 0 || state->buffered < 0 || state->frames < 0 ||
+     state->peer < -1 || state->peer > AS_NODE_MAX || (state->peer > 0 && server->peers[state->peer] != NULL) ||
+     (state->haveHeader && (state->payloadHave > state->header.payloadLength || state->header.payloadLength > AS_PAYLOAD_MAX)) || (!state->haveHeader && state->payloadHave) ||
+     end - p < (long long)state->remoteNum * sizeof(int) + state->payloadHave + state->buffered)
+    return 0;
+  
+  client = calloc(1, sizeof(AS_ConnectedClients_t));
+  client->socket = sock;
+  client->id = state->id;
+  client->presence = state->presence;
+  client->peer = state->peer;
+  memcpy(client->name, state->name, AS_NAMELEN-1);
+  client->udpToken = state->udpToken;
+  client->udpAddr = state->udpAddr;
+  client->udpAddrLen = state->udpAddrLen;
+  for(i = 0; i < state->remoteNum; i++, p += sizeof(int))
+    AS_IdSetAdd(&client->remote, *(int *)p);
+  AS_SocketOptions(sock, server->config.option);
+  AS_InBufferInit(&client->in, server->config.option);
+  client->in.account = &server->memory;
+  client->out.account = &server->memory;
+  if(client->peer)
+    client->in.admit = -1; // peers carry the frames of many clients, their budgets apply at their servers
+  
+  // bytes the server running before has read already: frame in progress and unparsed rest
+  if(state->haveHeader) {
+    client->in.header = state->header;
+    client->in.haveHeader = 1;
+    client->in.payloadHave = state->payloadHave;
+    if(state->header.payloadLength) {
+      client->in.payload = malloc(state->header.payloadLength + 1);
+      client->in.payload[state->header.payloadLength] = '\0';
+      memcpy(client->in.payload, p, state->payloadHave);
+      server->memory += state->header.payloadLength;
+    }
+    p += state->payloadHave;
+  }
+  if(state->buffered > client->in.size)
+    client->in.size = state->buffered;
+  client->in.data = malloc(client->in.size);
+  server->memory += client->in.size;
+  memcpy(client->in.data, p, state->buffered);
+  client->in.end = state->buffered;
+  p += state->buffered;
+  client->in.lastRecv = AS_monotonicMsec(); // idle time starts now
+  client->in.frameStart = state->haveHeader || state->buffered ? client->in.lastRecv : 0;
+  
+  // queued frames: scheduled ones continue where the server running before stopped (maybe within a frame)
+  for(i = 0; i < state->frames; i++)  {
+    if(end - p < sizeof(frame))
+      break;
+    memcpy(&frame, p, sizeof(frame));
+    p += sizeof(frame);
+    if(frame.len < sizeof(AS_MessageHeader_t) || frame.sent < 0 || frame.sent >= frame.len || (!frame.scheduled && frame.sent) || end - p < frame.len)
+      break;
+    buffer = AS_BufferNew(frame.len);
+    memcpy(buffer->data, p, frame.len);
+    p += frame.len;
+    if(frame.scheduled) {
+      out = calloc(1, sizeof(AS_OutFrame_t));
+      out->buffer = buffer; // queue takes over the reference
+      out->sent = frame.sent;
+      if(client->out.tail != NULL)
+        client->out.tail->next = out;
+      else
+        client->out.head = out;
+      client->out.tail = out;
+      client->out.wireBytes += frame.len - frame.sent;
+      client->out.bytes += frame.len - frame.sent;
+      server->memory += frame.len - frame.sent;
+    } else  {
+      AS_OutQueuePush(&client->out, buffer);
+      AS_BufferRelease(buffer);
+    }
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = client;
+  if(i < state->frames || epoll_ctl(server->epoll, EPOLL_CTL_ADD, sock, &ev) == -1)  {
+    AS_InBufferFree(&client->in);
+    AS_OutQueueClear(&client->out);
+    AS_IdSetFree(&client->remote);
+    free(client);
+    return 0;
+  }
+  client->lastSend = client->in.lastRecv;
+  client->tokens = server->rateBurst;
+  client->tokensTime = client->in.lastRecv;
+  client->timer.data = client;
+  if(server->mailboxDir != NULL && state->mailbox && client->name[0] != '\0')  {
+    client->mailbox = 1; // frames keep going to the mailbox until the replay has caught up
+    client->replayWanted = 1;
+  }
+  
+  // prepend client object to list
+  client->prev = server->clients;
+  client->next = server->clients->next;
+  if(client->next != NULL)
+    client->next->prev = client;
+  server->clients->next = client;
+  server->clientsNum ++;
+  if(!client->peer)
+    AS_IdMapPut(&server->clientMap, client->id, client);
+  else if(client->peer > 0)
+    server->peers[client->peer] = client;
+  AS_ServerSchedule(server, client);
+  if(client->out.bytes > 0)  { // written at the end of the first loop iteration
+    client->dirty = 1;
+    client->flushNext = server->flushList;
+    server->flushList = client;
+  }
+  if(state->buffered)
+    AS_ServerRunQueuePush(server, client); // complete frames might be waiting in the buffer
+  return 1;
+}
+
+int AS_ServerTakeover(AS_Server_t *server, int sock)  {
+  // take sockets and registry of the server running before on this port, returns 1 when it has handed over
+  AS_HandoverRecord_t record;
+  AS_HandoverServer_t *state;
+  AS_PresenceDelta_t *delta;
+  AS_PresenceBatch_t *batch;
+  AS_IdSet_t *sets[AS_HandoverSetNum];
+  AS_ConnectedClients_t *client;
+  AS_Buffer_t *buffer;
+  char *data;
+  int *ids, fd, i, ok = 1, done = 0;
+  
+  AS_HandoverSets(server, sets);
+  while(!done && AS_HandoverReceive(sock, &record, &fd, &data)) {
+    ids = (int *)data;
+    switch(record.type) {
+      case AS_HandoverServer:
+        state = (AS_HandoverServer_t *)data;
+        ok = fd != -1 && record.len == sizeof(AS_HandoverServer_t) && state->version == AS_VERSION && server->listener == -1;
+        if(!ok)
+          break;
+        if(state->node != server->node)
+          fprintf(stderr, "server %d: node %d of the running server is kept\n", server->port, state->node);
+        server->node = state->node; // IDs of the clients carry it
+        server->nextId = state->nextId;
+        server->presenceVersion = state->presenceVersion;
+        server->listener = fd;
+        fd = -1;
+        break;
+      case AS_HandoverDatagram:
+        ok = fd != -1 && server->udp == -1;
+        if(!ok)
+          break;
+        server->udp = fd;
+        server->udpBuffer = malloc(AS_DATAGRAM_BATCH * (AS_DATAGRAM + 1));
+        fd = -1;
+        break;
+      case AS_HandoverIds:
+        ok = record.len >= sizeof(int) && record.len % sizeof(int) == 0 && ids[0] >= 0 && ids[0] < AS_HandoverSetNum;
+        for(i = 1; ok && i < record.len / sizeof(int); i++)
+          AS_IdSetAdd(sets[ids[0]], ids[i]);
+        break;
+      case AS_HandoverHistory:
+        delta = (AS_PresenceDelta_t *)data;
+        ok = record.len >= sizeof(AS_PresenceDelta_t) && delta->toVersion > 0 && delta->leaveNum >= 0 && delta->joinNum >= 0 &&
+             record.len == sizeof(AS_PresenceDelta_t) + (delta->leaveNum + delta->joinNum) * sizeof(int);
+        if(!ok)
+          break;
+        batch = &server->presenceHistory[delta->toVersion % AS_PRESENCE_HISTORY];
+        free(batch->ids);
+        batch->toVersion = delta->toVersion;
+        batch->leaveNum = delta->leaveNum;
+        batch->joinNum = delta->joinNum;
+        batch->ids = malloc((delta->leaveNum + delta->joinNum) * sizeof(int));
+        memcpy(batch->ids, delta + 1, (delta->leaveNum + delta->joinNum) * sizeof(int));
+        break;
+      case AS_HandoverDeparted:
+        ok = record.len > sizeof(int) && data[record.len - 1] == '\0';
+        if(ok && server->mailboxDir != NULL)  {
+          free(AS_IdMapGet(&server->departed, ids[0]));
+          AS_IdMapPut(&server->departed, ids[0], strdup(data + sizeof(int)));
+        }
+        break;
+      case AS_HandoverClient:
+        ok = fd != -1 && AS_ServerRestoreClient(server, fd, data, record.len);
+        if(ok)
+          fd = -1;
+        break;
+      case AS_HandoverQueued:
+        ok = record.len >= sizeof(int) + sizeof(AS_MessageHeader_t);
+        if(!ok)
+          break;
+        if((client = AS_IdMapGet(&server->clientMap, ids[0])) == NULL) // peers are not in the map
+          for(client = server->clients->next; client != NULL && client->id != ids[0]; client = client->next);
+        ok = client != NULL;
+        if(!ok)
+          break;
+        buffer = AS_BufferNew(record.len - sizeof(int));
+        memcpy(buffer->data, data + sizeof(int), buffer->len);
+        AS_ServerSend(server, client, buffer);
+        AS_BufferRelease(buffer);
+        break;
+      case AS_HandoverEnd:
+        done = 1;
+        break;
+      default:
+        ok = 0;
+    }
+    if(fd != -1)
+      close(fd);
+    free(data);
+    if(!ok)
+      break;
+  }
+  if(done && server->listener != -1 && send(sock, "a", 1, MSG_NOSIGNAL) == 1) {
+    close(sock);
+    fprintf(stderr, "server %d: took over %d connections from the running server\n", server->port, server->clientsNum);
+    return 1;
+  }
+  
+  // the running server continues, nothing of it is kept
+  close(sock);
+  fprintf(stderr, "server %d: error: handover from the running server failed\n", server->port);
+  AS_HandoverRelease(server);
+  if(server->listener != -1)
+    close(server->listener);
+  if(server->udp != -1)
+    close(server->udp);
+  free(server->udpBuffer);
+  for(i = 0; i < AS_HandoverSetNum; i++)
+    AS_IdSetFree(sets[i]);
+  for(i = 0; i < AS_PRESENCE_HISTORY; i++)
+    free(server->presenceHistory[i].ids);
+  AS_DepartedFree(server);
+  return 0;
+}
+
+int AS_HandoverConnect(AS_Server_t *server)  {
+  // connection to the handover socket of a server running on this port in another process, -1: none
+  struct sockaddr_un addr;
+  int sock;
+  
+  AS_HandoverAddress(server, &addr);
+  if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+  if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)  {
+    if(errno != ENOENT && errno != ECONNREFUSED)
+      fprintf(stderr, "server %d: error: handover socket %s: %s\n", server->port, server->handoverPath, strerror(errno));
+    close(sock);
+    return -1; // no server running, start as usual
+  }
+  AS_HandoverTimeout(sock);
+  fprintf(stderr, "server %d: taking over from the running server\n", server->port);
+  return sock;
+}
+
+void AS_HandoverListen(AS_Server_t *server) {
+  // successors connect here, the socket file of the server running before is replaced
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  
+  AS_HandoverAddress(server, &addr);
+  unlink(addr.sun_path);
+  if((server->handover = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+     bind(server->handover, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server->handover, 1) == -1) {
+    fprintf(stderr, "server %d: error: handover socket %s: %s\n", server->port, server->handoverPath, strerror(errno));
+    if(server->handover != -1)
+      close(server->handover);
+    server->handover = -1;
+    return;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &server->handover;
+  epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->handover, &ev);
+}
+
+void AS_ServerHandover(AS_Server_t *server)  {
+  // a successor has connected: clients are sent one by one while the others are served (see AS_HandoverStep)
+  struct epoll_event ev;
+  int sock, window;
+  
+  if((sock = accept4(server->handover, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+    return;
+  if(server->handoverSock != -1)  { // one successor at a time, the other one does not start
+    close(sock);
+    return;
+  }
+  fprintf(stderr, "server %d: handover to new server\n", server->port);
+  window = AS_HANDOVER_WINDOW; // clients are sent as fast as the successor reads them
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &window, sizeof(window));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &server->handoverSock;
+  epoll_ctl(server->epoll, EPOLL_CTL_ADD, sock, &ev);
+  server->handoverDeadline = AS_monotonicMsec() + AS_HANDOVER_TIMEOUT;
+  // no new clients: sockets accepted meanwhile are part of the handover, later ones wait in the listen queue
+  server->handedOver = 1;
+  if(server->acceptor != NULL)
+    pthread_join(*server->acceptor, NULL);
+  else
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, server->listener, NULL);
+  AS_ServerTakeHandoff(server);
+  server->handoverSock = sock; // from now on handoffs wait until the handover is done
+  // hooks run in the server thread until the handover is done, their frames are not in two places
+  server->handoverHooks = server->hookWorkers != NULL;
+  if(server->handoverHooks)
+    AS_HookStop(server);
+  AS_HandoverSendServer(server);
+  server->handoverNext = server->clients->next;
+  server->handoverSealed = 0;
+  server->handoverOut = 0;
+}
+
+void AS_HandoverSeal(AS_Server_t *server)  {
+  // all clients are sent: mailbox files are complete, registry and end record follow
+  AS_ConnectedClients_t *client;
+  
+  if(server->udp != -1)
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, server->udp, NULL);
+  if(server->mailboxDir != NULL)  {
+    AS_MailboxStop(server);
+    for(client = server->clients->next; client != NULL; client = client->next)
+      if(client->replayRunning) { // batch was not taken, it is read again
+        client->replayRunning = 0;
+        client->replayWanted = 1;
+      }
+  }
+  AS_HandoverSendRegistry(server);
+  server->handoverSealed = 1;
+}
+
+void AS_HandoverAbort(AS_Server_t *server)  {
+  // successor failed: clients sent to it are served here again, the server continues as before
+  AS_ConnectedClients_t *client;
+  AS_HandoverOut_t *out;
+  struct epoll_event ev;
+  
+  fprintf(stderr, "server %d: error: handover failed, server continues\n", server->port);
+  epoll_ctl(server->epoll, EPOLL_CTL_DEL, server->handoverSock, NULL);
+  close(server->handoverSock);
+  server->handoverSock = -1;
+  while((out = server->handoverHead) != NULL) {
+    server->handoverHead = out->next;
+    free(out);
+  }
+  server->handoverTail = NULL;
+  server->handoverNext = NULL;
+  for(client = server->clients->next; client != NULL; client = client->next) {
+    if(!client->handedOver)
+      continue;
+    client->handedOver = 0;
+    AS_ServerSchedule(server, client);
+    AS_ServerRunQueuePush(server, client); // reading continues, frames queued meanwhile are written
+    if(client->out.bytes > 0 && !client->dirty) {
+      client->dirty = 1;
+      client->flushNext = server->flushList;
+      server->flushList = client;
+    }
+  }
+  ev.events = EPOLLIN;
+  if(server->handoverSealed)  {
+    if(server->udp != -1) {
+      ev.data.ptr = &server->udp;
+      epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->udp, &ev);
+    }
+    if(server->mailboxDir != NULL)  {
+      server->mailboxStop = 0;
+      AS_MailboxStart(server);
+      for(client = server->clients->next; client != NULL; client = client->next)
+        AS_MailboxContinue(server, client);
+    }
+  }
+  server->handoverSealed = 0;
+  if(server->handoverHooks)
+    AS_HookStart(server);
+  server->handedOver = 0;
+  if(server->acceptor != NULL)  {
+    pthread_create(server->acceptor, NULL, &AS_ServerAcceptThread, server);
+  } else  {
+    ev.data.ptr = server;
+    epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->listener, &ev);
+  }
+  AS_ServerTakeHandoff(server); // outgoing peer connections made meanwhile
+}
+
+int AS_HandoverStep(AS_Server_t *server) {
+  // called once per loop iteration while a handover runs: clients are sent as fast as the successor reads them,
+  // the others are served meanwhile, returns 1 when the successor has taken over
+  AS_ConnectedClients_t *client;
+  int rv, n;
+  char ack;
+  
+  while((rv = AS_HandoverWrite(server)) == 1 && !server->handoverSealed)  {
+    if((client = server->handoverNext) != NULL) {
+      server->handoverNext = client->next;
+      AS_HandoverSendClient(server, client);
+    } else  {
+      AS_HandoverSeal(server);
+    }
+  }
+  if(rv == 1) { // everything written, the successor answers when it has taken over
+    while((n = recv(server->handoverSock, &ack, 1, 0)) == -1 && errno == EINTR);
+    if(n == 1)  {
+      fprintf(stderr, "server %d: handed over %d connections\n", server->port, server->clientsNum);
+      epoll_ctl(server->epoll, EPOLL_CTL_DEL, server->handoverSock, NULL);
+      close(server->handoverSock);
+      server->handoverSock = -1;
+      AS_HandoverRelease(server);
+      free(server->acceptor);
+      server->acceptor = NULL;
+      free(server->mailboxDir);
+      server->mailboxDir = NULL;
+      return 1;
+    }
+    if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      rv = -1;
+  }
+  if(rv == -1 || AS_monotonicMsec() > server->handoverDeadline)
+    AS_HandoverAbort(server);
+  return 0;
+}
+
+int AS_ServerListen(AS_Server_t *server)  {
+  // bind listening socket (and datagram socket) to the port of the server, returns 0 on error
+  struct addrinfo *ai_hints, *ai_res, *ai_p;
+  int rv, sock_server;
+  char portstr[6];
+  char ipstr[INET6_ADDRSTRLEN]; 
+  
+  ai_hints = calloc(1, sizeof(struct addrinfo));
+  
+  ai_hints->ai_socktype = SOCK_STREAM;  // TCP
+  ai_hints->ai_flags    = AI_PASSIVE;   // fill in the IP for me please
+  // AddressFamily:
+  switch(server->IPv) {
+    case AS_IPv4:
+      ai_hints->ai_family = AF_INET;
+      break;
+    case AS_IPv6:
+      ai_hints->ai_family = AF_INET6;
+      break;
+    case AS_IPunspec:
+    default:
+      ai_hints->ai_family = AF_UNSPEC;
+      break;
+  }
+  snprintf(portstr, 6, "%d", server->port);  // int to string
+  if((rv = getaddrinfo(NULL, portstr, ai_hints, &ai_res)) != 0) {
+    fprintf(stderr, "server %d: error: getaddrinfo: %s\n", server->port, gai_strerror(rv));
+    return 0;
+  }
+  // loop through all the results and bind to the first working socket
+  for(ai_p = ai_res; ai_p != NULL; ai_p = ai_p->ai_next) {  // struct addrinfo: *serverinfo, *p!!!!
+    // try to open socket (non-blocking: accept() is called until the listen queue is empty)
+    if((sock_server = socket(ai_p->ai_family, ai_p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai_p->ai_protocol)) < 0)  {
+      perror("error: socket:");
+      continue; // if fails -> try next;
+    }
+    // allow restart while old connections are in TIME_WAIT
+    rv = 1;
+    setsockopt(sock_server, SOL_SOCKET, SO_REUSEADDR, &rv, sizeof(rv));
+    // try to bind socket to port
+    if(bind(sock_server, ai_p->ai_addr, ai_p->ai_addrlen) < 0) {
+      close(sock_server);  // if fails: close socket again
+      perror("error: bind:");
+      continue; // and try next;
+    }
+    // if this point is reached, bind worked!
+    // socket is now operational!
+    // socket connected!
+    // print socket information (port and IP version)
+    inet_ntop(ai_p->ai_family, &(ai_p->ai_addr), ipstr, sizeof(ipstr));
+    fprintf(stderr, "server %d: running at [%s]:%s\n", server->port, ipstr, portstr);
+    break;
+  }
+  if(ai_p == NULL) {  // iterated through complete list without binding
+    fprintf(stderr, "server %d: error: failed to bind server to port %s\n", server->port, portstr);
+    return 0;
+  }
+  // datagram channel: UDP socket on the same address and port, without it all frames go over TCP
+  if(server->config.option[AS_OptDatagram]) {
+    if((server->udp = socket(ai_p->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+       bind(server->udp, ai_p->ai_addr, ai_p->ai_addrlen) == -1) {
+      perror("error: datagram socket:");
+      if(server->udp != -1)
+        close(server->udp);
+      server->udp = -1;
+    } else  {
+      AS_SocketOptions(server->udp, server->config.option); // buffers and busy polling, TCP knobs do not apply
+      server->udpBuffer = malloc(AS_DATAGRAM_BATCH * (AS_DATAGRAM + 1));
+    }
+  }
+  // no more need for servinfo, listening socket is already open :)
+  freeaddrinfo(ai_res);
+  freeaddrinfo(ai_hints);
+  ai_p = NULL; ai_res = NULL; ai_hints = NULL;
+  // listen to socket
+  if(listen(sock_server, server->backlog) < 0) {
+    perror("listen");
+    close(sock_server);
+    return 0;
+  }
+  server->listener = sock_server;
+  return 1;
+}
+
+void* AS_ServerThread(void *arg) {
+  AS_Server_t* server = arg;
+  fprintf(stderr, "AS_ServerThread(%d)\n", server->port);
+  AS_SetAffinity(server->config.option[AS_OptAffinity]);
+  
+  // start server now
+  int rv, sock_server, i, handover = 0;
+  struct epoll_event ev, events[64];
+  AS_MessageHeader_t *header; // message header pointer
+  AS_ConnectedClients_t *client; // iteration element
+  AS_Buffer_t *buffer;
+  
+  // init client list
+  // server->clients is root element, first real client will be 'server->clients->next'
+  server->clients = calloc(1,sizeof(AS_ConnectedClients_t));
+  server->clientsNum = 0;
+  server->presenceLast = msec();
+  AS_TimerWheelInit(&server->wheel);
+  
+  // init epoll: listening socket (data = server) or wake pipe of acceptor thread (data = wakePipe)
+  server->epoll = epoll_create1(EPOLL_CLOEXEC);
+  pipe2(server->wakePipe, O_NONBLOCK | O_CLOEXEC);
+  pthread_mutex_init(&server->handoffLock, NULL);
+  ev.events = EPOLLIN;
+  ev.data.ptr = server->wakePipe;
+  epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->wakePipe[0], &ev);
+  
+  // handover: sockets and clients of a server running on this port in another process, otherwise bind the port
+  sock_server = server->handoverPath != NULL ? AS_HandoverConnect(server) : -1;
+  if(sock_server != -1 ? !AS_ServerTakeover(server, sock_server) : !AS_ServerListen(server)) {
+    close(server->epoll);
+    close(server->wakePipe[0]);
+    close(server->wakePipe[1]);
+    pthread_mutex_destroy(&server->handoffLock);
+    free(server->clients);
+    free(server->handoverPath);
+    free(server->peerSecret);
+    server->error = 1;
+    return NULL;
+  }
+  if(server->handoverPath != NULL)
+    AS_HandoverListen(server);
+  if(server->udp != -1) {
+    ev.data.ptr = &server->udp;
+    epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->udp, &ev);
+  }
+  if(server->mailboxDir != NULL)  {
+    AS_MailboxStart(server);
+    for(client = server->clients->next; client != NULL; client = client->next)
+      AS_MailboxContinue(server, client); // replays of clients taken over
+  }
+  for(i = 1; i < AS_HOOKS; i++)
+    if(server->hooks[i] != NULL && !server->hooksDirect[i])
+      break;
+  if(i < AS_HOOKS)
+    AS_HookStart(server);
+  if(server->acceptor != NULL)  {
+    pthread_create(server->acceptor, NULL, &AS_ServerAcceptThread, server);
+  } else  {
+    ev.data.ptr = server;
+    epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->listener, &ev);
+  }
+  
+  server->running = 1;
+  // server is now running, calling process can read this variable and return
+  
+  ///////////////////////////////////////////////////////////////////////////////////////
+  // main server loop
+  while(!server->stop) {
+    // Use epoll_wait() to wait for the next incomming message OR connection!
+    // in order to react to the main thread, implement timeout of 10 millisec
+    // don't wait while clients in the run queue have work left
+    rv = epoll_wait(server->epoll, events, 64, server->runNum ? 0 : 10);
+    AS_PresenceFlush(server); // send collected joins/leaves if interval passed
+    AS_TimerWheelAdvance(&server->wheel, &AS_ServerTimer, server); // heartbeats and timeouts
+    // clients queued in earlier iterations continue first (round robin), each with a new budget
+    for(i = server->runNum; i > 0; i--)
+      AS_ServerReceive(server, AS_ServerRunQueuePop(server));
+    // timeout is used in order to react to shutdown event
+    // epoll_wait() errors are ignored, just repeat loop
+    for(i = 0; i < rv; i++) {
+      if(events[i].data.ptr == server)  {
+        // this socket is the server listening socket!
+        // -> accept all new connections here!
+        while((sock_server = AS_ServerAcceptOne(server->listener, server->port)) != -1)
+          AS_ServerAddClient(server, sock_server, 0);
+      } else if(events[i].data.ptr == &server->udp) {
+        AS_ServerDatagramReceive(server);
+      } else if(events[i].data.ptr == &server->handover)  {
+        handover = 1; // after this iteration, when no event refers to a client anymore
+      } else if(events[i].data.ptr == &server->handoverSock)  {
+        // successor has read or answered, the handover continues after this iteration
+      } else if(events[i].data.ptr == server->wakePipe) {
+        // acceptor thread has new connections, mailbox thread has replayed frames or hook workers are done
+        AS_ServerTakeHandoff(server);
+        if(server->mailboxDir != NULL)
+          AS_MailboxTakeResults(server);
+        if(server->hookWorkers != NULL)
+          AS_ServerHookResults(server);
+      } else  {
+        client = events[i].data.ptr;
+        if(client->socket != -1 && (events[i].events & EPOLLOUT)) { // socket writable again
+          if(AS_OutQueueFlush(client->socket, &client->out) == -1)  {
+            AS_ServerRemoveClient(server, client);
+          } else  {
+            AS_ServerWatchOut(server, client, client->out.bytes > 0);
+            if(server->mailboxDir != NULL)
+              AS_MailboxContinue(server, client);
+          }
+        }
+        if(client->socket != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+          AS_ServerReceive(server, client);
+      }
+    }
+    if(server->memory > server->memoryPeak)
+      server->memoryPeak = server->memory;
+    AS_ServerFlush(server); // write frames queued in this iteration
+    if(handover)
+      AS_ServerHandover(server);
+    handover = 0;
+    if(server->handoverSock != -1 && AS_HandoverStep(server))
+      break; // clients belong to the new server now
+  }
+  if(server->handoverSock != -1)
+    AS_HandoverAbort(server); // stopped during the handover
+  
+  // some thread has called this server to stop
+  //fprintf(stderr, "AS_ServerThread: server on port %d is shutting down NOW\n", server->port);
+  if(server->acceptor != NULL)
+    pthread_join(*(server->acceptor), NULL);
+  AS_ServerTakeHandoff(server); // sockets accepted during shutdown
+  if(server->hookWorkers != NULL)
+    AS_HookStop(server);
+  // disconnect users...
+  buffer = AS_BufferNew(sizeof(AS_MessageHeader_t));
+  header = (AS_MessageHeader_t *)buffer->data;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = -1;              // Server
+  header->clientDestination = -2;         // input clientID here, -2 = broadcast
+  header->payloadType = AS_TypeShutdown;  // Type of Packet
+  header->payloadLength = 0;              // len of payload in byte
+  client = server->clients;
+  while(client->next != NULL) {
+    client = client->next;
+    AS_ServerSend(server, client, buffer);
+  }
+  AS_BufferRelease(buffer);
+  AS_ServerFlush(server);
+  
+  // close client sockets and free client list
+  while(server->clients->next != NULL)
+    AS_ServerRemoveClient(server, server->clients->next); // frames not sent yet go to mailboxes
+  AS_ServerFlush(server);
+  if(server->mailboxDir != NULL)
+    AS_MailboxStop(server);
+  AS_DepartedFree(server);
+  free(server->mailboxDir);
+  server->mailboxDir = NULL;
+  free(server->clients);
+  AS_IdMapFree(&server->clientMap);
+  AS_IdSetFree(&server->snapshot);
+  AS_IdSetFree(&server->pendingJoins);
+  AS_IdSetFree(&server->pendingLeaves);
+  AS_IdSetFree(&server->peerJoins);
+  AS_IdSetFree(&server->peerLeaves);
+  for(i = 0; i < AS_PRESENCE_HISTORY; i++)
+    free(server->presenceHistory[i].ids);
+  
+  // close socket
+  close(server->listener);
+  if(server->udp != -1)
+    close(server->udp);
+  free(server->udpBuffer);
+  if(server->handover != -1)  {
+    close(server->handover);
+    if(!server->handedOver) // otherwise the socket file belongs to the new server
+      unlink(server->handoverPath);
+  }
+  free(server->handoverPath);
+  server->handoverPath = NULL;
+  free(server->peerSecret);
+  server->peerSecret = NULL;
+  close(server->epoll);
+  close(server->wakePipe[0]);
+  close(server->wakePipe[1]);
+  pthread_mutex_destroy(&server->handoffLock);
+  // finish up
+  server->running = 0;
+  if(!server->handedOver) // handed over: the entry stays until AS_ServerStop(port) or the next start on this port
+    server->port = 0;
+  return;
+}
+
+int AS_ServerStart(int port, int IPv)  {
+  return AS_ServerStartEx(port, IPv, NULL);
+}
+
+int AS_ServerStartEx(int port, int IPv, AS_Config_t *config)  {
+  if(!AS_initialized) AS_init();
+  int *options = config != NULL ? config->option : AS_Options;
+  AS_Server_t *server, *last;
+  int i;
+  
+  fprintf(stderr, "AS_startServer(%d)\n", port);
+    
+  // check if port in range
+  if(port > AS_MAXPORT || port <= 0) {
+    fprintf(stderr, "error: AS_startServer(%d): port number out of range\n", port);
+    return 0;
+  }
+  
+  if(options[AS_OptNodeId] > AS_NODE_MAX) {
+    fprintf(stderr, "error: AS_startServer(%d): node ID out of range\n", port);
+    return 0;
+  }
+  
+  if(AS_HandoverDir != NULL && strlen(AS_HandoverDir) + sizeof("/65535.sock") > sizeof(((struct sockaddr_un *)0)->sun_path))  {
+    fprintf(stderr, "error: AS_startServer(%d): handover directory name too long\n", port);
+    return 0;
+  }
+  
+  // a server that has handed this port over to another process has ended, its entry is freed
+  last = AS_ServerList;
+  while((server = last->next) != NULL)  {
+    if(server->port == port && server->handedOver && !server->running)  {
+      pthread_join(*(server->thread), NULL);
+      last->next = server->next;
+      free(server->thread);
+      free(server);
+    } else  {
+      last = server;
+    }
+  }
+  
+  // check if there is already an AS server with this port number
+  if(AS_ServerIsRunning(port))  {
+    fprintf(stderr, "error: AS_startServer(%d): there is already an AS_Server on this port\n", port);
+    return 0;
+  }
+  
+  // create new element
+  AS_Server_t* newServer = calloc(1, sizeof(AS_Server_t));
+  // init element
+  newServer->IPv = IPv;
+  newServer->port = port;
+  newServer->listener = -1;
+  newServer->udp = -1;
+  newServer->handover = -1;
+  newServer->handoverSock = -1;
+  newServer->backlog = options[AS_OptBacklog];
+  newServer->heartbeat = options[AS_OptHeartbeat];
+  newServer->idleTimeout = options[AS_OptIdleTimeout];
+  newServer->readTimeout = options[AS_OptReadTimeout];
+  newServer->readBudget = options[AS_OptReadBudget] ? options[AS_OptReadBudget] : INT_MAX;
+  newServer->frameBudget = options[AS_OptFrameBudget] ? options[AS_OptFrameBudget] : INT_MAX;
+  newServer->rateLimit = options[AS_OptRateLimit];
+  newServer->rateBurst = options[AS_OptRateBurst] ? options[AS_OptRateBurst] : options[AS_OptRateLimit];
+  newServer->clientMemory = options[AS_OptClientMemory];
+  newServer->serverMemory = options[AS_OptServerMemory];
+  if(AS_MailboxDir != NULL)
+    newServer->mailboxDir = strdup(AS_MailboxDir);
+  newServer->mailboxSegment = options[AS_OptMailboxSegment];
+  newServer->mailboxSize = options[AS_OptMailboxSize];
+  newServer->mailboxAge = options[AS_OptMailboxAge];
+  newServer->mailboxQueue = options[AS_OptMailboxQueue];
+  newServer->mailboxBatch = options[AS_OptMailboxBatch] ? options[AS_OptMailboxBatch] : 1;
+  newServer->node = options[AS_OptNodeId];
+  if(AS_PeerSecret != NULL)
+    newServer->peerSecret = strdup(AS_PeerSecret);
+  if(AS_HandoverDir != NULL)  {
+    newServer->handoverPath = malloc(strlen(AS_HandoverDir) + sizeof("/65535.sock"));
+    sprintf(newServer->handoverPath, "%s/%d.sock", AS_HandoverDir, port);
+  }
+  memcpy(newServer->config.option, options, sizeof(newServer->config.option));
+  memcpy(newServer->handlers, AS_Handlers, sizeof(AS_Handlers));
+  memcpy(newServer->hooks, AS_Hooks, sizeof(AS_Hooks));
+  newServer->hookWorkersNum = options[AS_OptHookWorkers];
+  for(i = 0; i < AS_HOOKS; i++)
+    newServer->hooksDirect[i] = AS_HooksDirect[i] || !newServer->hookWorkersNum; // no workers: all hooks run in the server thread
+  newServer->thread = calloc(1, sizeof(pthread_t));
+  if(options[AS_OptAcceptThread])
+    newServer->acceptor = calloc(1, sizeof(pthread_t));
+  newServer->next = NULL;
+  
+  // start server thread
+  pthread_create(newServer->thread, NULL, &AS_ServerThread, newServer);
+  
+  // thread created, wait for thread to finish start-up
+  while(!newServer->running && !newServer->error)
+    msecsleep(10);
+    
+  // either server started successfully, or an error occured
+  if(newServer->error)  { // error occured, wait for thread to finish
+    pthread_join(*(newServer->thread), NULL);
+    free(newServer->thread);
+    free(newServer->acceptor);
+    free(newServer->mailboxDir);
+    free(newServer);  // free allocated memory and return
+    return 0;
+  }
+  
+  // server has announced that it is now running (without error)
+  // add element to list:
+  server = AS_ServerList;  // let pointer point to root of list
+  while(server->next != NULL)
+    server = server->next;
+  server->next = newServer;
+  return 1;
+}
+
+
+int AS_ServerStop(int port)  {
+  if(!AS_initialized) AS_init();
+  //fprintf(stderr, "AS_stopServer(%d)\n",port);
+  
+  if(port == 0) {
+    while(AS_ServerList->next != NULL) {
+      AS_ServerStop(AS_ServerList->next->port);
+    }
+  }
+  
+  AS_Server_t *server, *last;
+  server = AS_ServerList;
+  while(server->next != NULL) {
+    last = server;
+    server = server->next;
+    if(server->port == port || port == 0)  {
+      server->stop = 1; // call thread to stop and wait
+      pthread_join(*(server->thread), NULL);
+      fprintf(stderr, "server %d is now stopped\n", port);
+      
+      // delete element from linked list
+      last->next = server->next;
+      free(server);
+      return 1; // only return if this single server should be stopped
+    }
+  }
+  return 0;
+}
+
+int AS_ServerGetStats(int port, AS_ServerStats_t *stats)  {
+  // counters are written by the server thread and read without lock (snapshot may be slightly inconsistent)
+  if(!AS_initialized) AS_init();
+  AS_Server_t *server = AS_ServerList;
+  
+  while((server = server->next) != NULL)
+    if(server->port == port && server->running)
+      break;
+  if(server == NULL || stats == NULL)
+    return 0;
+  stats->clients = server->clientsNum;
+  stats->memory = server->memory;
+  stats->memoryPeak = server->memoryPeak;
+  stats->dropped = server->dropped;
+  stats->rejected = server->rejected;
+  return 1;
+}
+
+int AS_ServerPeer(int port, char *host, char *peerPort) {
+  // connect (blocking) and hand the socket over to the server thread, which exchanges hellos and client lists
+  struct addrinfo hints, *res, *p;
+  AS_Server_t *server;
+  AS_Handoff_t *handoff;
+  int rv, sock;
+  
+  if(!AS_initialized) AS_init();
+  server = AS_ServerList;
+  while(server->next != NULL && server->port != port)
+    server = server->next;
+  if(server->port != port || !server->running || !server->node) {
+    fprintf(stderr, "error: AS_ServerPeer(%d): no server with node ID running on this port\n", port);
+    return 0;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if((rv = getaddrinfo(host, peerPort, &hints, &res)) != 0) {
+    fprintf(stderr, "error: AS_ServerPeer(%d): getaddrinfo: %s\n", port, gai_strerror(rv));
+    return 0;
+  }
+  sock = -1;
+  for(p = res; p != NULL; p = p->ai_next) {
+    if((sock = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0)
+      continue;
+    if(connect(sock, p->ai_addr, p->ai_addrlen) == 0)
       break;
+    close(sock);
+    sock = -1;
   }
-  snprintf(portstr, 6, "%d", server->port);  // int to string
-  if((rv = getaddrinfo(NULL, portstr, ai_hints, &ai_res)) != 0) {
-    fprintf(stderr, "server %d: error: getaddrinfo: %s\n", server->port, gai_strerror(rv));
-    server->error = 1;
+  freeaddrinfo(res);
+  if(sock == -1)  {
+    fprintf(stderr, "error: AS_ServerPeer(%d): failed to connect to %s:%s\n", port, host, peerPort);
+    return 0;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  
+  handoff = calloc(1, sizeof(AS_Handoff_t));
+  handoff->socket = sock;
+  handoff->peer = 1;
+  pthread_mutex_lock(&server->handoffLock);
+  handoff->next = server->handoff;
+  server->handoff = handoff;
+  pthread_mutex_unlock(&server->handoffLock);
+  write(server->wakePipe[1], "p", 1); // wake server thread
+  return 1;
+}
+
+
+//##########################################################################################################################
+
+
+//////////////////////////////
+//          CLIENT          //
+//////////////////////////////
+
+AS_Connections_t* AS_ClientGetConnection(int conID)  { // find connection of conID or NULL
+  AS_Connections_t *connection;
+  
+  connection = AS_ConnectionList; // root of con list
+  while(connection->next != NULL) { // iterate through whole list until end
+    connection = connection->next;
+    if(connection->conID == conID)
+      return connection;
+  }
+  return NULL;
+}
+
+int AS_ClientCheckConID(int conID)  { // test if conID is in list of current conections monitored by AS
+  if(!AS_initialized) AS_init();
+  
+  if(AS_ClientGetConnection(conID) != NULL)
+    return true; // found this conID in the list -> return true (1)
+  return false;
+}
+
+AS_Address_t* AS_ResolverCacheGet(char *host, char *port, int *addrNum) {
+  // copy of cached addresses of host:port or NULL, expired entries are removed on the way
+  AS_ResolverCache_t *entry, *last;
+  AS_Address_t *addrs;
+  long long now = AS_monotonicMsec();
+  
+  last = AS_ResolverCache; // root of cache list
+  while((entry = last->next) != NULL) {
+    if(now >= entry->expires) {
+      last->next = entry->next;
+      free(entry->addrs);
+      free(entry->host);
+      free(entry->port);
+      free(entry);
+      continue;
+    }
+    if(strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) {
+      addrs = malloc(entry->addrNum * sizeof(AS_Address_t));
+      memcpy(addrs, entry->addrs, entry->addrNum * sizeof(AS_Address_t));
+      *addrNum = entry->addrNum;
+      return addrs;
+    }
+    last = entry;
+  }
+  return NULL;
+}
+
+void AS_ResolverCacheDrop(char *host, char *port)  {
+  // forget addresses of host:port (e.g. none of them could be connected)
+  AS_ResolverCache_t *entry, *last;
+  
+  last = AS_ResolverCache; // root of cache list
+  while((entry = last->next) != NULL) {
+    if(strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) {
+      last->next = entry->next;
+      free(entry->addrs);
+      free(entry->host);
+      free(entry->port);
+      free(entry);
+      return;
+    }
+    last = entry;
+  }
+}
+
+void AS_ResolverCachePut(char *host, char *port, AS_Address_t *addrs, int addrNum)  {
+  AS_ResolverCache_t *entry;
+  
+  if(!AS_Options[AS_OptResolverTTL] || addrNum == 0)
+    return;
+  AS_ResolverCacheDrop(host, port);
+  entry = calloc(1, sizeof(AS_ResolverCache_t));
+  entry->host = strdup(host);
+  entry->port = strdup(port);
+  entry->addrs = malloc(addrNum * sizeof(AS_Address_t));
+  memcpy(entry->addrs, addrs, addrNum * sizeof(AS_Address_t));
+  entry->addrNum = addrNum;
+  entry->expires = AS_monotonicMsec() + AS_Options[AS_OptResolverTTL];
+  entry->next = AS_ResolverCache->next;
+  AS_ResolverCache->next = entry;
+}
+
+void AS_ClientEventFree(AS_ClientEvent_t *event)  {
+  if(event == NULL)
+    return;
+  free(event->header);
+  free(event->payload);
+  free(event);
+}
+
+void AS_ClientQueueEvent(AS_Connections_t *con, int type, int source, int destination, void *payload, int len) {
+  // append a (synthesized) event to the connections event queue, payload is taken over
+  AS_QueuedEvent_t *queued;
+  
+  queued = calloc(1, sizeof(AS_QueuedEvent_t));
+  queued->event = calloc(1, sizeof(AS_ClientEvent_t));
+  queued->event->header = calloc(1, sizeof(AS_MessageHeader_t));
+  queued->event->header->as_identifier = 144;
+  queued->event->header->clientSource = source;
+  queued->event->header->clientDestination = destination;
+  queued->event->header->payloadType = type;
+  queued->event->header->payloadLength = len;
+  queued->event->payload = payload;
+  if(con->eventsLast != NULL)
+    con->eventsLast->next = queued;
+  else
+    con->events = queued;
+  con->eventsLast = queued;
+}
+
+AS_ClientEvent_t* AS_ClientPopEvent(AS_Connections_t *con)  {
+  AS_QueuedEvent_t *queued = con->events;
+  AS_ClientEvent_t *event;
+  
+  if(queued == NULL)
+    return NULL;
+  con->events = queued->next;
+  if(con->events == NULL)
+    con->eventsLast = NULL;
+  event = queued->event;
+  if(queued->traced)
+    AS_TraceDeliver(&queued->trace);
+  free(queued);
+  return event;
+}
+
+void AS_ClientCallEnd(AS_Call_t *call, int source, void *payload, int len)  {
+  // report response (AS_Rpc_t + result, taken over) to the callback or as AS_TypeResponse event
+  AS_Connections_t *con = call->con;
+  
+  AS_IdMapRemove(&con->calls, call->call);
+  AS_TimerRemove(&call->timer);
+  if(call->callback != NULL)  {
+    call->callback(con->conID, payload, payload + sizeof(AS_Rpc_t), len - sizeof(AS_Rpc_t), call->ctx);
+    free(payload);
+  } else  {
+    AS_ClientQueueEvent(con, AS_TypeResponse, source, con->id, payload, len);
+  }
+  free(call);
+}
+
+void AS_ClientCallFail(AS_Call_t *call, int status)  {
+  // no response will arrive, report status without result
+  AS_Rpc_t *rpc;
+  
+  rpc = calloc(1, sizeof(AS_Rpc_t) + 1);
+  rpc->call = call->call;
+  rpc->method = call->method;
+  rpc->status = status;
+  AS_ClientCallEnd(call, call->recipient, rpc, sizeof(AS_Rpc_t));
+}
+
+void AS_ClientCallTimer(void *ctx, AS_Timer_t *timer)  {
+  // request timed out, called by the timer wheel
+  AS_ClientCallFail(timer->data, AS_RpcTimeout);
+}
+
+void AS_ClientCallsFail(AS_Connections_t *con, int status)  {
+  // connection is gone: all requests fail (callbacks cannot send new ones, connection is closed)
+  int i;
+  for(i = 0; i < con->calls.size; i++)
+    if(con->calls.keys[i] >= 0)
+      AS_ClientCallFail(con->calls.values[i], status);
+  AS_IdMapFree(&con->calls);
+}
+
+void AS_ClientCloseAttempts(AS_Connections_t *con)  {
+  int i;
+  for(i = 0; i < con->addrNum; i++)  {
+    if(con->attempts[i] != -1)
+      close(con->attempts[i]);
+    con->attempts[i] = -1;
+  }
+}
+
+void AS_ClientDatagramClose(AS_Connections_t *con) {
+  if(con->udp != -1)
+    close(con->udp);
+  con->udp = -1;
+  con->udpReady = 0;
+}
+
+void AS_ClientDatagramHello(AS_Connections_t *con)  {
+  // register the UDP endpoint at the server, repeated until acknowledged (datagrams may be lost)
+  char data[sizeof(AS_Datagram_t) + sizeof(AS_MessageHeader_t)];
+  AS_Datagram_t *prefix = (AS_Datagram_t *)data;
+  AS_MessageHeader_t *header = (AS_MessageHeader_t *)(prefix + 1);
+  
+  prefix->client = con->id;
+  prefix->token = con->udpToken;
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = 0;
+  header->clientDestination = -1; // server
+  header->payloadType = AS_TypeDatagramHello;
+  header->payloadLength = 0;
+  send(con->udp, data, sizeof(data), MSG_DONTWAIT);
+  con->udpHello = AS_monotonicMsec();
+}
+
+void AS_ClientDatagramOffer(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload)  {
+  // server offers a datagram channel: same host as the TCP connection, port of the offer
+  AS_DatagramOffer_t *offer = payload;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  
+  if(!con->config.option[AS_OptDatagram] || header->payloadLength < sizeof(AS_DatagramOffer_t) || con->udp != -1)
+    return; // not wanted, all frames go over TCP
+  if(getpeername(con->socket, (struct sockaddr *)&addr, &len) == -1)
+    return;
+  if(addr.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *)&addr)->sin6_port = htons(offer->port);
+  else
+    ((struct sockaddr_in *)&addr)->sin_port = htons(offer->port);
+  if((con->udp = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return;
+  AS_SocketOptions(con->udp, con->config.option);
+  if(connect(con->udp, (struct sockaddr *)&addr, len) == -1) {
+    AS_ClientDatagramClose(con);
     return;
   }
-  // loop through all the results and bind to the first working socket
-  for(ai_p = ai_res; ai_p != NULL; ai_p = ai_p->ai_next) {  // struct addrinfo: *serverinfo, *p!!!!
-    // try to open socket
-    if((sock_server = socket(ai_p->ai_family, ai_p->ai_socktype, ai_p->ai_protocol)) < 0)  {
-      perror("error: socket:");
-      continue; // if fails -> try next;
+  con->udpToken = offer->token;
+  AS_ClientDatagramHello(con);
+}
+
+int AS_ClientDatagram(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload) {
+  // send frame as datagram, returns 0 if it has to go over TCP
+  AS_Datagram_t prefix;
+  struct iovec iov[3];
+  struct msghdr msg;
+  
+  if(con->udp == -1 || sizeof(AS_Datagram_t) + sizeof(AS_MessageHeader_t) + header->payloadLength > AS_DATAGRAM)
+    return 0;
+  if(!con->udpReady)  {
+    if(AS_monotonicMsec() - con->udpHello >= AS_DATAGRAM_RETRY)
+      AS_ClientDatagramHello(con);
+    return 0;
+  }
+  prefix.client = con->id;
+  prefix.token = con->udpToken;
+  iov[0].iov_base = &prefix;
+  iov[0].iov_len = sizeof(AS_Datagram_t);
+  iov[1].iov_base = header;
+  iov[1].iov_len = sizeof(AS_MessageHeader_t);
+  iov[2].iov_base = payload;
+  iov[2].iov_len = header->payloadLength;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+  return sendmsg(con->udp, &msg, MSG_DONTWAIT) != -1;
+}
+
+void AS_ClientClose(AS_Connections_t *con, int type, char *reason) {
+  // connection is dead or could not be established
+  // application receives event of type (AS_TypeShutdown / AS_TypeConnectFailed), conID stays valid until AS_ClientDisconnect
+  int i;
+  fprintf(stderr, "%s\n", reason);
+  AS_TimerRemove(&con->timer);
+  AS_ClientCloseAttempts(con);
+  if(con->socket != -1)
+    close(con->socket);
+  con->socket = -1;
+  AS_ClientDatagramClose(con);
+  con->state = AS_ConClosed;
+  AS_OutQueueClear(&con->out);
+  if(!con->pool)  {
+    AS_ClientCallsFail(con, AS_RpcLost); // reported before the closed connection
+    AS_ClientQueueEvent(con, type, -1, con->id, NULL, 0);
+    return;
+  }
+  for(i = 1; i <= AS_CHANNEL_MAX; i++)  // all channels of a pooled connection are gone as well
+    if(con->channels[i] != NULL)  {
+      con->channels[i]->state = AS_ConClosed;
+      AS_ClientCallsFail(con->channels[i], AS_RpcLost);
+      AS_ClientQueueEvent(con->channels[i], type, -1, con->channels[i]->id, NULL, 0);
     }
-    // try to bind socket to port
-    if(bind(sock_server, ai_p->ai_addr, ai_p->ai_addrlen) < 0) {
-      close(sock_server);  // if fails: close socket again
-      perror("error: bind:");
-      continue; // and try next;
+}
+
+void AS_ClientLost(AS_Connections_t *con, char *reason) {
+  AS_ClientClose(con, AS_TypeShutdown, reason);
+}
+
+void AS_ClientFailed(AS_Connections_t *con, char *reason) {
+  char text[512];
+  snprintf(text, sizeof(text), "problems connecting to server [%s]:%s: %s", con->host, con->port, reason);
+  AS_ResolverCacheDrop(con->host, con->port); // resolve again next time
+  AS_ClientClose(con, AS_TypeConnectFailed, text);
+}
+
+void AS_ClientFlush(AS_Connections_t *con)  {
+  // write queued frames without blocking, rest is written by AS_ClientEvent() / AS_ClientPoll()
+  if(con->state != AS_ConEstablished || con->out.bytes == 0)
+    return;
+  if(AS_OutQueueFlush(con->socket, &con->out) == -1)
+    AS_ClientLost(con, "connection to server lost (send)");
+}
+
+int AS_ClientSendAll(AS_Connections_t *con, void *buf, int len) { // queue frame for server, returns len or 0 if connection is closed
+  AS_MessageHeader_t header;
+  AS_Buffer_t *buffer;
+  unsigned int offset = 0;
+  void *payload, *traced = NULL;
+  
+  if(con->state == AS_ConClosed)
+    return 0; // connection lost
+  memcpy(&header, buf, sizeof(AS_MessageHeader_t));
+  payload = buf + sizeof(AS_MessageHeader_t);
+  if(con->traceSample && (header.payloadType & ~AS_TypeUnreliable) >= AS_TypeMessage && (header.payloadType & ~AS_TypeUnreliable) < AS_TypeConnected &&
+     ++con->traceCount >= con->traceSample)  { // sampled: timestamps are collected in front of the payload
+    con->traceCount = 0;
+    traced = calloc(1, sizeof(AS_Trace_t) + header.payloadLength);
+    ((AS_Trace_t *)traced)->send = AS_monotonicNsec();
+    memcpy(traced + sizeof(AS_Trace_t), payload, header.payloadLength);
+    header.payloadType |= AS_TypeTraced;
+    header.payloadLength += sizeof(AS_Trace_t);
+    payload = traced;
+  }
+  if(con->link != NULL) { // channel: server keeps the channel bits of the source
+    if(con->link->state == AS_ConClosed)  {
+      con->state = AS_ConClosed;
+      free(traced);
+      return 0; // pooled connection lost
     }
-    // if this point is reached, bind worked!
-    // socket is now operational!
-    // socket connected!
-    // print socket information (port and IP version)
-    inet_ntop(ai_p->ai_family, &(ai_p->ai_addr), ipstr, sizeof(ipstr));
-    fprintf(stderr, "server %d: running at [%s]:%s\n", server->port, ipstr, portstr);
+    header.clientSource = con->channel << AS_CHANNEL_SHIFT;
+    con = con->link;
+  }
+  if((header.payloadType & AS_TypeUnreliable) && con->state == AS_ConEstablished && AS_ClientDatagram(con, &header, payload)) {
+    free(traced);
+    return len;
+  }
+  do  { // large bulk payloads are queued as fragments, frames of higher priority can be sent in between
+    buffer = AS_BufferFragment(&header, payload, &offset);
+    AS_OutQueuePush(&con->out, buffer); // frames of pending connections are sent after welcome message
+    AS_BufferRelease(buffer);
+  } while(offset < header.payloadLength);
+  free(traced);
+  con->lastSend = AS_monotonicMsec();
+  AS_ClientFlush(con);
+  return len;
+}
+
+void AS_ClientSchedule(AS_Connections_t *con) {
+  // next check of heartbeat/timeouts, activity only updates timestamps (no timer changes)
+  unsigned long long next = ULLONG_MAX;
+  if(con->state == AS_ConClosed)
+    return;
+  if(con->state != AS_ConEstablished)  { // connect timeout and happy eyeballs
+    next = AS_TimerTick(con->deadline);
+    if(con->state == AS_ConConnecting && con->addrNext < con->addrNum && AS_TimerTick(con->nextAttempt) < next)
+      next = AS_TimerTick(con->nextAttempt);
+    AS_TimerAdd(&AS_ClientWheel, &con->timer, next);
+    return;
+  }
+  next = AS_TimerNext(con->in.lastRecv, con->idleTimeout, next);
+  next = AS_TimerNext(con->in.frameStart, con->readTimeout, next);
+  next = AS_TimerNext(con->lastSend, con->heartbeat, next);
+  if(con->pool && con->channelsNum == 0 && AS_TimerTick(con->lingerUntil) < next)
+    next = AS_TimerTick(con->lingerUntil);
+  if(next != ULLONG_MAX)
+    AS_TimerAdd(&AS_ClientWheel, &con->timer, next);
+}
+
+void AS_ClientStartAttempt(AS_Connections_t *con) {
+  // start non-blocking connect to next address, earlier attempts keep running
+  AS_Address_t *addr;
+  int sock;
+  
+  while(con->addrNext < con->addrNum)  {
+    addr = &con->addrs[con->addrNext];
+    con->addrNext++;
+    if((sock = socket(addr->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)  {
+      perror("client: socket");
+      continue;
+    }
+    if(connect(sock, (struct sockaddr *)&addr->addr, addr->len) == -1 && errno != EINPROGRESS)  {
+      perror("client: connect");
+      close(sock);
+      continue;
+    }
+    AS_SocketOptions(sock, con->config.option);
+    con->attempts[con->addrNext-1] = sock;
     break;
   }
-  if(ai_p == NULL) {  // iterated through complete list without binding
-    fprintf(stderr, "server %d: error: failed to bind server to port %s\n", server->port, portstr);
-    server->error = 1;
+  con->nextAttempt = AS_monotonicMsec() + con->connectDelay;
+}
+
+void AS_ClientTimer(void *ctx, AS_Timer_t *timer)  {
+  // heartbeats and timeouts of one connection, called by the timer wheel
+  AS_Connections_t *con = timer->data;
+  AS_MessageHeader_t header;
+  long long now = AS_monotonicMsec();
+  
+  if(con->state != AS_ConEstablished) {
+    if(now >= con->deadline)  {
+      AS_ClientFailed(con, "timed out");
+      return;
+    }
+    if(con->state == AS_ConConnecting && now >= con->nextAttempt)
+      AS_ClientStartAttempt(con); // previous attempt is slow, race the next address
+    AS_ClientSchedule(con);
     return;
   }
-  // no more need for servinfo, listening socket is already open :)
-  freeaddrinfo(ai_res);
-  freeaddrinfo(ai_hints);
-  ai_p = NULL; ai_res = NULL; ai_hints = NULL;
-  // listen to socket
-  if(listen(sock_server, AS_BACKLOG) < 0) {
-    perror("listen");
-    server->error = 1;
+  if(con->pool && con->channelsNum == 0 && now >= con->lingerUntil) {
+    AS_ClientDisconnect(con->conID); // unused pooled connection
+    return;
+  }
+  if(con->idleTimeout && now - con->in.lastRecv >= con->idleTimeout)  {
+    AS_ClientLost(con, "connection to server timed out (idle)");
+    return;
+  }
+  if(con->readTimeout && con->in.frameStart && now - con->in.frameStart >= con->readTimeout) {
+    AS_ClientLost(con, "connection to server timed out (incomplete frame)");
+    return;
+  }
+  if(con->heartbeat && now - con->lastSend >= con->heartbeat) {
+    memset(&header, 0, sizeof(AS_MessageHeader_t));
+    header.as_identifier = 144; // mandatory (for checking at receiver)
+    header.clientDestination = -1;  // server
+    header.payloadType = AS_TypeHeartbeat;
+    AS_ClientSendAll(con, &header, sizeof(AS_MessageHeader_t));
+  }
+  AS_ClientSchedule(con);
+}
+
+void* AS_ClientResolveThread(void *arg) {
+  // resolve host:port, addresses of both families are alternated (IPv6 first if available)
+  AS_Resolve_t *job = arg;
+  struct addrinfo ai_hints, *ai_res, *ai_p;
+  AS_Address_t *addrs = NULL;
+  int num = 0, i, family, found;
+  
+  memset(&ai_hints, 0, sizeof(ai_hints));
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+  ai_hints.ai_flags = AI_ADDRCONFIG;
+  if((job->error = getaddrinfo(job->host, job->port, &ai_hints, &ai_res)) == 0) {
+    for(ai_p = ai_res; ai_p != NULL; ai_p = ai_p->ai_next)
+      num++;
+    addrs = calloc(num, sizeof(AS_Address_t));
+    for(ai_p = ai_res; ai_p != NULL; ai_p = ai_p->ai_next)
+      ai_p->ai_protocol = -1; // not taken yet
+    family = ai_res->ai_family;
+    for(i = 0; i < num; i++)  {
+      // take first address of wanted family, otherwise first address left
+      found = 0;
+      for(ai_p = ai_res; ai_p != NULL && !found; ai_p = ai_p->ai_next)
+        found = ai_p->ai_protocol == -1 && ai_p->ai_family == family;
+      if(!found)
+        for(ai_p = ai_res; ai_p->ai_protocol != -1; ai_p = ai_p->ai_next);
+      else
+        for(ai_p = ai_res; ai_p->ai_protocol != -1 || ai_p->ai_family != family; ai_p = ai_p->ai_next);
+      ai_p->ai_protocol = 0;
+      addrs[i].family = ai_p->ai_family;
+      addrs[i].len = ai_p->ai_addrlen;
+      memcpy(&addrs[i].addr, ai_p->ai_addr, ai_p->ai_addrlen);
+      family = ai_p->ai_family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+    freeaddrinfo(ai_res);
+  }
+  
+  pthread_mutex_lock(&job->lock);
+  job->addrs = addrs;
+  job->addrNum = num;
+  job->done = 1;
+  if(!job->cancelled) {
+    pthread_mutex_unlock(&job->lock);
+    write(AS_ClientWakePipe[1], "r", 1); // wake AS_ClientPoll()
+    return NULL;
+  }
+  pthread_mutex_unlock(&job->lock);
+  // connection is gone, nobody will pick up the result
+  pthread_mutex_destroy(&job->lock);
+  free(job->addrs);
+  free(job->host);
+  free(job->port);
+  free(job);
+  return NULL;
+}
+
+void AS_ClientResolveCancel(AS_Connections_t *con)  {
+  AS_Resolve_t *job = con->resolve;
+  int done;
+  
+  if(job == NULL)
+    return;
+  con->resolve = NULL;
+  pthread_mutex_lock(&job->lock);
+  job->cancelled = 1;
+  done = job->done;
+  pthread_mutex_unlock(&job->lock);
+  if(!done) // thread frees job
+    return;
+  pthread_mutex_destroy(&job->lock);
+  free(job->addrs);
+  free(job->host);
+  free(job->port);
+  free(job);
+}
+
+void AS_ClientStartConnecting(AS_Connections_t *con, AS_Address_t *addrs, int addrNum) {
+  // addresses are known (resolved or cached), start racing, addrs is taken over
+  int i;
+  
+  con->addrs = addrs;
+  con->addrNum = addrNum;
+  con->attempts = malloc(con->addrNum * sizeof(int));
+  for(i = 0; i < con->addrNum; i++)
+    con->attempts[i] = -1;
+  con->state = AS_ConConnecting;
+  AS_ClientStartAttempt(con);
+  AS_ClientSchedule(con);
+}
+
+void AS_ClientChannelUp(AS_Connections_t *channel) {
+  // pooled connection is established, channel uses its client ID plus channel number
+  channel->state = AS_ConEstablished;
+  channel->id = channel->link->id | (channel->channel << AS_CHANNEL_SHIFT);
+  AS_ClientQueueEvent(channel, AS_TypeConnected, -1, channel->id, NULL, 0);
+}
+
+void AS_ClientEstablished(AS_Connections_t *con, AS_MessageHeader_t *header) {
+  // received welcome message from server!
+  int i;
+  fprintf(stderr, "welcome to this server, your ID is %d\n", header->clientDestination);
+  con->state = AS_ConEstablished;
+  con->id = header->clientDestination;
+  con->in.lastRecv = con->lastSend = AS_monotonicMsec();
+  if(con->pool) {
+    for(i = 1; i <= AS_CHANNEL_MAX; i++)
+      if(con->channels[i] != NULL)
+        AS_ClientChannelUp(con->channels[i]);
+    con->lingerUntil = con->lastSend + con->config.option[AS_OptPoolLinger];
+  } else  {
+    AS_ClientQueueEvent(con, AS_TypeConnected, -1, con->id, NULL, 0);
+  }
+  AS_ClientSchedule(con);
+  AS_ClientFlush(con); // frames queued while connecting
+}
+
+void AS_ClientPresenceReceived(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload) {
+  // apply AS_TypePresence or AS_TypeClientListDelta to local client list and queue events
+  AS_PresenceDelta_t *delta = payload;
+  int *ids, i;
+  int *list;
+  
+  if(header->payloadLength < sizeof(AS_PresenceDelta_t) || delta->leaveNum < 0 || delta->joinNum < 0 ||
+     header->payloadLength != sizeof(AS_PresenceDelta_t) + (delta->leaveNum + delta->joinNum) * sizeof(int))  {
+    fprintf(stderr, "error: received incorrect presence frame\n");
+    return;
+  }
+  ids = payload + sizeof(AS_PresenceDelta_t);
+  
+  if(delta->fromVersion == 0) // complete list
+    AS_IdSetClear(&con->clients);
+  for(i = 0; i < delta->leaveNum; i++)
+    AS_IdSetRemove(&con->clients, ids[i]);
+  for(i = delta->leaveNum; i < delta->leaveNum + delta->joinNum; i++)
+    AS_IdSetAdd(&con->clients, ids[i]);
+  if(delta->fromVersion == 0 || delta->fromVersion == con->clientsVersion)
+    con->clientsVersion = delta->toVersion;
+  else
+    con->clientsVersion = -1; // missed a delta (e.g. presence disabled), ask for complete list next time
+  
+  if(header->payloadType == AS_TypePresence)  {
+    // report each change as separate event (same as single notifications)
+    for(i = 0; i < delta->leaveNum; i++)
+      AS_ClientQueueEvent(con, AS_TypeClientDisconnect, -1, ids[i], NULL, 0);
+    for(i = delta->leaveNum; i < delta->leaveNum + delta->joinNum; i++)
+      if(ids[i] != (con->id & AS_ID_MASK))
+        AS_ClientQueueEvent(con, AS_TypeClientConnect, -1, ids[i], NULL, 0);
+  } else  {
+    // report complete list to application
+    list = malloc(con->clients.num * sizeof(int) + 1);
+    memcpy(list, con->clients.ids, con->clients.num * sizeof(int));
+    AS_ClientQueueEvent(con, AS_TypeListOfClients, -1, con->id, list, con->clients.num * sizeof(int));
+  }
+}
+
+void AS_ClientShutdown(AS_Connections_t *con)  {
+  // server shuts down, conID stays valid until AS_ClientDisconnect
+  int i;
+  AS_TimerRemove(&con->timer);
+  if(con->socket != -1)
+    close(con->socket);
+  con->socket = -1;
+  AS_ClientDatagramClose(con);
+  con->state = AS_ConClosed;
+  AS_ClientCallsFail(con, AS_RpcLost);
+  if(!con->pool)
+    return;
+  for(i = 1; i <= AS_CHANNEL_MAX; i++)  // channels are closed with the pooled connection, even without a frame of their own
+    if(con->channels[i] != NULL)  {
+      con->channels[i]->state = AS_ConClosed;
+      AS_ClientCallsFail(con->channels[i], AS_RpcLost);
+    }
+}
+
+void AS_ClientFrame(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload);
+
+void AS_ClientDemux(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload)  {
+  // frame of a pooled connection: destination with channel bits -> that channel, otherwise -> all channels
+  AS_Connections_t *channel;
+  AS_MessageHeader_t each;
+  void *copy;
+  int i, last;
+  
+  if(header->payloadType == AS_TypeHeartbeat) {
+    free(payload);
+    return;
+  }
+  if(header->clientDestination >= 0 && (header->clientDestination & AS_CHANNEL_MASK)) {
+    channel = con->channels[(header->clientDestination & AS_CHANNEL_MASK) >> AS_CHANNEL_SHIFT];
+    if(channel != NULL)
+      AS_ClientFrame(channel, header, payload);
+    else
+      free(payload); // channel was disconnected meanwhile
+    return;
+  }
+  for(last = AS_CHANNEL_MAX; last > 0 && con->channels[last] == NULL; last--);
+  for(i = 1; i <= last; i++)  {
+    if((channel = con->channels[i]) == NULL)
+      continue;
+    if(i == last) { // last channel takes the original
+      copy = payload;
+      payload = NULL;
+    } else  {
+      copy = malloc(header->payloadLength + 1);
+      memcpy(copy, payload, header->payloadLength);
+    }
+    each = *header; // may be changed by the channel (trace removed)
+    AS_ClientFrame(channel, &each, copy);
+  }
+  free(payload); // no channel left
+  if(header->payloadType == AS_TypeShutdown)
+    AS_ClientShutdown(con);
+}
+
+void AS_ClientFragment(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload)  {
+  // collect fragments per source, the complete frame is handled like any other frame
+  AS_Fragment_t *fragment = payload;
+  AS_Reassembly_t *part, *last;
+  AS_MessageHeader_t complete;
+  unsigned int len;
+  
+  if(!AS_FragmentValid(header, payload)) {
+    fprintf(stderr, "error: received incorrect fragment\n");
+    free(payload);
+    return;
+  }
+  len = header->payloadLength - sizeof(AS_Fragment_t);
+  for(part = con->fragments; part != NULL && part->source != header->clientSource; part = part->next);
+  if(fragment->offset == 0) { // first fragment, an incomplete frame of this source is dropped
+    if(part == NULL)  {
+      part = calloc(1, sizeof(AS_Reassembly_t));
+      part->source = header->clientSource;
+      part->next = con->fragments;
+      con->fragments = part;
+    }
+    if(part->payload != NULL) {
+      con->fragmentBytes -= part->payloadLength;
+      free(part->payload);
+      part->payload = NULL;
+    }
+    part->payloadType = fragment->payloadType;
+    part->payloadLength = fragment->payloadLength;
+    part->have = 0;
+    if(fragment->payloadLength > con->in.maxPayload || (con->in.admit >= 0 && con->fragmentBytes + fragment->payloadLength > con->in.admit))  {
+      // refused like an oversized frame, the following fragments of this frame are dropped silently
+      fprintf(stderr, "error: received fragmented frame of %u bytes exceeds the limit\n", fragment->payloadLength);
+      free(payload);
+      return;
+    }
+    if((part->payload = malloc(part->payloadLength + 1)) != NULL) {
+      part->payload[part->payloadLength] = '\0';
+      con->fragmentBytes += part->payloadLength;
+    }
+  } else if(part != NULL && part->payload == NULL)  { // rest of a refused frame
+    free(payload);
+    return;
+  }
+  if(part == NULL || part->payload == NULL || fragment->offset != part->have || len > part->payloadLength - part->have) {
+    fprintf(stderr, "error: received fragment out of order\n");
+    free(payload);
+    return;
+  }
+  memcpy(part->payload + part->have, fragment + 1, len);
+  part->have += len;
+  free(payload);
+  if(part->have < part->payloadLength)
     return;
+  
+  // frame complete
+  complete = *header;
+  complete.payloadType = part->payloadType;
+  complete.payloadLength = part->payloadLength;
+  payload = part->payload;
+  con->fragmentBytes -= part->payloadLength;
+  if(con->fragments == part)  {
+    con->fragments = part->next;
+  } else  {
+    for(last = con->fragments; last->next != part; last = last->next);
+    last->next = part->next;
   }
+  free(part);
+  AS_ClientFrame(con, &complete, payload);
+}
+
+void AS_ClientFrame(AS_Connections_t *con, AS_MessageHeader_t *header, void *payload)  {
+  // frame received from server, queue event(s) for application
+  AS_Call_t *call;
+  AS_Trace_t trace;
+  int traced = 0;
   
-  // init client list
-  // AS_ClientList is root element, first real client will be 'AS_ClientList->next'
-  AS_ConnectedClientList = calloc(1,sizeof(AS_ConnectedClients_t));
-  server->clientsNum = 0;
+  if(con->pool) {
+    AS_ClientDemux(con, header, payload);
+    return;
+  }
+  header->payloadType &= ~AS_TypeUnreliable; // transport only, the application gets the type it was sent with
+  if(header->payloadType & AS_TypeTraced) {
+    // remove trace, hops are recorded when the application gets the frame
+    if(header->payloadLength < sizeof(AS_Trace_t)) {
+      fprintf(stderr, "error: received incorrect trace\n");
+      free(payload);
+      return;
+    }
+    memcpy(&trace, payload, sizeof(AS_Trace_t));
+    header->payloadType &= ~AS_TypeTraced;
+    header->payloadLength -= sizeof(AS_Trace_t);
+    memmove(payload, payload + sizeof(AS_Trace_t), header->payloadLength + 1); // including terminating '\0'
+    traced = 1;
+  }
+  switch(header->payloadType)  {
+    case AS_TypeHeartbeat:
+      // keeps connection alive, nothing to report
+      free(payload);
+      return;
+    case AS_TypeFragment:
+      // application receives the complete frame
+      AS_ClientFragment(con, header, payload);
+      return;
+    case AS_TypePresence:
+    case AS_TypeClientListDelta:
+      // handled internally, application receives the resulting events
+      AS_ClientPresenceReceived(con, header, payload);
+      free(payload);
+      return;
+    case AS_TypeResponse:
+      // callback or event of the request, late responses (after timeout) are dropped
+      if(traced)
+        AS_TraceDeliver(&trace);
+      if(header->payloadLength >= sizeof(AS_Rpc_t) && ((AS_Rpc_t *)payload)->call > 0 &&
+         (call = AS_IdMapGet(&con->calls, ((AS_Rpc_t *)payload)->call)) != NULL)
+        AS_ClientCallEnd(call, header->clientSource, payload, header->payloadLength);
+      else
+        free(payload);
+      return;
+  }
+  if(header->payloadType == AS_TypeShutdown)
+    AS_ClientShutdown(con); // failed requests are reported first
+  AS_ClientQueueEvent(con, header->payloadType, header->clientSource, header->clientDestination, payload, header->payloadLength);
+  if(traced)  {
+    con->eventsLast->traced = 1;
+    con->eventsLast->trace = trace;
+  }
+}
+
+void AS_ClientDatagramReceive(AS_Connections_t *con) {
+  // frames received as datagrams, handled like frames received over TCP
+  struct mmsghdr msgs[AS_DATAGRAM_BATCH];
+  struct iovec iovs[AS_DATAGRAM_BATCH];
+  AS_MessageHeader_t header;
+  AS_Datagram_t *prefix;
+  char *data;
+  void *payload;
+  int i, num;
   
-  server->running = 1;
-  // server is now running, calling process can read this variable and return
+  data = malloc(AS_DATAGRAM_BATCH * AS_DATAGRAM);
+  do  {
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < AS_DATAGRAM_BATCH; i++) {
+      iovs[i].iov_base = data + i * AS_DATAGRAM;
+      iovs[i].iov_len = AS_DATAGRAM;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if((num = recvmmsg(con->udp, msgs, AS_DATAGRAM_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+      break;
+    for(i = 0; i < num && con->udp != -1; i++) { // a frame may close the connection
+      prefix = iovs[i].iov_base;
+      if(msgs[i].msg_len < sizeof(AS_Datagram_t) + sizeof(AS_MessageHeader_t) || prefix->token != con->udpToken)
+        continue;
+      memcpy(&header, prefix + 1, sizeof(AS_MessageHeader_t));
+      if(header.as_identifier != 144 || header.payloadLength != msgs[i].msg_len - sizeof(AS_Datagram_t) - sizeof(AS_MessageHeader_t))
+        continue;
+      payload = malloc(header.payloadLength + 1);
+      memcpy(payload, (char *)(prefix + 1) + sizeof(AS_MessageHeader_t), header.payloadLength);
+      ((char *)payload)[header.payloadLength] = '\0'; // terminated like frames received over TCP
+      AS_ClientFrame(con, &header, payload);
+    }
+  } while(num == AS_DATAGRAM_BATCH && con->udp != -1);
+  free(data);
+}
+
+void AS_ClientProcess(AS_Connections_t *con) {
+  // advance connection without blocking: resolve, connect, receive frames and send queued frames
+  AS_MessageHeader_t header;
+  struct pollfd pfd;
+  void *payload;
+  int i, rv, err, failed;
+  socklen_t len;
   
-  // init select()
-  FD_ZERO(&fds_master);
-  FD_SET(sock_server,&fds_master); // add listening socket to list
-  sockmax = sock_server;           // maximum socket number = only socket
+  if(con->link != NULL) { // channel: everything happens on the pooled connection
+    AS_ClientProcess(con->link);
+    return;
+  }
+  if(con->state == AS_ConResolving) {
+    pthread_mutex_lock(&con->resolve->lock);
+    rv = con->resolve->done;
+    pthread_mutex_unlock(&con->resolve->lock);
+    if(!rv)
+      return;
+    if(con->resolve->error) {
+      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(con->resolve->error));
+      AS_ClientResolveCancel(con);
+      AS_ClientFailed(con, "could not resolve host");
+      return;
+    }
+    // take over addresses and start racing
+    AS_ResolverCachePut(con->host, con->port, con->resolve->addrs, con->resolve->addrNum);
+    AS_ClientStartConnecting(con, con->resolve->addrs, con->resolve->addrNum);
+    con->resolve->addrs = NULL;
+    AS_ClientResolveCancel(con);
+  }
   
-  ///////////////////////////////////////////////////////////////////////////////////////
-  // main server loop
-  while(!server->stop) {
-    // copy master list to "fds_read", since select() will manipulate the list
-    fds_read = fds_master;
-    // Use select() to wait for the next incomming message OR connection!
-    // in order to react to the main thread, implement timeout
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 10000;  // 10 * 1000 microsec = 10 millisec
-    rv = select(sockmax+1, &fds_read, NULL, NULL, &timeout);
-    if(rv == 0) // timeout!
-      // time out used in order to react to shutdown event
-      // shutdown is checked at each loop iteartion
-      // repeat loop
-      continue;
-    if(rv == -1)  //error!
-      // some select() error...
-      // no error catching for select() implemented
-      // ignore for now and repeat loop
-      continue;
-    if(rv > 0)  {
-      // a socket has triggered
-      for(i = 0; i <= sockmax; i++) { // loop through all possible socket numbers
-        if(FD_ISSET(i, &fds_read)) { // i = found triggering socket
-          if(i == sock_server) {
-            // this socket is the server listening socket!
-            // -> accept new connections here!
-            
-            sockaddr_size = sizeof(sockaddr_remote);
-            // typecast sockaddr_storage to sockaddr
-            sock_remote = accept(sock_server, (struct sockaddr *) &sockaddr_remote, &sockaddr_size);
-            if(sock_remote == -1)  {
-              perror("accept"); 
-              continue;
-            }
-            
-            // create new Client
-            newClient = calloc(1, sizeof(AS_ConnectedClients_t));
-            // copy sockaddr_storage to client 'object'
-            // newClient->sockaddr = sockaddr_remote;
-            // newClient->name is set to '\0\0\0\0...' due to calloc()
-            newClient->socket = sock_remote;
-            newClient->next = NULL;
-            
-            // now add this new socket to the select()-list for socket reading
-            FD_SET(sock_remote, &fds_master);
-            if(sock_remote > sockmax)
-              sockmax = sock_remote;
-            
-            // send clientID to new client
-            header = calloc(1, sizeof(AS_MessageHeader_t));
-            header->as_identifier = 144; // mandatory (for checking at receiver)
-            header->clientSource = -1; // server
-            header->clientDestination = newClient->socket; // this indicates the new clients id
-            header->payloadType = AS_TypeClientID; // inform client that it will receive it's own id
-            header->payloadLength = 0; // no payload needed
-            AS_sendAll(newClient->socket, header, sizeof(AS_MessageHeader_t)); // send info only to new client
-            free(header); header = NULL;
-            
-            // send "new client" to all clients
-            client = AS_ConnectedClientList;  // let pointer point to root of list
-            while(client->next != NULL) {
-              client = client->next;
-              
-              header = calloc(1, sizeof(AS_MessageHeader_t));
-              header->as_identifier = 144; // mandatory (for checking at receiver)
-              header->clientSource = -1; // server
-              header->clientDestination = newClient->socket;
-                // destination not needed since server is source
-                // -> use field for transmitting new client ID
-              header->payloadType = AS_TypeClientConnect; // new client
-              header->payloadLength = 0; // no payload needed (id is stored in "destination")
-              AS_sendAll(client->socket, header, sizeof(AS_MessageHeader_t)); // send info
-              free(header); header = NULL;
-            }
-            // append client object to list
-            client->next = newClient; // add pointer to new client to list of clients!
-            server->clientsNum ++; // increase client counter
-            
-            fprintf(stderr, "server %d: new client %d\n", server->port, sock_remote);
-          } else  {
-            // some client sends data
-            sock_remote = i;
-            header = calloc(1, sizeof(AS_MessageHeader_t));
-            rv = recv(sock_remote, header, sizeof(AS_MessageHeader_t), 0);
-            if(rv == -1)  { // error
-              perror("receive");
-            } else if(rv == 0) {  // client closes connection
-              fprintf(stderr, "server %d: client %d closed connection\n", server->port, sock_remote);
-              close(sock_remote); // clear the client (socket) from the select () list
-              FD_CLR(sock_remote, &fds_master); // delete the client from AS_ConnectedClientList
-              client = AS_ConnectedClientList;
-              while(client->next != NULL) {
-                lastClient = client;
-                client = client->next;
-                if(client->socket == sock_remote)  {
-                  // delete element from linked list
-                  lastClient->next = client->next;
-                  free(client); // free memory
-                } else  {
-                  // inform other clients that this client left
-                  header = calloc(1, sizeof(AS_MessageHeader_t));
-                  header->as_identifier = 144; // mandatory (for checking at receiver)
-                  header->clientSource = -1; // server
-                  header->clientDestination = sock_remote;  // triggering socket is the client which disconnected
-                  header->payloadType = AS_TypeClientDisconnect; // 
-                  header->payloadLength = 0;
-                  AS_sendAll(client->socket, header, sizeof(AS_MessageHeader_t)); // send info
-                  free(header); header = NULL;
-                }
-              }
-              server->clientsNum --; // decrease client counter
-            } else  { // clients sends actual data
-              // analyze header
-              if(rv == sizeof(AS_MessageHeader_t) && header->as_identifier == 144)  {
-                // header received
-                // header has orrect length and test variable is also correct
-                // receive the rest of the packet (payload length)
-                payload = NULL;
-                if(header->payloadLength) {
-                  payload = calloc(1, header->payloadLength + sizeof(char));  // add an additional '\0' to the end of the payload (safe version, not needed)
-                  AS_receiveAll(sock_remote, payload, header->payloadLength); // receive the exact amount of data
-                }
-                
-                switch(header->payloadType) {
-                  // all typed that are forwarded to other clients and handled the same way:
-                  case AS_TypeMessage:
-                  case AS_TypeFileRequest:
-                  case AS_TypeFileAnswer:
-                  case AS_TypeFileData:
-                    if(header->clientDestination == -1) {
-                      fprintf(stderr, "error: server %d: client %d sends unexpected data\n", server->port, sock_remote);
-                    } else  {
-                      // forward message to user
-                      // first: generate new message out of header + payload
-                      // header already present, just add sourceID (if not present already)
-                      header->clientSource = sock_remote;
-                      len = sizeof(AS_MessageHeader_t) + header->payloadLength;
-                      buffer = calloc(1, len);
-                      memcpy(buffer, header, sizeof(AS_MessageHeader_t)); // copy header + payload to buffer
-                      memcpy(buffer + sizeof(AS_MessageHeader_t), payload, header->payloadLength);
-                      // packet ready
-                      if(header->clientDestination == -2) { // broadcasting -> send to all clients
-                        client = AS_ConnectedClientList;
-                        while(client->next != NULL) {
-                          client = client->next;
-                          AS_sendAll(client->socket, buffer, len);
-                        }
-                        fprintf(stderr, "server %d: data: client %d -> broadcast\n", server->port, sock_remote);
-                      } else  { // destination specified ->  send only to destination client (no checking if connected)
-                        AS_sendAll(header->clientDestination, buffer, len);
-                        fprintf(stderr, "server %d: data: client %d -> client %d\n", server->port, sock_remote, header->clientDestination);
-                      }
-                      free(buffer); buffer = NULL;
-                      // done forwarding the message
-                    }
-                    break;
-                  case AS_TypeAskForClients:
-                    // client wants to know who is connected to this server
-                    header->clientSource = -1;  // change source to server
-                    header->clientDestination = sock_remote; // change dest to client asking
-                    header->payloadType = AS_TypeListOfClients; // return list of clients
-                    header->payloadLength = server->clientsNum * sizeof(int); // all client IDs in payload
-                    // don't need old payload
-                    if(payload)
-                      free(payload);
-                    payload = calloc(server->clientsNum, sizeof(int)); // allocate memory for payload
-                    tmpPI = payload; // copy pointer, now tmpP points to payload start
-                    client = AS_ConnectedClientList;
-                    while(client->next != NULL) {
-                      client = client->next;
-                      *tmpPI = client->socket; // write int to location of tmpP pointer
-                      tmpPI += 1;  // more tmpP to next entry
-                    }
-                    len = sizeof(AS_MessageHeader_t) + server->clientsNum * sizeof(int);
-                    buffer = calloc(1, len);
-                    memcpy(buffer, header, sizeof(AS_MessageHeader_t)); // copy header + payload to buffer
-                    memcpy(buffer + sizeof(AS_MessageHeader_t), payload, server->clientsNum * sizeof(int));
-                    // send header + list of clients to requesting client
-                    AS_sendAll(header->clientDestination, buffer, len);
-                    fprintf(stderr, "server %d: sent list of clients to client %d\n", server->port, sock_remote);
-                    free(buffer); buffer = NULL;
-                    break;
-                }
-                if(payload)
-                  free(payload); payload = NULL;
-              } else  {
-                // received too less in order for a correct header
-                // do not try to handle error, just leave
-                fprintf(stderr, "server %d: error: received incorrect header from %d!\n", server->port, sock_remote);
-              }
-            }
-            free(header); header = NULL;
-          }
-        } // FD_ISSET
+  if(con->state == AS_ConConnecting)  {
+    // first attempt that succeeds wins, all others are closed
+    rv = 0;
+    failed = 0;
+    for(i = 0; i < con->addrNum && con->socket == -1; i++) {
+      if(con->attempts[i] == -1)
+        continue;
+      pfd.fd = con->attempts[i];
+      pfd.events = POLLOUT;
+      if(poll(&pfd, 1, 0) <= 0)  {
+        rv++; // still running
+        continue;
       }
+      len = sizeof(err);
+      if(getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)  {
+        close(pfd.fd); // this address failed
+        con->attempts[i] = -1;
+        failed++;
+        continue;
+      }
+      con->socket = pfd.fd;
+      con->attempts[i] = -1;
+    }
+    if(con->socket != -1) {
+      AS_ClientCloseAttempts(con);
+      con->state = AS_ConWelcome;
+    } else if(!rv)  { // no attempt running: try next address now
+      AS_ClientStartAttempt(con);
+      for(i = 0; i < con->addrNum && con->attempts[i] == -1; i++);
+      if(i == con->addrNum)
+        AS_ClientFailed(con, "failed to connect to server");
+      else
+        AS_ClientSchedule(con);
+      return;
+    } else  {
+      if(failed)  { // do not wait for the connect delay, race the next address now
+        AS_ClientStartAttempt(con);
+        AS_ClientSchedule(con);
+      }
+      return;
     }
   }
   
-  // some thread has called this server to stop
-  //fprintf(stderr, "AS_ServerThread: server on port %d is shutting down NOW\n", server->port);
-  // disconnect users...
-  header = calloc(1, sizeof(AS_MessageHeader_t));
-  header->as_identifier = 144; // mandatory (for checking at receiver)
-  header->clientSource = -1;              // Server
-  header->clientDestination = -2;         // input clientID here, -2 = broadcast
-  header->payloadType = AS_TypeShutdown;  // Type of Packet
-  header->payloadLength = 0;              // len of payload in byte
-  client = AS_ConnectedClientList;
-  while(client->next != NULL) {
-    client = client->next;
-    AS_sendAll(client->socket, header, sizeof(AS_MessageHeader_t));
+  while(con->state == AS_ConWelcome || con->state == AS_ConEstablished) {
+    // socket is non-blocking, returns 0 if no complete frame is waiting
+    rv = AS_ReceiveFrame(con->socket, &con->in, &header, &payload, NULL);
+    if(rv == 0)
+      break;
+    if(rv == -1)  { // connection closed
+      if(con->state == AS_ConWelcome)
+        AS_ClientFailed(con, "connection closed by server");
+      else
+        AS_ClientLost(con, "remote socket closed");
+      return;
+    }
+    if(rv == -2)  { // stream out of sync
+      if(con->state == AS_ConWelcome)
+        AS_ClientFailed(con, "received incorrect header");
+      else
+        AS_ClientLost(con, "error: received incorrect header!");
+      return;
+    }
+    if(rv == -3)  { // frame exceeds AS_OptMaxPayload or the memory budget
+      if(con->state == AS_ConWelcome)
+        AS_ClientFailed(con, "received frame exceeds limits");
+      else
+        AS_ClientLost(con, "error: received frame exceeds limits!");
+      return;
+    }
+    if(con->state == AS_ConWelcome) {
+      if(header.payloadType == AS_TypeClientID)
+        AS_ClientEstablished(con, &header);
+      free(payload);
+      continue;
+    }
+    if(header.payloadType == AS_TypeDatagramOffer || header.payloadType == AS_TypeDatagramHello)  {
+      // datagram channel belongs to the connection (pooled: shared by its channels)
+      if(header.payloadType == AS_TypeDatagramOffer)
+        AS_ClientDatagramOffer(con, &header, payload);
+      else if(con->udp != -1)
+        con->udpReady = 1;
+      free(payload);
+      continue;
+    }
+    AS_ClientFrame(con, &header, payload);
   }
-  free(header); header = NULL;
-  
-  // close socket
-  close(sock_server);
-  // finish up
-  server->running = 0;
-  server->port = 0;
-  return;
+  if(con->udp != -1)
+    AS_ClientDatagramReceive(con);
+  AS_ClientFlush(con);
 }
 
-int AS_ServerStart(int port, int IPv)  {
-  if(!AS_initialized) AS_init();
+AS_Connections_t* AS_ClientNew(char* host, char* port, int *options)  {
+  // new connection in the list, resolving runs in a detached thread unless addresses are cached
+  AS_Connections_t *con, *connection;
+  AS_Address_t *addrs;
+  pthread_t thread;
+  pthread_attr_t attr;
+  int addrNum;
   
-  fprintf(stderr, "AS_startServer(%d)\n", port);
-    
-  // check if port in range
-  if(port > AS_MAXPORT || port <= 0) {
-    fprintf(stderr, "error: AS_startServer(%d): port number out of range\n", port);
-    return 0;
-  }
+  con = calloc(1, sizeof(AS_Connections_t));
+  con->conID = AS_ClientNextConID++;
+  con->state = AS_ConResolving;
+  con->socket = -1;
+  con->udp = -1;
+  con->id = -1;
+  con->host = strdup(host);
+  con->port = strdup(port);
+  con->clientsVersion = -1; // no client list received yet
+  con->heartbeat = options[AS_OptHeartbeat];
+  con->idleTimeout = options[AS_OptIdleTimeout];
+  con->readTimeout = options[AS_OptReadTimeout];
+  con->connectDelay = options[AS_OptConnectDelay];
+  con->traceSample = options[AS_OptTraceSample];
+  con->deadline = AS_monotonicMsec() + options[AS_OptConnectTimeout];
+  con->timer.data = con;
+  memcpy(con->config.option, options, sizeof(con->config.option));
+  AS_InBufferInit(&con->in, options);
   
-  // check if there is already an AS server with this port number
-  if(AS_ServerIsRunning(port))  {
-    fprintf(stderr, "error: AS_startServer(%d): there is already an AS_Server on this port\n", port);
-    return 0;
-  }
+  connection = AS_ConnectionList; // root of con list
+  while(connection->next != NULL) // iterate through whole list until end
+    connection = connection->next;
+  connection->next = con; // add new connection to the end of the list
   
-  // create new element
-  AS_Server_t* newServer = calloc(1, sizeof(AS_Server_t));
-  // init element
-  newServer->IPv = IPv;
-  newServer->port = port;
-  newServer->thread = calloc(1, sizeof(pthread_t));
-  newServer->next = NULL;
+  if((addrs = AS_ResolverCacheGet(host, port, &addrNum)) != NULL)  {
+    AS_ClientStartConnecting(con, addrs, addrNum); // resolved recently, no thread needed
+    return con;
+  }
   
-  // start server thread
-  pthread_create(newServer->thread, NULL, &AS_ServerThread, newServer);
+  // resolve in a detached thread, getaddrinfo() may block for a long time
+  con->resolve = calloc(1, sizeof(AS_Resolve_t));
+  pthread_mutex_init(&con->resolve->lock, NULL);
+  con->resolve->host = strdup(host);
+  con->resolve->port = strdup(port);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if(pthread_create(&thread, &attr, &AS_ClientResolveThread, con->resolve) != 0) {
+    con->resolve->done = 1;
+    con->resolve->error = EAI_SYSTEM;
+  }
+  pthread_attr_destroy(&attr);
+  AS_ClientSchedule(con);
+  return con;
+}
+
+AS_Connections_t* AS_ClientChannelOpen(char* host, char* port, int *options)  {
+  // new channel on a pooled connection to host:port, the pooled connection is created if necessary
+  AS_Connections_t *con, *link;
+  int i;
   
-  // thread created, wait for thread to finish start-up
-  while(!newServer->running && !newServer->error)
-    msecsleep(10);
-    
-  // either server started successfully, or an error occured
-  if(newServer->error)  { // error occured, wait for thread to finish
-    pthread_join(*(newServer->thread), NULL);
-    free(newServer);  // free allocated memory and return
-    return 0;
+  link = AS_ConnectionList; // root of con list
+  while((link = link->next) != NULL)
+    if(link->pool && link->state != AS_ConClosed && link->channelsNum < AS_CHANNEL_MAX &&
+       strcmp(link->host, host) == 0 && strcmp(link->port, port) == 0)
+      break;
+  if(link == NULL)  {
+    link = AS_ClientNew(host, port, options); // options of the first channel apply to the pooled connection
+    link->pool = 1;
   }
+  for(i = 1; link->channels[i] != NULL; i++); // lowest free channel
   
-  // server has announced that it is now running (without error)
-  // add element to list:
-  AS_Server_t* server;
-  server = AS_ServerList;  // let pointer point to root of list
-  while(server->next != NULL)
-    server = server->next;
-  server->next = newServer;
-  return 1;
+  con = calloc(1, sizeof(AS_Connections_t));
+  con->conID = AS_ClientNextConID++;
+  con->state = AS_ConConnecting; // until the pooled connection is established
+  con->socket = -1;
+  con->udp = -1;              // datagrams of channels use the pooled connection
+  con->id = -1;
+  con->host = strdup(host);
+  con->port = strdup(port);
+  con->clientsVersion = -1; // no client list received yet
+  con->timer.data = con;    // never scheduled, timeouts belong to the pooled connection
+  con->traceSample = options[AS_OptTraceSample];
+  memcpy(con->config.option, options, sizeof(con->config.option));
+  con->link = link;
+  con->channel = i;
+  link->channels[i] = con;
+  link->channelsNum++;
+  if(link->state == AS_ConEstablished)
+    AS_ClientChannelUp(con);
+  
+  while(link->next != NULL) // add channel to the end of the list
+    link = link->next;
+  link->next = con;
+  return con;
 }
 
-
-int AS_ServerStop(int port)  {
-  if(!AS_initialized) AS_init();
-  //fprintf(stderr, "AS_stopServer(%d)\n",port);
+void AS_ClientStep(int msec)  {
+  // wait for network activity of all connections (at most msec), advance timers and connections
+  AS_Connections_t *con;
+  struct pollfd *pfds;
+  int num = 0, max = 1, i, timeout;
+  char drain[64];
   
-  if(port == 0) {
-    while(AS_ServerList->next != NULL) {
-      AS_ServerStop(AS_ServerList->next->port);
+  con = AS_ConnectionList;
+  while((con = con->next) != NULL)
+    max += con->state == AS_ConConnecting ? con->addrNum : 2;
+  pfds = malloc(max * sizeof(struct pollfd));
+  pfds[num].fd = AS_ClientWakePipe[0];
+  pfds[num].events = POLLIN;
+  num++;
+  con = AS_ConnectionList;
+  while((con = con->next) != NULL) {
+    if(con->state == AS_ConConnecting)  {
+      for(i = 0; i < con->addrNum; i++)
+        if(con->attempts[i] != -1)  {
+          pfds[num].fd = con->attempts[i];
+          pfds[num].events = POLLOUT;
+          num++;
+        }
+    } else if(con->socket != -1) {
+      pfds[num].fd = con->socket;
+      pfds[num].events = POLLIN | (con->out.bytes > 0 ? POLLOUT : 0);
+      num++;
+      if(con->udp != -1)  {
+        pfds[num].fd = con->udp;
+        pfds[num].events = POLLIN;
+        num++;
+      }
     }
   }
+  // wake up for next timer wheel tick
+  timeout = msec < AS_TICK ? msec : AS_TICK;
+  poll(pfds, num, timeout);
+  free(pfds);
+  while(read(AS_ClientWakePipe[0], drain, sizeof(drain)) > 0);
   
-  AS_Server_t *server, *last;
-  server = AS_ServerList;
-  while(server->next != NULL) {
-    last = server;
-    server = server->next;
-    if(server->port == port || port == 0)  {
-      server->stop = 1; // call thread to stop and wait
-      pthread_join(*(server->thread), NULL);
-      fprintf(stderr, "server %d is now stopped\n", port);
-      
-      // delete element from linked list
-      last->next = server->next;
-      free(server);
-      return 1; // only return if this single server should be stopped
+  AS_TimerWheelAdvance(&AS_ClientWheel, &AS_ClientTimer, NULL); // heartbeats and timeouts of all connections
+  AS_TimerWheelAdvance(&AS_CallWheel, &AS_ClientCallTimer, NULL); // request timeouts
+  con = AS_ConnectionList;
+  while((con = con->next) != NULL)
+    if(con->link == NULL) // channels are processed with their pooled connection
+      AS_ClientProcess(con);
+}
+
+int AS_ClientPolled(int unseen) {
+  // conID with events waiting, unseen: only if they changed since AS_ClientPoll() returned it
+  AS_Connections_t *con;
+  
+  con = AS_ConnectionList;
+  while((con = con->next) != NULL)
+    if(con->events != NULL && (!unseen || con->events != con->eventsPolled))  {
+      con->eventsPolled = con->events;
+      return con->conID;
     }
-  }
   return 0;
 }
 
+int AS_ClientConnectAsync(char* host, char* port)  { // start connecting to a server and return connection ID
+  return AS_ClientConnectAsyncEx(host, port, NULL);
+}
 
-//##########################################################################################################################
-
-
-//////////////////////////////
-//          CLIENT          //
-//////////////////////////////
+int AS_ClientConnectAsyncEx(char* host, char* port, AS_Config_t *config)  {
+  if(!AS_initialized) AS_init();
+  int *options = config != NULL ? config->option : AS_Options;
+  
+  if(options[AS_OptPool])
+    return AS_ClientChannelOpen(host, port, options)->conID;
+  return AS_ClientNew(host, port, options)->conID;
+}
 
 int AS_ClientConnect(char* host, char* port)	{ // connect to a server and return connection ID
+  return AS_ClientConnectEx(host, port, NULL);
+}
+
+int AS_ClientConnectEx(char* host, char* port, AS_Config_t *config)  {
   if(!AS_initialized) AS_init();
-	int sockID, rv, time;
-	struct addrinfo *ai_hints, *ai_res, *ai_p;
   AS_Connections_t *con;
-  AS_MessageHeader_t *header;
-  int bytes, established;
-	
-	ai_hints = calloc(1, sizeof(struct addrinfo));
-	ai_hints->ai_family = AF_UNSPEC;
-	ai_hints->ai_socktype = SOCK_STREAM;
-	
-	if((rv = getaddrinfo(host, port, ai_hints, &ai_res)) != 0) {
-	  fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-	  return 0;
-	}
-	
-	for(ai_p = ai_res; ai_p != NULL; ai_p = ai_p->ai_next)  {
-	  if((sockID = socket(ai_res->ai_family, ai_res->ai_socktype, ai_res->ai_protocol)) == -1)  {
-	    perror("client: socket");
-	    continue;
-	  }
-	  if(connect(sockID, ai_res->ai_addr, ai_res->ai_addrlen) == -1)  {
-	    close(sockID);
-	    sockID = -1;
-	    perror("client: connect");
-	    continue;
-	  }
-	  // if this point is reached, connect was successfull
-	  break;
-	}
-	
-  if(ai_p == NULL)  { // for loop iteared until the end -> no connect !
-	  fprintf(stderr, "client: failed to connect to server\n");
-	  return 0;
-	}
-	
-	freeaddrinfo(ai_res);
-	freeaddrinfo(ai_hints);
-	
-	// socket connection successfull
-	// now wait for welcome message of AS Server!
-	
-  header = calloc(1, sizeof(AS_MessageHeader_t));
-  rv = AS_receiveAll(sockID, header, sizeof(AS_MessageHeader_t)); // wait for header to arrive
-  // known bug: this function will block program!
-  if(rv == sizeof(AS_MessageHeader_t))  {
-    // correct size received
-	  // successfully connected to AS Server
-	  // add this client to internal client list
-	  if(header->payloadType == AS_TypeClientID)  {
-	    // received welcome message from server!
-	    fprintf(stderr, "welcome to this server, your ID is %d\n", header->clientDestination);
-	    
-	    con = calloc(1, sizeof(AS_Connections_t));
-      con->conID = sockID;
-      con->next = NULL;
-      
-      AS_Connections_t *connection;
-      connection = AS_ConnectionList; // root of con list
-      while(connection->next != NULL) // iterate through whole list until end
-        connection = connection->next;
-      connection->next = con; // add new connection to the end of the list
-      
-	    return sockID;    // return socket fd (conID)
-	  }
+  AS_ClientEvent_t *event;
+  int conID;
+  
+  conID = AS_ClientConnectAsyncEx(host, port, config);
+  con = AS_ClientGetConnection(conID);
+  while(con->state != AS_ConEstablished && con->state != AS_ConClosed)
+    AS_ClientStep(AS_TICK); // wait until connected, failed or timed out, events of other connections stay queued
+  if(con->state == AS_ConClosed)  {
+    AS_ClientDisconnect(conID);
+    return 0;
   }
-  // header not received completely!
-  fprintf(stderr, "problems connecting to server [%s]:%s\n", host, port);
-	return 0;
+  // drop AS_TypeConnected, the return value reports success
+  event = AS_ClientPopEvent(con);
+  AS_ClientEventFree(event);
+  return conID;
 }
 
-int AS_ClientCheckConID(int conID)  { // test if conID is in list of current conections monitored by AS
+int AS_ClientPoll(int msec) {
+  // event loop for all connections: waits for network activity (at most msec) and queues events
   if(!AS_initialized) AS_init();
+  int conID;
   
-  AS_Connections_t *connection;
-  
-  connection = AS_ConnectionList; // root of con list
-  while(connection->next != NULL) { // iterate through whole list until end
-    connection = connection->next;
-    if(connection->conID == conID)  {
-      return true; // found this conID in the list -> return true (1)
-    }
-  }
-  return false;
+  // events the caller has not been told about are returned at once,
+  // events left untouched since the last call do not stop waiting for new ones
+  if((conID = AS_ClientPolled(1)) != 0)
+    return conID;
+  AS_ClientStep(msec);
+  if((conID = AS_ClientPolled(1)) != 0)
+    return conID;
+  return AS_ClientPolled(0);
 }
 
-AS_ClientEvent_t* AS_ClientEvent(int conID) { // check for incomming stuff, receive data to buffer and return header
+AS_ClientEvent_t* AS_ClientEventGet(int conID, int receive) {
+  // next event of conID, receive: read from the socket first if none is waiting
   if(!AS_initialized) AS_init();
   
   if(!AS_ClientCheckConID(conID)) {
     fprintf(stderr, "AS_ClientEvent error: conID not valid\n");
-    return NULL;  // conID not valid (server socket fd)
+    return NULL;  // conID not valid
   }
   
-  struct timeval tv;
-  fd_set fds;
-  int rv;
   static AS_ClientEvent_t *event = NULL; // including header
-  static void *payload = NULL; // use same pointer to payload
+  AS_Connections_t *con;
+  int type;
   
-  // each time this function is called, the old payload will be deleted
-  if(payload != NULL) {
-    free(payload);
-    payload = NULL;
-  }
-  if(event != NULL) {
-    free(event);
-    event = NULL;
-  }
-  
-  /*
-  tv.tv_sec = 0;
-  tv.tv_usec = 1000; // 1 ms
-  FD_ZERO(&fds);
-  FD_SET(conID, &fds);  // only this socket should be monitored
-  */
-  fcntl(conID, F_SETFL, O_NONBLOCK);  // non-blocking!
-  //if(select(conID + 1, &fds, NULL, NULL, &tv))  { known bug: segmentation fault! (no idea why) -> use non blocking socket instead
-    event = calloc(1, sizeof(AS_ClientEvent_t));
-    event->header = calloc(1, sizeof(AS_MessageHeader_t));
-    
-    rv = recv(conID, event->header, sizeof(AS_MessageHeader_t), 0);
-    // known bug: if a correct header is send but only a part of it is received in one call of recv
-    // this header will not be recognised and the packet is lost!
-    
-    if(rv == -1)  { // error  
-      if(errno != EWOULDBLOCK)  {  // ignore blocking "error"
-        //perror("receive");
-        return NULL;
-      }
-    } else if(rv == 0) {  // connection closed
-      fprintf(stderr, "remote socket closed\n");
-      AS_ClientDisconnect(conID);
-      event->header->payloadType = AS_TypeShutdown;
-    } else  { // receive data!
-      if(rv == sizeof(AS_MessageHeader_t) && event->header->as_identifier == 144)  {
-        // received header with correct size and correct identifier
-        // header is already in event variable
-        // now receive payload
-        if(event->header->payloadLength)  {
-          payload = calloc(1, event->header->payloadLength);
-          AS_receiveAll(conID, payload, event->header->payloadLength);
-          // now, payload is downloaded to "payload"
-          event->payload = payload; // copy pointer to event return value
-        }
-        
-        if(event->header->payloadType == AS_TypeShutdown)
-          AS_ClientDisconnect(conID);
-        
-        if(event->header->payloadType == AS_TypeListOfClients)  {
-          int num, i;
-          int *cid;
-          num = event->header->payloadLength / sizeof(int);
-          cid = event->payload;
-          fprintf(stderr, "%d clients are connected to the server:", num);
-          for(i = 0; i < num; i++) {
-            if(i == (num-1))
-              fprintf(stderr, " #%d\n", *cid);
-            else
-              fprintf(stderr, " #%d,", *cid);
-            cid ++; // point to next int
-          }
-        }
-          
-      } else  { // header size
-        fprintf(stderr, "error: received incorrect header! (rv=%d)\n", rv);
-        return NULL;
-      }
+  // each time this function is called, the old event will be deleted
+  AS_ClientEventFree(event);
+  event = NULL;
+  
+  AS_TimerWheelAdvance(&AS_ClientWheel, &AS_ClientTimer, NULL); // heartbeats and timeouts of all connections
+  AS_TimerWheelAdvance(&AS_CallWheel, &AS_ClientCallTimer, NULL); // request timeouts
+  con = AS_ClientGetConnection(conID);
+  if(receive && con->events == NULL)
+    AS_ClientProcess(con);  // non-blocking
+  if((event = AS_ClientPopEvent(con)) == NULL)
+    return NULL;
+  
+  type = event->header->payloadType;
+  if((type == AS_TypeShutdown || type == AS_TypeConnectFailed) && con->state == AS_ConClosed)
+    AS_ClientDisconnect(conID); // last event of this connection
+  
+  if(type == AS_TypeListOfClients)  {
+    int num, i;
+    int *cid;
+    num = event->header->payloadLength / sizeof(int);
+    cid = event->payload;
+    fprintf(stderr, "%d clients are connected to the server:", num);
+    for(i = 0; i < num; i++) {
+      if(i == (num-1))
+        fprintf(stderr, " #%d\n", *cid);
+      else
+        fprintf(stderr, " #%d,", *cid);
+      cid ++; // point to next int
     }
-    return event;
-  //}
-  // timeout (no data waiting)
-  return NULL;
+  }
+  return event;
+}
+
+AS_ClientEvent_t* AS_ClientEvent(int conID) { // check for incomming stuff, receive data to buffer and return header
+  return AS_ClientEventGet(conID, 1);
+}
+
+AS_ClientEvent_t* AS_ClientNextEvent(int conID) {
+  return AS_ClientEventGet(conID, 0);
 }
 
 int AS_ClientSendMessage(int conID, int recipient, char *message)  {
@@ -748,7 +5715,7 @@ int AS_ClientSendMessage(int conID, int recipient, char *message)  {
   
   if(!AS_ClientCheckConID(conID)) {
     fprintf(stderr, "AS_ClientSendMessage error: conID not valid\n");
-    return 0;  // conID not valid (server socket fd)
+    return 0;  // conID not valid
   }
   
   int rv;
@@ -771,31 +5738,169 @@ int AS_ClientSendMessage(int conID, int recipient, char *message)  {
   memcpy(buffer + sizeof(AS_MessageHeader_t), message, len);  // copy messsage to buffer behing header
   
   // buffer is not complete, send everything to server
-  rv =  AS_sendAll(conID, buffer, size);
+  rv =  AS_ClientSendAll(AS_ClientGetConnection(conID), buffer, size);
   // error check?
   free(header);
   free(buffer);
   return rv;
 }
 
+int AS_ClientSend(int conID, int recipient, int type, void *payload, int len)  {
+  if(!AS_initialized) AS_init();
+  if(!AS_ClientCheckConID(conID)) {
+    fprintf(stderr, "AS_ClientSend error: conID not valid\n");
+    return 0;  // conID not valid
+  }
+  
+  int rv;
+  AS_MessageHeader_t *header;
+  
+  header = malloc(sizeof(AS_MessageHeader_t) + len);
+  header->as_identifier = 144;        // mandatory (for checking at receiver)
+  header->clientSource = 0;           // server will fill this
+  header->clientDestination = recipient;
+  header->payloadType = type;
+  header->payloadLength = len;
+  if(len)
+    memcpy(header + 1, payload, len);
+  
+  rv = AS_ClientSendAll(AS_ClientGetConnection(conID), header, sizeof(AS_MessageHeader_t) + len);
+  free(header);
+  return rv;
+}
+
+int AS_ClientQueued(int conID)  {
+  if(!AS_initialized) AS_init();
+  AS_Connections_t *con;
+  
+  if((con = AS_ClientGetConnection(conID)) == NULL)
+    return -1;  // conID not valid
+  if(con->link != NULL) // channel: frames are queued on the pooled connection
+    con = con->link;
+  return con->out.bytes;
+}
+
 int AS_ClientListClients(int conID) {
   if(!AS_initialized) AS_init();
   if(!AS_ClientCheckConID(conID)) {
-    return 0;  // conID not valid (server socket fd)
+    return 0;  // conID not valid
   }
   
   int rv;
   AS_MessageHeader_t *header;
   
-  header = calloc(1, sizeof(AS_MessageHeader_t));
+  // send version of local client list, server answers with changes since then
+  header = calloc(1, sizeof(AS_MessageHeader_t) + sizeof(int));
   header->as_identifier = 144; // mandatory (for checking at receiver)
   header->clientSource = 0;
   header->clientDestination = -1;
   header->payloadType = AS_TypeAskForClients;
-  header->payloadLength = 0;
+  header->payloadLength = sizeof(int);
+  *(int *)(header + 1) = AS_ClientGetConnection(conID)->clientsVersion;
+  
+  rv = AS_ClientSendAll(AS_ClientGetConnection(conID), header, sizeof(AS_MessageHeader_t) + sizeof(int));
+  free(header);
+  return rv;
+}
+
+int AS_ClientPresence(int conID, int enable) {
+  if(!AS_initialized) AS_init();
+  if(!AS_ClientCheckConID(conID)) {
+    return 0;  // conID not valid
+  }
+  
+  int rv;
+  AS_MessageHeader_t *header;
+  
+  header = calloc(1, sizeof(AS_MessageHeader_t) + sizeof(int));
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = 0;
+  header->clientDestination = -1;
+  header->payloadType = AS_TypePresenceSubscribe;
+  header->payloadLength = sizeof(int);
+  *(int *)(header + 1) = enable ? 1 : 0;
+  
+  rv = AS_ClientSendAll(AS_ClientGetConnection(conID), header, sizeof(AS_MessageHeader_t) + sizeof(int));
+  free(header);
+  return rv;
+}
+
+int AS_ClientSetName(int conID, char *name)  {
+  if(!AS_initialized) AS_init();
+  if(!AS_ClientCheckConID(conID)) {
+    return 0;  // conID not valid
+  }
+  return AS_ClientSend(conID, -1, AS_TypeClientName, name, strlen(name)+1);
+}
+
+int AS_ClientRequest(int conID, int recipient, int method, void *args, int len, int timeout, AS_ResponseCallback_t callback, void *ctx)  {
+  if(!AS_initialized) AS_init();
+  if(!AS_ClientCheckConID(conID)) {
+    fprintf(stderr, "AS_ClientRequest error: conID not valid\n");
+    return 0;  // conID not valid
+  }
+  
+  AS_Connections_t *con;
+  AS_MessageHeader_t *header;
+  AS_Call_t *call;
+  AS_Rpc_t *rpc;
+  int id;
+  
+  con = AS_ClientGetConnection(conID);
+  if(con->state == AS_ConClosed)
+    return 0;
+  // any number of requests can be in flight, responses are matched by call ID
+  call = calloc(1, sizeof(AS_Call_t));
+  do  {
+    con->lastCall = con->lastCall == INT_MAX ? 1 : con->lastCall + 1;
+  } while(AS_IdMapGet(&con->calls, con->lastCall) != NULL);
+  call->call = con->lastCall;
+  call->method = method;
+  call->recipient = recipient;
+  call->con = con;
+  call->callback = callback;
+  call->ctx = ctx;
+  call->timer.data = call;
+  AS_IdMapPut(&con->calls, call->call, call);
+  if(timeout)
+    AS_TimerAdd(&AS_CallWheel, &call->timer, AS_TimerTick(AS_monotonicMsec() + timeout));
   
-  rv = AS_sendAll(conID, header, sizeof(AS_MessageHeader_t));
+  header = malloc(sizeof(AS_MessageHeader_t) + sizeof(AS_Rpc_t) + len);
+  header->as_identifier = 144; // mandatory (for checking at receiver)
+  header->clientSource = 0;    // server will fill this
+  header->clientDestination = recipient;
+  header->payloadType = AS_TypeRequest;
+  header->payloadLength = sizeof(AS_Rpc_t) + len;
+  rpc = (AS_Rpc_t *)(header + 1);
+  rpc->call = call->call;
+  rpc->method = method;
+  rpc->status = AS_RpcOk;
+  if(len)
+    memcpy(rpc + 1, args, len);
+  id = call->call; // call is already finished if the connection is lost while sending
+  AS_ClientSendAll(con, header, sizeof(AS_MessageHeader_t) + header->payloadLength);
   free(header);
+  return id;
+}
+
+int AS_ClientRespond(int conID, AS_ClientEvent_t *request, int status, void *result, int len) {
+  if(!AS_initialized) AS_init();
+  if(!AS_ClientCheckConID(conID)) {
+    return 0;  // conID not valid
+  }
+  
+  int rv;
+  AS_Rpc_t *rpc;
+  
+  if(request == NULL || request->header->payloadType != AS_TypeRequest || request->header->payloadLength < sizeof(AS_Rpc_t))
+    return 0;
+  rpc = malloc(sizeof(AS_Rpc_t) + len);
+  *rpc = *(AS_Rpc_t *)request->payload;
+  rpc->status = status;
+  if(len)
+    memcpy(rpc + 1, result, len);
+  rv = AS_ClientSend(conID, request->header->clientSource, AS_TypeResponse, rpc, sizeof(AS_Rpc_t) + len);
+  free(rpc);
   return rv;
 }
 
@@ -803,10 +5908,16 @@ int AS_ClientDisconnect(int conID)	{
   if(!AS_initialized) AS_init();
   
   if(!AS_ClientCheckConID(conID)) {
-    return 0;  // conID not valid (server socket fd)
+    return 0;  // conID not valid
   }
   
-  AS_Connections_t *connection, *last;
+  AS_Connections_t *connection, *last, *link = NULL;
+  AS_Reassembly_t *part;
+  int i;
+  
+  connection = AS_ClientGetConnection(conID);
+  if(connection->pool && connection->channelsNum > 0)
+    return 0; // pooled connection is closed with its last channel
   
   connection = AS_ConnectionList; // root of con list
   while(connection->next != NULL) { // iterate through whole list until end
@@ -814,11 +5925,51 @@ int AS_ClientDisconnect(int conID)	{
     connection = connection->next;
     if(connection->conID == conID)  {
       last->next = connection->next;
+      if((link = connection->link) != NULL) { // channel: release it on the pooled connection
+        link->channels[connection->channel] = NULL;
+        link->channelsNum--;
+      }
+      // discard events not handled by application
+      while(connection->events != NULL)
+        AS_ClientEventFree(AS_ClientPopEvent(connection));
+      AS_IdSetFree(&connection->clients);
+      for(i = 0; i < connection->calls.size; i++)  // pending requests are dropped silently
+        if(connection->calls.keys[i] >= 0)  {
+          AS_TimerRemove(&((AS_Call_t *)connection->calls.values[i])->timer);
+          free(connection->calls.values[i]);
+        }
+      AS_IdMapFree(&connection->calls);
+      while(connection->fragments != NULL)  {
+        part = connection->fragments;
+        connection->fragments = part->next;
+        free(part->payload);
+        free(part);
+      }
+      AS_TimerRemove(&connection->timer);
+      AS_InBufferFree(&connection->in);
+      AS_ClientFlush(connection); // last frames, best effort
+      AS_OutQueueClear(&connection->out);
+      AS_ClientResolveCancel(connection);
+      AS_ClientCloseAttempts(connection);
+      if(connection->socket != -1)
+        close(connection->socket);
+      AS_ClientDatagramClose(connection);
+      free(connection->attempts);
+      free(connection->addrs);
+      free(connection->host);
+      free(connection->port);
       free(connection); // free memory
       break;
     }
   }
-  
-  close(conID);
+  if(link != NULL && link->channelsNum == 0)  {
+    if(link->state == AS_ConEstablished)  { // keep it for further connects for a while
+      link->lingerUntil = AS_monotonicMsec() + link->config.option[AS_OptPoolLinger];
+      AS_TimerRemove(&link->timer);
+      AS_ClientSchedule(link);
+    } else  {
+      AS_ClientDisconnect(link->conID);
+    }
+  }
   return 1;
 }
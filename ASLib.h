@@ -13,12 +13,68 @@
 #define AS_VERSION 1
 #define AS_LOG
 #define AS_MAXPORT 65535
-#define AS_BACKLOG 5
+#define AS_BACKLOG 128 // default listen() backlog, see AS_OptBacklog
+#define AS_MAXPAYLOAD 67108864 // default bytes per received frame, see AS_OptMaxPayload
 #define AS_BUFFLEN 1024
 #define AS_IPv4 4
 #define AS_IPv6 6
 #define AS_IPunspec 0
 #define AS_NAMELEN 128
+#define AS_SECRET_MAX 256       // bytes of the shared secret of a federation (AS_SetPeerSecret)
+#define AS_PRESENCE_INTERVAL 50 // ms, join/leave deltas are collected and sent as one frame per interval
+#define AS_PRESENCE_HISTORY 64  // number of presence deltas kept by the server for versioned client lists
+#define AS_TICK 10              // ms per tick of the timer wheels (heartbeats and timeouts)
+#define AS_FRAGMENT 16384       // bulk payloads larger than this are sent as AS_TypeFragment frames
+#define AS_DATAGRAM 1400        // bytes per datagram (AS_Datagram_t + header + payload), larger unreliable frames go over TCP
+#define AS_HANDOVER_TIMEOUT 5000 // ms a handover may make no progress (see AS_SetHandover) before the running server continues
+#define AS_HANDOVER_WINDOW 65536  // bytes of a handover the new server has not read yet, clients not sent are served meanwhile
+
+// options (AS_SetOption or AS_Config_t), apply to servers started and connections established afterwards
+#define AS_OptBacklog 0       // listen() backlog
+#define AS_OptAcceptThread 1  // 1: accept connections in a dedicated thread and hand them to the server thread
+#define AS_OptHeartbeat 2     // ms without sending before a heartbeat is sent, 0: off
+#define AS_OptIdleTimeout 3   // ms without receiving before connection is closed, 0: off
+#define AS_OptReadTimeout 4   // ms to complete a started frame before connection is closed, 0: off
+#define AS_OptConnectTimeout 5  // ms for resolving, connecting and welcome message of a new connection
+#define AS_OptConnectDelay 6    // ms before the next address is tried in parallel (happy eyeballs)
+#define AS_OptResolverTTL 7     // ms resolved addresses of host:port are reused by further connects, 0: always resolve
+#define AS_OptPool 8            // 1: connects to the same host:port share one socket (channels of a pooled connection)
+#define AS_OptPoolLinger 9      // ms a pooled connection stays open after its last channel was disconnected
+#define AS_OptReadBudget 10     // bytes the server reads from one client per wakeup before serving the next
+#define AS_OptFrameBudget 11    // frames the server handles from one client per wakeup before serving the next
+#define AS_OptRateLimit 12      // bytes/s the server reads from one client, 0: off
+#define AS_OptRateBurst 13      // bytes a client may send at once when it was quiet before, 0: one second of AS_OptRateLimit
+#define AS_OptMailboxSegment 14 // bytes per mailbox segment file (see AS_SetMailbox)
+#define AS_OptMailboxSize 15    // bytes kept per mailbox, oldest segments are deleted first
+#define AS_OptMailboxAge 16     // ms frames are kept in a mailbox, 0: no limit
+#define AS_OptMailboxQueue 17   // bytes waiting for a named client before further frames go to its mailbox
+#define AS_OptMailboxBatch 18   // frames per replay batch
+#define AS_OptNodeId 19         // 1..AS_NODE_MAX: node of this server in a federation (see AS_ServerPeer), 0: no federation
+#define AS_OptTraceSample 20    // trace one of this many frames sent to other clients (AS_TypeTraced), 0: off
+#define AS_OptSendBuffer 21     // SO_SNDBUF of connections (bytes), 0: kernel default
+#define AS_OptRecvBuffer 22     // SO_RCVBUF of connections (bytes), 0: kernel default
+#define AS_OptNoDelay 23        // 1: TCP_NODELAY (no Nagle delay for small frames)
+#define AS_OptBusyPoll 24       // SO_BUSY_POLL of connections (us), 0: off
+#define AS_OptQuickAck 25       // 1: TCP_QUICKACK after each read (no delayed ACKs)
+#define AS_OptAffinity 26       // bit mask of CPUs 0..30 for the server and acceptor threads, 0: any
+#define AS_OptMaxClients 27     // clients per server, further connections are closed, 0: unlimited
+#define AS_OptMaxPayload 28     // bytes per received frame, larger ones close the connection, 0: no limit below 2 GB
+#define AS_OptReadBuffer 29     // bytes of the receive buffer per connection (default AS_BUFFLEN)
+#define AS_OptHookWorkers 30    // threads per server running hooks (see AS_SetHook), 0: all hooks run in the server thread
+#define AS_OptDatagram 31       // 1: server offers / client accepts a UDP channel for frames flagged AS_TypeUnreliable
+#define AS_OptClientMemory 32   // bytes per connection (receive buffer, frame in progress, queued frames), 0: unlimited
+#define AS_OptServerMemory 33   // bytes of all connections of a server, reading pauses while it is used up, 0: unlimited
+#define AS_OptNum 34
+
+// client IDs: bits 0..24 identify the connection at the server, bits 25..30 the channel of a pooled connection
+// of bits 0..24: bits 0..19 connection number at the server, bits 20..24 node of the server (AS_OptNodeId)
+#define AS_NODE_SHIFT 20
+#define AS_NODE_MAX 31
+#define AS_NODE_MASK (AS_NODE_MAX << AS_NODE_SHIFT)
+#define AS_CHANNEL_SHIFT 25
+#define AS_CHANNEL_MAX 63       // channels per pooled connection (channel 0: the connection itself)
+#define AS_CHANNEL_MASK (AS_CHANNEL_MAX << AS_CHANNEL_SHIFT)
+#define AS_ID_MASK ((1 << AS_CHANNEL_SHIFT) - 1)
 
 #define AS_TypeShutdown 1
 #define AS_TypeClientID 2
@@ -26,10 +82,47 @@
 #define AS_TypeClientDisconnect 4
 #define AS_TypeAskForClients 5
 #define AS_TypeListOfClients 6
+#define AS_TypePresence 7           // batch of joins/leaves (AS_PresenceDelta_t + ids)
+#define AS_TypePresenceSubscribe 8  // client enables/disables presence frames (payload: int)
+#define AS_TypeClientListDelta 9    // answer to versioned AS_TypeAskForClients (AS_PresenceDelta_t + ids)
+#define AS_TypeHeartbeat 10         // keeps idle connections alive, not reported to application
+#define AS_TypeFragment 11          // part of a large bulk frame (AS_Fragment_t + data), reassembled by the library
+#define AS_TypeClientName 12        // client registers its name (payload: string), frames for it are kept while it is offline
+#define AS_TypePeerHello 13         // server introduces itself to a peer of the federation (payload: int node, shared secret)
+#define AS_TypePeerPresence 14      // joins/leaves of the clients of a peer (AS_PresenceDelta_t + ids)
+#define AS_TypeDatagramOffer 15     // server offers its UDP channel after the welcome message (AS_DatagramOffer_t)
+#define AS_TypeDatagramHello 16     // client registers its UDP endpoint (datagram without payload), acknowledged over TCP
+#define AS_TypeTraced 0x40000000    // flag in payloadType: payload starts with AS_Trace_t (added and removed by the library)
+#define AS_TypeUnreliable 0x20000000 // flag in payloadType: frame may be sent as datagram (can be lost or reordered), removed by the library
+// local events, never sent over the network
+#define AS_TypeConnected 100      // asynchronous connect finished, clientDestination = own client ID
+#define AS_TypeConnectFailed 101  // asynchronous connect failed, conID is invalid afterwards
+
 #define AS_TypeMessage 50
 #define AS_TypeFileRequest 51
 #define AS_TypeFileAnswer 52
 #define AS_TypeFileData 53
+#define AS_TypeRequest 54   // RPC request (AS_Rpc_t + arguments) to a client or to the server (-1), see AS_ClientRequest
+#define AS_TypeResponse 55  // RPC response (AS_Rpc_t + result), see AS_ClientRespond
+
+// status of RPC responses, application handlers may use values > 0
+#define AS_RpcOk 0
+#define AS_RpcTimeout -1      // no response within the timeout (reported by the library)
+#define AS_RpcLost -2         // connection lost before the response arrived (reported by the library)
+#define AS_RpcUnreachable -3  // recipient is not connected (reported by the server)
+#define AS_RpcNoHandler -4    // server has no handler for this method
+
+// methods of requests to the server, built-in ones can be replaced by AS_SetHandler
+#define AS_MethodPing 1       // result: the arguments
+#define AS_MethodClients 2    // result: IDs of all clients (int array, as AS_TypeListOfClients)
+#define AS_MethodFind 3       // arguments: name (string), result: ID of the client with this name (int)
+#define AS_METHODS 256        // methods 1..AS_METHODS-1 can have handlers
+
+// result of server hooks (AS_SetHook)
+#define AS_HookForward 0  // forward the frame (with the changes made by the hook) to clientDestination
+#define AS_HookDrop 1     // discard the frame
+#define AS_HookReply 2    // send the frame (with the changes made by the hook) back to its source, on behalf of the server
+#define AS_HOOKS 256      // payload types AS_TypeMessage..AS_HOOKS-1 can have hooks
 
 /*
   AF_INET
@@ -41,7 +134,9 @@
 //        STRUCTURES        //
 //////////////////////////////
 
+#ifndef __cplusplus
 typedef enum { false, true } bool;
+#endif
 
 typedef struct AS_MessageHeader_s { // header of each packet! afterwards -> payload
   int as_identifier;          // has to be set to 144 all the time
@@ -51,28 +146,140 @@ typedef struct AS_MessageHeader_s { // header of each packet! afterwards -> payl
   unsigned int payloadLength; // bytes
 } AS_MessageHeader_t;
 
+typedef struct AS_PresenceDelta_s { // payload header of AS_TypePresence and AS_TypeClientListDelta
+  int fromVersion;  // client list version this delta applies to, 0: complete list follows
+  int toVersion;    // client list version after applying this delta
+  int leaveNum;     // number of client IDs that left (first in payload)
+  int joinNum;      // number of client IDs that joined (behind the leaves)
+} AS_PresenceDelta_t;
+
+typedef struct AS_Fragment_s { // payload header of AS_TypeFragment, followed by a part of the original payload
+  unsigned int payloadType;   // type of the original frame
+  unsigned int payloadLength; // length of the original payload
+  unsigned int offset;        // position of this part in the original payload
+} AS_Fragment_t;
+
+typedef struct AS_Rpc_s { // payload header of AS_TypeRequest and AS_TypeResponse, followed by arguments/result
+  int call;     // correlation ID chosen by the caller, copied into the response
+  int method;
+  int status;   // response: AS_Rpc... or status returned by the handler
+} AS_Rpc_t;
+
+typedef struct AS_Datagram_s { // in front of each datagram, followed by header and payload
+  int client;           // client -> server: client ID of the sender, server -> client: -1
+  unsigned int token;   // from AS_TypeDatagramOffer, datagrams with another token are dropped
+} AS_Datagram_t;
+
+typedef struct AS_DatagramOffer_s { // payload of AS_TypeDatagramOffer, the host is the one of the TCP connection
+  int port;
+  unsigned int token;
+} AS_DatagramOffer_t;
+
+typedef struct AS_Trace_s { // timestamps of a traced frame (ns, CLOCK_MONOTONIC, comparable on one host only)
+  long long send;     // frame queued by the sending client
+  long long receive;  // frame complete at the server
+  long long forward;  // frame queued for the recipient(s)
+} AS_Trace_t;
+
+#define AS_HopSend 0      // send -> server receive (sender queue, network, server read)
+#define AS_HopServer 1    // server receive -> forward
+#define AS_HopDeliver 2   // forward -> returned by AS_ClientEvent (server queue, network, receiver queue)
+#define AS_HopTotal 3     // send -> returned by AS_ClientEvent
+#define AS_HopNum 4
+
+typedef struct AS_TraceStats_s { // latency of one hop (ns), see AS_TraceGet
+  long long count;
+  long long min;
+  long long max;
+  long long mean;
+  long long p50;
+  long long p90;
+  long long p99;
+  long long p999;
+} AS_TraceStats_t;
+
+typedef struct AS_ServerStats_s { // see AS_ServerGetStats
+  int clients;          // connections (including peers)
+  long long memory;     // bytes used by all connections (receive buffers, frames in progress, queued frames)
+  long long memoryPeak; // highest value of memory since start
+  long long dropped;    // frames not queued for a recipient over its memory budget, datagrams over the limits of their sender
+  long long rejected;   // connections closed by admission control (frame over budget or server memory used up)
+} AS_ServerStats_t;
+
+typedef struct AS_Config_s { // options of one server or connection, see AS_ServerStartEx / AS_ClientConnectEx
+  int option[AS_OptNum];    // value per AS_Opt..., AS_ConfigInit copies the defaults set with AS_SetOption
+} AS_Config_t;
+
 typedef struct AS_ClientEvent_s { // used for return from event function
   AS_MessageHeader_t *header;
-  void* payload;
+  void* payload;  // malloc()ed, to keep it beyond the next AS_ClientEvent() take it over and set payload to NULL
 } AS_ClientEvent_t;
 
+// response (or failure) of a request, result points behind response
+typedef void (*AS_ResponseCallback_t)(int conID, AS_Rpc_t *response, void *result, int len, void *ctx);
+// server side request handler (server thread), returns status, *result (malloc()ed) is sent back and freed afterwards
+typedef int (*AS_RequestHandler_t)(int port, int client, void *args, int len, void **result, int *resultLen);
+// server side hook of a payload type, returns AS_Hook...
+// may change clientDestination, payloadType and payloadLength of header and replace *payload (malloc()ed, both are freed by the library)
+typedef int (*AS_Hook_t)(int port, AS_MessageHeader_t *header, void **payload);
+
 //////////////////////////////
 //        FUNCTIONS         //
 //////////////////////////////
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void msecsleep(int msec); // waits for msec milliseconds
 int AS_version();         // return AS version
+int AS_SetOption(int option, int value);  // set AS_Opt... for servers/connections started afterwards, returns 1 on success
+int AS_GetOption(int option);             // returns current value of AS_Opt... or -1
+void AS_ConfigInit(AS_Config_t *config);  // fill config with the current values of all options
+int AS_ConfigSet(AS_Config_t *config, int option, int value); // set AS_Opt... in config, returns 1 on success
+int AS_TraceGet(int hop, AS_TraceStats_t *stats); // latency of traced frames received by this process per AS_Hop..., returns number of samples
+int AS_TraceReset();                      // clear latency histograms
 
 int AS_ServerIsRunning(int port);       // returns 1 if an AS_Server is running in this process on this port, otherwise 0
 int AS_ServerPrintRunning();            // prints a list of all running AS_Server in this process to stdout
+int AS_SetMailbox(char *dir);           // directory for mailboxes of servers started afterwards, NULL: off
+int AS_SetHandover(char *dir);          // directory for handover sockets of servers started afterwards, NULL: off
+int AS_SetPeerSecret(char *secret);     // shared secret of the federation for servers started afterwards, returns 1 on success
+                                        // peers have to know it, NULL: only connections made with AS_ServerPeer become peers
+                                        // a server started on the port of a running one (other process) takes over its clients
+int AS_SetHandler(int method, AS_RequestHandler_t handler); // handler of AS_Method... for servers started afterwards, NULL: built-in / none
+int AS_SetHook(int type, AS_Hook_t hook, int direct);       // hook for frames of AS_Type... sent by clients to servers started afterwards, NULL: none
+                                                            // direct 1: run in the server thread (cheap hooks), 0: on a worker thread
+                                                            // frames sent in fragments are collected first, the hook sees them complete
 int AS_ServerStart(int port, int IPv);  // start ASServer at specific port
                                         // IPv can be AS_IPv4, AS_IPv6 or AS_IPunspec
+int AS_ServerStartEx(int port, int IPv, AS_Config_t *config); // same with options of config (NULL: AS_SetOption values)
 int AS_ServerStop(int port);            // stop ASServer if running
+int AS_ServerPeer(int port, char *host, char *peerPort); // connect server on port with the server at host:peerPort (same federation, other AS_OptNodeId)
+int AS_ServerGetStats(int port, AS_ServerStats_t *stats); // memory usage and admission control of a running server, returns 1 on success
 
 int AS_ClientConnect(char* host, char *port); // establish a connection to an AS_Server at [host]:port, returns connection id: cid
-int AS_ClientDisconect(int conID);            // disconnects from an AS_Server previously connected with AS_ClientConnect
+int AS_ClientConnectAsync(char* host, char *port); // same without blocking, returns pending conID, result is reported by AS_ClientEvent()
+int AS_ClientConnectEx(char* host, char *port, AS_Config_t *config);      // AS_ClientConnect with options of config (NULL: AS_SetOption values)
+int AS_ClientConnectAsyncEx(char* host, char *port, AS_Config_t *config); // AS_ClientConnectAsync with options of config
+int AS_ClientPoll(int msec);                  // wait up to msec for events of all connections, returns a conID with events waiting or 0
+int AS_ClientDisconnect(int conID);           // disconnects from an AS_Server previously connected with AS_ClientConnect
 AS_ClientEvent_t* AS_ClientEvent(int conID);  // listen to socket and return NULL or an even structure
+AS_ClientEvent_t* AS_ClientNextEvent(int conID); // same without reading from the socket: events received by AS_ClientPoll
 int AS_ClientSendMessage(int conID, int recipient, char *message);
+int AS_ClientSend(int conID, int recipient, int type, void *payload, int len); // send payload of any AS_Type... to recipient (-2: broadcast)
+int AS_ClientQueued(int conID);               // bytes queued for the server and not sent yet, -1: conID not valid
 int AS_ClientListClients(int conID);          // ask server for a list of all connected clients
+int AS_ClientPresence(int conID, int enable); // enable (1) or disable (0) connect/disconnect notifications
+int AS_ClientSetName(int conID, char *name);  // register name at the server, frames sent while offline are delivered on reconnect
+int AS_ClientRequest(int conID, int recipient, int method, void *args, int len, int timeout, AS_ResponseCallback_t callback, void *ctx);
+                                              // send request to a client or the server (-1), returns call ID or 0
+                                              // response goes to callback (called by AS_ClientPoll/AS_ClientEvent, must not disconnect)
+                                              // or, without callback, is returned as AS_TypeResponse event; timeout in ms, 0: none
+int AS_ClientRespond(int conID, AS_ClientEvent_t *request, int status, void *result, int len); // answer an AS_TypeRequest event
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,647 @@
+/************************************
+ *            ASLib.hpp             *
+ *         AbstractSocket           *
+ *  C++20 interface to ASLib.h:     *
+ *  RAII objects, owned payloads,   *
+ *  coroutines, typed dispatch      *
+ ************************************/
+
+#ifndef ASLIB_HPP_
+#define ASLIB_HPP_
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "ASLib.h"
+
+namespace AS {
+
+class Loop;
+class Connection;
+
+class Error : public std::runtime_error { // failed connect, start of a server, closed connection
+public:
+  using std::runtime_error::runtime_error;
+};
+
+//////////////////////////////
+//     BUFFERS, FRAMES      //
+//////////////////////////////
+
+class Buffer { // move-only owner of a malloc()ed block, payloads of the library are taken over without copying
+public:
+  Buffer() = default;
+  Buffer(void *block, std::size_t size, std::size_t offset = 0) : block_(static_cast<std::byte *>(block)), offset_(offset), size_(size) {}
+  Buffer(Buffer &&other) noexcept : block_(std::move(other.block_)), offset_(std::exchange(other.offset_, 0)), size_(std::exchange(other.size_, 0)) {}
+  Buffer &operator=(Buffer &&other) noexcept {
+    block_ = std::move(other.block_);
+    offset_ = std::exchange(other.offset_, 0);
+    size_ = std::exchange(other.size_, 0);
+    return *this;
+  }
+
+  static Buffer copy(const void *data, std::size_t size) { // malloc()ed copy, terminated by '\0' like payloads of the library
+    void *block = std::malloc(size + 1);
+    if(block == nullptr)
+      throw std::bad_alloc();
+    if(size)
+      std::memcpy(block, data, size);
+    static_cast<char *>(block)[size] = '\0';
+    return Buffer(block, size);
+  }
+
+  std::byte *data() { return block_ ? block_.get() + offset_ : nullptr; }
+  const std::byte *data() const { return block_ ? block_.get() + offset_ : nullptr; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::span<const std::byte> bytes() const { return {data(), size_}; }
+  std::string_view view() const { return {reinterpret_cast<const char *>(data()), size_}; }
+  std::string_view text() const { // view without the terminating '\0' sent by AS_ClientSendMessage
+    std::string_view v = view();
+    return !v.empty() && v.back() == '\0' ? v.substr(0, v.size() - 1) : v;
+  }
+
+  template<typename T> std::optional<T> as(std::size_t offset = 0) const { // copy of a payload header at offset
+    static_assert(std::is_trivially_copyable_v<T>, "AS::Buffer::as needs a trivially copyable type");
+    if(offset + sizeof(T) > size_)
+      return std::nullopt;
+    T value;
+    std::memcpy(&value, data() + offset, sizeof(T));
+    return value;
+  }
+
+  Buffer tail(std::size_t offset) && { // same block without the first offset bytes (e.g. behind AS_Rpc_t)
+    if(offset > size_)
+      offset = size_;
+    Buffer rest(std::move(*this));
+    rest.offset_ += offset;
+    rest.size_ -= offset;
+    return rest;
+  }
+
+private:
+  struct Free { void operator()(std::byte *block) const { std::free(block); } };
+  std::unique_ptr<std::byte, Free> block_;
+  std::size_t offset_ = 0;
+  std::size_t size_ = 0;
+};
+
+class Frame { // header and payload of one event
+public:
+  Frame() = default;
+  Frame(const AS_MessageHeader_t &header, Buffer payload) : header_(header), payload_(std::move(payload)) {}
+  explicit Frame(AS_ClientEvent_t *event) : header_(*event->header), payload_(event->payload, event->header->payloadLength) {
+    event->payload = nullptr; // taken over, not freed by the next AS_ClientEvent()
+  }
+
+  unsigned type() const { return header_.payloadType; }
+  int source() const { return header_.clientSource; }
+  int destination() const { return header_.clientDestination; }
+  const AS_MessageHeader_t &header() const { return header_; }
+  Buffer &payload() { return payload_; }
+  const Buffer &payload() const { return payload_; }
+  Buffer take() { return std::move(payload_); }
+
+private:
+  AS_MessageHeader_t header_ = {};
+  Buffer payload_;
+};
+
+struct Response { // result of Connection::request
+  int status = AS_RpcOk;  // AS_Rpc... or status returned by the handler
+  Buffer result;
+};
+
+class Config { // options of one server or connection, starts with the AS_SetOption values
+public:
+  Config() { AS_ConfigInit(&config_); }
+  Config &set(int option, int value) {
+    if(!AS_ConfigSet(&config_, option, value))
+      throw Error("AS::Config: invalid option " + std::to_string(option));
+    return *this;
+  }
+  int get(int option) const { return option >= 0 && option < AS_OptNum ? config_.option[option] : -1; }
+  AS_Config_t *c() const { return const_cast<AS_Config_t *>(&config_); }
+
+private:
+  AS_Config_t config_;
+};
+
+//////////////////////////////
+//         SERVER           //
+//////////////////////////////
+
+class Server { // AS_Server on port, stopped when the object is destroyed
+public:
+  explicit Server(int port, int IPv = AS_IPunspec, const Config *config = nullptr) {
+    if(!AS_ServerStartEx(port, IPv, config != nullptr ? config->c() : nullptr))
+      throw Error("AS::Server: cannot start server on port " + std::to_string(port));
+    port_ = port;
+  }
+  Server(Server &&other) noexcept : port_(std::exchange(other.port_, 0)) {}
+  Server &operator=(Server &&other) noexcept {
+    if(this != &other)  {
+      stop();
+      port_ = std::exchange(other.port_, 0);
+    }
+    return *this;
+  }
+  ~Server() { stop(); }
+
+  int port() const { return port_; }
+  bool peer(const std::string &host, const std::string &port) {
+    return AS_ServerPeer(port_, const_cast<char *>(host.c_str()), const_cast<char *>(port.c_str()));
+  }
+  AS_ServerStats_t stats() const {
+    AS_ServerStats_t stats = {};
+    AS_ServerGetStats(port_, &stats);
+    return stats;
+  }
+  void stop() {
+    if(port_)
+      AS_ServerStop(port_);
+    port_ = 0;
+  }
+
+private:
+  int port_ = 0;
+};
+
+//////////////////////////////
+//         TASKS            //
+//////////////////////////////
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation; // awaiting coroutine
+  std::exception_ptr error;
+  Loop *loop = nullptr;                 // set by Loop::spawn, the loop destroys the task when it is done
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template<typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> task) noexcept;
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; } // started by co_await or Loop::spawn
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template<typename T> struct Promise : PromiseBase {
+  std::optional<T> value;
+  template<typename U> void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+  T result() {
+    if(error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template<> struct Promise<void> : PromiseBase {
+  void return_void() {}
+  void result() {
+    if(error)
+      std::rethrow_exception(error);
+  }
+};
+
+} // namespace detail
+
+template<typename T> class [[nodiscard]] Task { // lazy coroutine, runs when awaited or spawned on a Loop
+public:
+  struct promise_type : detail::Promise<T> {
+    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+  };
+
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if(this != &other)  {
+      if(handle_)
+        handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+  ~Task() {
+    if(handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+    handle_.promise().continuation = caller;
+    return handle_; // symmetric transfer, the task returns to caller when done
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  friend class Loop;
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  std::coroutine_handle<promise_type> handle_;
+};
+
+//////////////////////////////
+//       EVENT LOOP         //
+//////////////////////////////
+
+class Loop { // resumes coroutines driven by AS_ClientPoll, single-threaded like the client functions of the library
+public:
+  Loop() = default;
+  Loop(const Loop &) = delete;
+  Loop &operator=(const Loop &) = delete;
+  ~Loop() {
+    std::unordered_set<void *> tasks;
+    tasks.swap(tasks_);
+    for(void *task : tasks) // unfinished tasks, their connections are closed on the way
+      std::coroutine_handle<>::from_address(task).destroy();
+  }
+
+  template<typename T> void spawn(Task<T> task) { // run task on this loop, it is destroyed when done
+    auto handle = std::exchange(task.handle_, {});
+    handle.promise().loop = this;
+    tasks_.insert(handle.address());
+    ready_.push_back(handle);
+  }
+
+  void poll(int msec) { // wait up to msec for the network, resume coroutines whose operations completed
+    AS_ClientPoll(ready_.empty() ? msec : 0); // events of conIDs outside this loop do not cut the wait short
+    pump();
+    resume();
+    if(error_)
+      std::rethrow_exception(std::exchange(error_, nullptr)); // exception of a spawned task
+  }
+  void run() { // until all spawned tasks are done
+    while(!tasks_.empty())
+      poll(AS_TICK);
+  }
+  bool runFor(int msec) { // poll for msec, returns true if spawned tasks are left
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+    while(std::chrono::steady_clock::now() < end)
+      poll(AS_TICK);
+    return !tasks_.empty();
+  }
+  bool empty() const { return tasks_.empty(); }
+
+  void setSendLimit(int bytes) { sendLimit_ = bytes; } // co_await Connection::send suspends while more bytes are queued
+  int sendLimit() const { return sendLimit_; }
+
+  class ConnectAwaiter;
+  ConnectAwaiter connect(std::string host, std::string port, const Config *config = nullptr);
+
+private:
+  friend class Connection;
+  friend struct detail::PromiseBase::FinalAwaiter;
+
+  struct Call { // pending request
+    std::coroutine_handle<> waiter;
+    Response response;
+  };
+  struct Channel { // state of one conID
+    int id = 0;                 // own client ID, reported by AS_TypeConnected
+    bool connected = false;
+    bool closed = false;        // conID no longer valid
+    std::deque<Frame> frames;   // received, not awaited yet
+    std::coroutine_handle<> receiver;
+    std::coroutine_handle<> connector;
+    std::vector<std::coroutine_handle<>> senders;
+    std::unordered_map<int, Call *> calls;  // call ID -> request waiting for its response
+  };
+
+  void wake(std::coroutine_handle<> &waiter) {
+    if(waiter)
+      ready_.push_back(std::exchange(waiter, {}));
+  }
+
+  void pump() { // take over the events AS_ClientPoll has received, waiters are resumed afterwards by resume()
+    for(auto &[conID, channel] : channels_) {
+      AS_ClientEvent_t *event;
+      while(!channel.closed && (event = AS_ClientNextEvent(conID)) != NULL)
+        receive(conID, channel, Frame(event));
+      if(channel.receiver && (!channel.frames.empty() || channel.closed))
+        wake(channel.receiver);
+      if(!channel.senders.empty() && (channel.closed || AS_ClientQueued(conID) <= sendLimit_)) {
+        for(auto &sender : channel.senders)
+          wake(sender);
+        channel.senders.clear();
+      }
+    }
+  }
+
+  void receive(int conID, Channel &channel, Frame frame) {
+    if(frame.type() == AS_TypeConnected)  {
+      channel.id = frame.destination();
+      channel.connected = true;
+      wake(channel.connector);
+      return;
+    }
+    if(frame.type() == AS_TypeConnectFailed)  { // the library has released the conID
+      channel.closed = true;
+      wake(channel.connector);
+      return;
+    }
+    if(frame.type() == AS_TypeResponse) {
+      auto rpc = frame.payload().as<AS_Rpc_t>();
+      auto call = rpc ? channel.calls.find(rpc->call) : channel.calls.end();
+      if(call != channel.calls.end()) { // response of Connection::request, result is handed over without copying
+        call->second->response.status = rpc->status;
+        call->second->response.result = frame.take().tail(sizeof(AS_Rpc_t));
+        wake(call->second->waiter);
+        channel.calls.erase(call);
+        return;
+      }
+    }
+    if(frame.type() == AS_TypeShutdown && AS_ClientQueued(conID) < 0)
+      channel.closed = true; // last event, the library has released the conID
+    channel.frames.push_back(std::move(frame));
+  }
+
+  void resume() {
+    std::deque<std::coroutine_handle<>> ready;
+    ready.swap(ready_);
+    for(auto handle : ready)
+      handle.resume();
+  }
+
+  void finish(std::coroutine_handle<> task, std::exception_ptr error) {
+    tasks_.erase(task.address());
+    if(error && !error_)
+      error_ = error;
+    task.destroy();
+  }
+
+  std::unordered_map<int, Channel> channels_; // node based: Channel pointers stay valid until the conID is closed
+  std::deque<std::coroutine_handle<>> ready_;
+  std::unordered_set<void *> tasks_;
+  std::exception_ptr error_;
+  int sendLimit_ = 4 * AS_FRAGMENT;
+};
+
+template<typename P> std::coroutine_handle<> detail::PromiseBase::FinalAwaiter::await_suspend(std::coroutine_handle<P> task) noexcept {
+  PromiseBase &promise = task.promise();
+  if(promise.loop != nullptr) { // spawned
+    promise.loop->finish(task, promise.error);
+    return std::noop_coroutine();
+  }
+  return promise.continuation ? promise.continuation : std::noop_coroutine();
+}
+
+//////////////////////////////
+//       CONNECTIONS        //
+//////////////////////////////
+
+class Connection { // conID of the library, disconnected when the object is destroyed
+public:
+  Connection() = default;
+  Connection(Loop &loop, const std::string &host, const std::string &port, const Config *config = nullptr) : loop_(&loop) {
+    // blocking connect, events of other connections are kept for their coroutines
+    int conID = AS_ClientConnectAsyncEx(const_cast<char *>(host.c_str()), const_cast<char *>(port.c_str()), config != nullptr ? config->c() : nullptr);
+    if(conID <= 0 || AS_ClientQueued(conID) < 0)
+      throw Error("AS::Connection: cannot connect to " + host + ":" + port + " (no connection ID)");
+    conID_ = conID;
+    Loop::Channel &channel = loop.channels_[conID_];
+    while(!channel.connected && !channel.closed) {
+      AS_ClientPoll(AS_TICK);
+      loop.pump();
+    }
+    if(channel.closed)  {
+      loop.channels_.erase(conID_);
+      conID_ = 0;
+      throw Error("AS::Connection: cannot connect to " + host + ":" + port);
+    }
+  }
+  Connection(Connection &&other) noexcept : loop_(std::exchange(other.loop_, nullptr)), conID_(std::exchange(other.conID_, 0)) {}
+  Connection &operator=(Connection &&other) noexcept {
+    if(this != &other)  {
+      close();
+      loop_ = std::exchange(other.loop_, nullptr);
+      conID_ = std::exchange(other.conID_, 0);
+    }
+    return *this;
+  }
+  ~Connection() { close(); }
+
+  int conID() const { return conID_; }
+  int id() const { return conID_ ? channel().id : 0; } // own client ID
+  bool closed() const { return !conID_ || channel().closed; }
+  void close() { // disconnect, coroutines must not wait for this connection anymore
+    if(!conID_)
+      return;
+    if(!channel().closed)
+      AS_ClientDisconnect(conID_);
+    loop_->channels_.erase(conID_);
+    conID_ = 0;
+  }
+
+  class SendAwaiter { // frame is queued already, co_await waits while more than Loop::sendLimit bytes are queued
+  public:
+    bool await_ready() { return !sent_ || channel_->closed || AS_ClientQueued(conID_) <= loop_->sendLimit_; }
+    void await_suspend(std::coroutine_handle<> waiter) { channel_->senders.push_back(waiter); }
+    int await_resume() const { return sent_; }
+    int sent() const { return sent_; } // bytes queued or 0 if the connection is closed
+  private:
+    friend class Connection;
+    SendAwaiter(Loop *loop, int conID, int sent) : loop_(loop), channel_(&loop->channels_.at(conID)), conID_(conID), sent_(sent) {}
+    Loop *loop_;
+    Loop::Channel *channel_;
+    int conID_;
+    int sent_;
+  };
+
+  SendAwaiter send(int recipient, unsigned type, std::span<const std::byte> payload) { // recipient -2: broadcast
+    int sent = channel().closed ? 0 : AS_ClientSend(conID_, recipient, type, const_cast<std::byte *>(payload.data()), payload.size());
+    return SendAwaiter(loop_, conID_, sent);
+  }
+  template<typename T> requires(std::is_trivially_copyable_v<T> && !std::is_convertible_v<const T &, std::span<const std::byte>>)
+  SendAwaiter send(int recipient, unsigned type, const T &value) { // payload: copy of a struct
+    return send(recipient, type, std::span<const std::byte>(reinterpret_cast<const std::byte *>(&value), sizeof(T)));
+  }
+  SendAwaiter send(int recipient, const std::string &message) { // AS_TypeMessage including '\0'
+    return send(recipient, AS_TypeMessage, std::as_bytes(std::span<const char>(message.c_str(), message.size() + 1)));
+  }
+
+  class ReceiveAwaiter { // next frame of this connection, throws AS::Error when the connection is closed
+  public:
+    bool await_ready() const { return !channel_->frames.empty() || channel_->closed; }
+    void await_suspend(std::coroutine_handle<> waiter) { channel_->receiver = waiter; }
+    Frame await_resume() {
+      if(channel_->frames.empty())
+        throw Error("AS::Connection: connection closed");
+      Frame frame = std::move(channel_->frames.front());
+      channel_->frames.pop_front();
+      return frame;
+    }
+  private:
+    friend class Connection;
+    explicit ReceiveAwaiter(Loop::Channel *channel) : channel_(channel) {}
+    Loop::Channel *channel_;
+  };
+
+  ReceiveAwaiter receive() { return ReceiveAwaiter(&channel()); } // one coroutine at a time
+  std::optional<Frame> tryReceive() { // without waiting for the network
+    Loop::Channel &c = channel();
+    if(c.frames.empty())  {
+      AS_ClientPoll(0);
+      loop_->pump();
+    }
+    if(c.frames.empty())
+      return std::nullopt;
+    Frame frame = std::move(c.frames.front());
+    c.frames.pop_front();
+    return frame;
+  }
+
+  class RequestAwaiter { // response of a request, AS_RpcLost if it could not be sent
+  public:
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> waiter) {
+      int id = channel_->closed ? 0 : AS_ClientRequest(conID_, recipient_, method_, const_cast<std::byte *>(args_.data()), args_.size(), timeout_, NULL, NULL);
+      if(!id) {
+        call_.response.status = AS_RpcLost;
+        return false;
+      }
+      call_.waiter = waiter;
+      channel_->calls[id] = &call_;
+      return true;
+    }
+    Response await_resume() { return std::move(call_.response); }
+  private:
+    friend class Connection;
+    RequestAwaiter(Loop::Channel *channel, int conID, int recipient, int method, std::span<const std::byte> args, int timeout)
+      : channel_(channel), conID_(conID), recipient_(recipient), method_(method), timeout_(timeout), args_(args) {}
+    Loop::Channel *channel_;
+    int conID_, recipient_, method_, timeout_;
+    std::span<const std::byte> args_;
+    Loop::Call call_;
+  };
+
+  // request to a client or the server (-1), args must stay valid until the request is awaited; timeout in ms, 0: none
+  RequestAwaiter request(int recipient, int method, std::span<const std::byte> args = {}, int timeout = 0) {
+    return RequestAwaiter(&channel(), conID_, recipient, method, args, timeout);
+  }
+  int respond(const Frame &request, int status, std::span<const std::byte> result = {}) { // answer an AS_TypeRequest frame
+    AS_MessageHeader_t header = request.header();
+    AS_ClientEvent_t event = {&header, const_cast<std::byte *>(request.payload().data())};
+    return AS_ClientRespond(conID_, &event, status, const_cast<std::byte *>(result.data()), result.size());
+  }
+
+  int listClients() { return AS_ClientListClients(conID_); }
+  int presence(bool enable) { return AS_ClientPresence(conID_, enable); }
+  int setName(const std::string &name) { return AS_ClientSetName(conID_, const_cast<char *>(name.c_str())); }
+
+private:
+  friend class Loop;
+  Connection(Loop *loop, int conID) : loop_(loop), conID_(conID) {}
+  Loop::Channel &channel() const { return loop_->channels_.at(conID_); }
+  Loop *loop_ = nullptr;
+  int conID_ = 0;
+};
+
+class Loop::ConnectAwaiter { // co_await loop.connect(host, port): connected AS::Connection, throws AS::Error on failure
+public:
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> waiter) { // not suspended if the library returns no usable conID
+    conID_ = AS_ClientConnectAsyncEx(host_.data(), port_.data(), config_ != nullptr ? config_->c() : nullptr);
+    if(conID_ <= 0 || AS_ClientQueued(conID_) < 0)
+      return false;
+    loop_->channels_[conID_].connector = waiter;
+    return true;
+  }
+  Connection await_resume() {
+    if(!loop_->channels_.contains(conID_)) // not suspended
+      throw Error("AS::Loop: cannot connect to " + host_ + ":" + port_ + " (no connection ID)");
+    if(loop_->channels_.at(conID_).closed)  {
+      loop_->channels_.erase(conID_);
+      throw Error("AS::Loop: cannot connect to " + host_ + ":" + port_);
+    }
+    return Connection(loop_, conID_);
+  }
+private:
+  friend class Loop;
+  ConnectAwaiter(Loop *loop, std::string host, std::string port, const Config *config)
+    : loop_(loop), host_(std::move(host)), port_(std::move(port)), config_(config) {}
+  Loop *loop_;
+  std::string host_, port_;
+  const Config *config_;
+  int conID_ = 0;
+};
+
+inline Loop::ConnectAwaiter Loop::connect(std::string host, std::string port, const Config *config) {
+  return ConnectAwaiter(this, std::move(host), std::move(port), config);
+}
+
+//////////////////////////////
+//     TYPED DISPATCH       //
+//////////////////////////////
+
+// handler of one payload type: f(frame), or f(header, frame) with a copy of the Header at the start of the payload
+template<unsigned Type, typename Header, typename F> struct Handler {
+  static constexpr unsigned type = Type;
+  F f;
+};
+
+template<unsigned Type, typename Header = void, typename F> Handler<Type, Header, F> on(F f) {
+  static_assert(std::is_void_v<Header> || std::is_trivially_copyable_v<Header>, "AS::on needs a trivially copyable payload header");
+  return {std::move(f)};
+}
+
+template<typename... Handlers> class Dispatch { // calls the handler of frame.type(), the chain of handlers is generated at compile time
+  static_assert(sizeof...(Handlers) > 0, "AS::Dispatch needs at least one handler");
+  static constexpr bool unique() {
+    unsigned types[] = {Handlers::type...};
+    for(std::size_t i = 0; i < sizeof...(Handlers); i++)
+      for(std::size_t j = i + 1; j < sizeof...(Handlers); j++)
+        if(types[i] == types[j])
+          return false;
+    return true;
+  }
+  static_assert(unique(), "AS::Dispatch has two handlers for the same payload type");
+
+public:
+  explicit Dispatch(Handlers... handlers) : handlers_(std::move(handlers)...) {}
+  bool operator()(Frame &frame) { // returns false if no handler matched (or the payload is shorter than its Header)
+    return call(frame, std::index_sequence_for<Handlers...>{});
+  }
+
+private:
+  template<std::size_t... I> bool call(Frame &frame, std::index_sequence<I...>) {
+    return (invoke(std::get<I>(handlers_), frame) || ...);
+  }
+  template<unsigned Type, typename Header, typename F> static bool invoke(Handler<Type, Header, F> &handler, Frame &frame) {
+    if(frame.type() != Type)
+      return false;
+    if constexpr(std::is_void_v<Header>) {
+      handler.f(frame);
+    } else  {
+      std::optional<Header> header = frame.payload().template as<Header>();
+      if(!header)
+        return false;
+      handler.f(*header, frame);
+    }
+    return true;
+  }
+  std::tuple<Handlers...> handlers_;
+};
+
+} // namespace AS
+
+#endif
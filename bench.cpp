@@ -0,0 +1,123 @@
+/************************************
+ *            bench.cpp             *
+ *  round trips between two clients *
+ *  with the C API and ASLib.hpp    *
+ ************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <vector>
+#include "ASLib.hpp"
+
+// usage: bench [round trips] [payload bytes] [port] [host]
+// without host both clients and the server run in this process, run with 2>/dev/null to leave out the server log
+// with host the server runs elsewhere, e.g. the example server restarted during the benchmark (see AS_SetHandover)
+
+static double usecSince(std::chrono::steady_clock::time_point start, int n) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / n;
+}
+
+static AS_ClientEvent_t* waitForMessage(int conID, bool sleep) {
+  AS_ClientEvent_t *event;
+
+  while(1)  {
+    event = AS_ClientEvent(conID);
+    if(event != NULL && event->header->payloadType == AS_TypeMessage)
+      return event;
+    if(event != NULL)
+      continue;
+    if(sleep)
+      msecsleep(1); // loop of client.c
+    else
+      AS_ClientPoll(AS_TICK);
+  }
+}
+
+static double benchC(char *host, char *port, int n, int len, bool sleep) {
+  AS_ClientEvent_t *event;
+  int a, b, idA = 0, idB = 0, i;
+  std::vector<char> payload(len, 'x');
+
+  a = AS_ClientConnectAsync(host, port);
+  b = AS_ClientConnectAsync(host, port);
+  while(!idA || !idB) { // own IDs are reported with AS_TypeConnected
+    AS_ClientPoll(AS_TICK);
+    if((event = AS_ClientEvent(a)) != NULL && event->header->payloadType == AS_TypeConnected)
+      idA = event->header->clientDestination;
+    if((event = AS_ClientEvent(b)) != NULL && event->header->payloadType == AS_TypeConnected)
+      idB = event->header->clientDestination;
+  }
+  for(i = 0; i < 10; i++) { // presence notifications of the other client
+    AS_ClientPoll(AS_TICK);
+    while(AS_ClientEvent(a) != NULL || AS_ClientEvent(b) != NULL);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for(i = 0; i < n; i++)  {
+    AS_ClientSend(a, idB, AS_TypeMessage, payload.data(), len);
+    event = waitForMessage(b, sleep);
+    AS_ClientSend(b, idA, AS_TypeMessage, event->payload, event->header->payloadLength);
+    waitForMessage(a, sleep);
+  }
+  double usec = usecSince(start, n);
+  AS_ClientDisconnect(a);
+  AS_ClientDisconnect(b);
+  return usec;
+}
+
+static AS::Task<> ping(AS::Connection &con, int peer, int n, int len) {
+  std::vector<std::byte> payload(len, std::byte('x'));
+  int pongs = 0;
+  AS::Dispatch handle{AS::on<AS_TypeMessage>([&](AS::Frame &) { pongs++; })};
+
+  while(pongs < n)  {
+    co_await con.send(peer, AS_TypeMessage, payload);
+    for(int expect = pongs + 1; pongs < expect;) {
+      AS::Frame frame = co_await con.receive();
+      handle(frame);
+    }
+  }
+}
+
+static AS::Task<> pong(AS::Connection &con, int peer, int n) {
+  for(int pings = 0; pings < n;)  {
+    AS::Frame frame = co_await con.receive();
+    if(frame.type() != AS_TypeMessage)
+      continue;
+    co_await con.send(peer, AS_TypeMessage, frame.payload().bytes()); // sent back as received, AS_ClientSend copies it into the send queue like in benchC
+    pings++;
+  }
+}
+
+static double benchCpp(const std::string &host, const std::string &port, int n, int len) {
+  AS::Loop loop;
+  AS::Connection a(loop, host, port), b(loop, host, port);
+
+  loop.runFor(100); // presence notifications of the other client
+  while(a.tryReceive() || b.tryReceive());
+
+  auto start = std::chrono::steady_clock::now();
+  loop.spawn(pong(b, a.id(), n));
+  loop.spawn(ping(a, b.id(), n, len));
+  loop.run();
+  return usecSince(start, n);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 10000;
+  int len = argc > 2 ? atoi(argv[2]) : 64;
+  std::string port = argc > 3 ? argv[3] : "20145";
+  std::string host = argc > 4 ? argv[4] : "localhost";
+
+  std::optional<AS::Server> server;
+  if(argc <= 4)
+    server.emplace(atoi(port.c_str()));
+  printf("%d round trips, %d bytes payload\n", n, len);
+  printf("C, client.c: %.2f us per round trip (%d round trips)\n", benchC(host.data(), port.data(), n / 10 + 1, len, true), n / 10 + 1);
+  printf("C, poll:     %.2f us per round trip\n", benchC(host.data(), port.data(), n, len, false));
+  printf("ASLib.hpp:   %.2f us per round trip\n", benchCpp(host, port, n, len));
+  return 0;
+}
@@ -14,17 +14,45 @@
 #include <string.h>
 #include "ASLib.h"
 
-int main(void)  {
+int isSTDIN(int msec) { // 0: timeout (no input), >0: stdin has input, -1: error
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = msec * 1000;
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(0, &fds);  // only stdin as input in select()
+  return select(1, &fds, NULL, NULL, &tv);
+}
+
+int main(int argc, char **argv)  {
   char *buffer;
   size_t size;
-  int port;
+  int port, first;
+  char host[256], peerPort[16];
   
   AS_version(); // not used here
   
-  AS_ServerStart(20144, AS_IPv6);
+  // optional: server <port> <node>, node ID for federations (see "peer")
+  if(argc > 2)
+    AS_SetOption(AS_OptNodeId, atoi(argv[2]));
+  // the secret of the federation is taken from the environment (not visible in the process list)
+  if(getenv("AS_PEER_SECRET") != NULL)
+    AS_SetPeerSecret(getenv("AS_PEER_SECRET"));
+  // optional: server <port> <node> <dir>, a second server started with the same port and dir takes over all clients
+  if(argc > 3)
+    AS_SetHandover(argv[3]);
+  setvbuf(stdin, NULL, _IONBF, 0); // lines are not read ahead, select() sees all of them
+  first = argc > 1 ? atoi(argv[1]) : 20144;
+  AS_ServerStart(first, AS_IPv6);
   AS_ServerPrintRunning();
   
   while(1)  {
+    if(argc > 3 && !AS_ServerIsRunning(first)) { // handed over to the new server (or stopped)
+      printf("server %d is not running anymore, quit\n", first);
+      break;
+    }
+    if(isSTDIN(100) <= 0)
+      continue;
     buffer = NULL;
     getline(&buffer, &size, stdin); // wait for input and read line
     
@@ -35,6 +63,7 @@ int main(void)  {
       printf("  print, p:  print list of running server in this process\n");
       printf("  start <port>, s <port>:  start a new server\n");
       printf("  stop <port>,  t <port>:  stop a running server\n");
+      printf("  peer <port> <host> <remote port>:  connect server on port with the server at host:remote port\n");
       //printf("  clients, c: print list of all connected clients for all running server in this process\n");
     }
     
@@ -55,6 +84,8 @@ int main(void)  {
     if(port > -1) AS_ServerStop(port);
     port = -1; sscanf(buffer, "t %d\n", &port);
     if(port > -1) AS_ServerStop(port);
+    if(sscanf(buffer, "peer %d %255s %15s\n", &port, host, peerPort) == 3)
+      AS_ServerPeer(port, host, peerPort);
     
     free(buffer);
   }
@@ -0,0 +1,554 @@
+/************************************
+ *            test.cpp              *
+ *  self-checking tests of ASLib    *
+ *  and ASLib.hpp, 0: passed        *
+ ************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ASLib.hpp"
+
+// usage: test [port], run with 2>/dev/null to leave out the log of the library
+// test node <port> <node> [dir]: server in another process (started by the test), runs until stdin is closed or it handed over
+// the port and the 3 ports after it must be free, nothing may listen on port 1
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+  if(!(cond)) { \
+    printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    failed++; \
+  } \
+} while(0)
+
+static std::string port;
+
+struct Header { // payload header of the dispatch test
+  int a;
+  int b;
+};
+
+static AS_ClientEvent_t* newEvent(unsigned type, const char *text) { // event as returned by AS_ClientEvent, payload malloc()ed
+  AS_ClientEvent_t *event = (AS_ClientEvent_t *)calloc(1, sizeof(AS_ClientEvent_t));
+  event->header = (AS_MessageHeader_t *)calloc(1, sizeof(AS_MessageHeader_t));
+  event->header->payloadType = type;
+  event->header->payloadLength = strlen(text) + 1;
+  event->payload = strdup(text);
+  return event;
+}
+
+static void freeEvent(AS_ClientEvent_t *event) {
+  free(event->payload);
+  free(event->header);
+  free(event);
+}
+
+static void testBuffers() {
+  printf("buffers and frames\n");
+  AS::Buffer a = AS::Buffer::copy("hello", 5);
+  CHECK(a.size() == 5 && a.text() == "hello" && a.data()[5] == std::byte('\0'));
+  const std::byte *block = a.data();
+  AS::Buffer b(std::move(a));
+  CHECK(a.empty() && a.data() == nullptr);  // moved out
+  CHECK(b.data() == block);                 // same block, no copy
+  AS::Buffer c = std::move(b).tail(2);
+  CHECK(b.empty() && c.text() == "llo" && c.data() == block + 2);
+  CHECK(!c.as<Header>());                   // shorter than the type
+  CHECK(c.as<char>(1) == 'l');
+
+  AS_ClientEvent_t *event = newEvent(AS_TypeMessage, "payload");
+  void *payload = event->payload;
+  AS::Frame frame(event);
+  CHECK(event->payload == nullptr);         // taken over
+  CHECK(frame.payload().data() == payload && frame.payload().text() == "payload");
+  CHECK(frame.type() == AS_TypeMessage);
+  AS::Buffer taken = frame.take();
+  CHECK(frame.payload().empty() && taken.data() == payload);
+  freeEvent(event);
+}
+
+static void testDispatch() {
+  printf("typed dispatch\n");
+  int messages = 0, requests = 0, sum = 0;
+  AS::Dispatch handle{
+    AS::on<AS_TypeMessage>([&](AS::Frame &) { messages++; }),
+    AS::on<AS_TypeFileRequest, Header>([&](const Header &header, AS::Frame &) { requests++; sum = header.a + header.b; }),
+  };
+  Header header = {3, 4};
+  AS_MessageHeader_t h = {};
+
+  h.payloadType = AS_TypeMessage;
+  AS::Frame message(h, AS::Buffer::copy("x", 1));
+  CHECK(handle(message) && messages == 1 && requests == 0);
+
+  h.payloadType = AS_TypeFileRequest;
+  AS::Frame request(h, AS::Buffer::copy(&header, sizeof(header)));
+  CHECK(handle(request) && requests == 1 && sum == 7 && messages == 1);
+
+  AS::Frame shortRequest(h, AS::Buffer::copy(&header, sizeof(header) - 1));
+  CHECK(!handle(shortRequest) && requests == 1);  // too short for Header
+
+  h.payloadType = AS_TypeFileData;
+  AS::Frame other(h, AS::Buffer::copy("x", 1));
+  CHECK(!handle(other) && messages == 1 && requests == 1);
+}
+
+static void testConnectFailure() {
+  printf("connect failure\n");
+  AS::Loop loop;
+  bool thrown = false;
+  try {
+    AS::Connection con(loop, "127.0.0.1", "1");
+  } catch(const AS::Error &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+
+  thrown = false;
+  loop.spawn([](AS::Loop &loop, bool &thrown) -> AS::Task<> {
+    try {
+      AS::Connection con = co_await loop.connect("127.0.0.1", "1");
+    } catch(const AS::Error &) {
+      thrown = true;
+    }
+  }(loop, thrown));
+  loop.run();
+  CHECK(thrown);
+}
+
+static AS::Task<> answer(AS::Connection &con, int n) {
+  // collect n requests, answer them in reverse order: status is the method, result the arguments reversed
+  std::vector<AS::Frame> requests;
+  while((int)requests.size() < n) {
+    AS::Frame frame = co_await con.receive();
+    if(frame.type() == AS_TypeRequest)
+      requests.push_back(std::move(frame));
+  }
+  for(int i = n - 1; i >= 0; i--)  {
+    std::string_view args = requests[i].payload().view().substr(sizeof(AS_Rpc_t));
+    std::string result(args.rbegin(), args.rend());
+    con.respond(requests[i], requests[i].payload().as<AS_Rpc_t>()->method, std::as_bytes(std::span<const char>(result)));
+  }
+}
+
+static AS::Task<> call(AS::Connection &con, int recipient, int method, std::string args, int &matched) {
+  AS::Response response = co_await con.request(recipient, method, std::as_bytes(std::span<const char>(args)), 5000);
+  std::string expected(args.rbegin(), args.rend());
+  if(response.status == method && response.result.view() == expected)
+    matched++;
+}
+
+static void testRequests() {
+  printf("request/response matching\n");
+  AS::Loop loop;
+  AS::Connection a(loop, "127.0.0.1", port), b(loop, "127.0.0.1", port);
+  int matched = 0;
+  loop.runFor(100); // presence notifications
+  while(a.tryReceive() || b.tryReceive());
+
+  loop.spawn(answer(b, 3));
+  loop.spawn(call(a, b.id(), 1, "first", matched));
+  loop.spawn(call(a, b.id(), 2, "second one", matched));
+  loop.spawn(call(a, b.id(), 3, "3", matched));
+  for(int i = 0; i < 300 && !loop.empty(); i++)
+    loop.poll(AS_TICK);
+  CHECK(loop.empty());
+  CHECK(matched == 3);
+
+  AS::Response lost;
+  loop.spawn([](AS::Connection &con, AS::Response &lost) -> AS::Task<> {
+    lost = co_await con.request(12345, 1, {}, 200); // nobody answers
+  }(a, lost));
+  loop.run();
+  CHECK(lost.status == AS_RpcUnreachable || lost.status == AS_RpcTimeout);
+}
+
+static void testClosed() {
+  printf("receive after close\n");
+  int otherPort = atoi(port.c_str()) + 1;
+  AS::Server server(otherPort);
+  AS::Loop loop;
+  AS::Connection con(loop, "127.0.0.1", std::to_string(otherPort));
+  bool shutdown = false, thrown = false;
+  loop.runFor(50);
+  while(con.tryReceive());
+
+  loop.spawn([](AS::Connection &con, bool &shutdown, bool &thrown) -> AS::Task<> {
+    try {
+      while(1)  {
+        AS::Frame frame = co_await con.receive();
+        if(frame.type() == AS_TypeShutdown)
+          shutdown = true;
+      }
+    } catch(const AS::Error &) {
+      thrown = true;
+    }
+  }(con, shutdown, thrown));
+  loop.runFor(50);
+  server.stop();
+  for(int i = 0; i < 300 && !loop.empty(); i++)
+    loop.poll(AS_TICK);
+  CHECK(shutdown && thrown);
+  CHECK(con.closed());
+  CHECK(con.send(-2, std::string("late")).sent() == 0);
+}
+
+static void testForeignEvents() {
+  printf("events of connections outside the loop\n");
+  AS::Loop loop;
+  int other = AS_ClientConnect((char *)"127.0.0.1", port.data());
+  AS::Connection con(loop, "127.0.0.1", port); // presence event for other, never read by the loop
+  CHECK(other > 0 && !con.closed());
+  msecsleep(50);
+  std::clock_t cpu = std::clock();
+  loop.runFor(300);
+  double msec = (std::clock() - cpu) * 1000.0 / CLOCKS_PER_SEC;
+  CHECK(msec < 150);  // waits in poll() instead of spinning
+  AS_ClientDisconnect(other);
+}
+
+static int rawConnect(int port) { // plain TCP connection, frames are written by the test
+  sockaddr_in addr = {};
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(connect(sock, (sockaddr *)&addr, sizeof(addr)) == -1)  {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static void rawSend(int sock, unsigned type, int destination, unsigned length, const void *payload, unsigned len) {
+  // header with any payloadLength, followed by len bytes
+  AS_MessageHeader_t header = {144, 0, destination, type, length};
+  std::string frame((const char *)&header, sizeof(header));
+  frame.append((const char *)payload, len);
+  send(sock, frame.data(), frame.size(), MSG_NOSIGNAL);
+}
+
+static bool rawClosed(int sock, int msec) { // server closes the connection within msec
+  char data[4096];
+  pollfd pfd = {sock, POLLIN, 0};
+  while(poll(&pfd, 1, msec) == 1)
+    if(recv(sock, data, sizeof(data), 0) <= 0)
+      return true;
+  return false;
+}
+
+static void testOversized() {
+  printf("frames larger than allowed\n");
+  int otherPort = atoi(port.c_str()) + 2;
+  for(int maxPayload : {AS_MAXPAYLOAD, 0})  {
+    AS::Config config;
+    config.set(AS_OptMaxPayload, maxPayload);
+    AS::Server server(otherPort, AS_IPunspec, &config);
+    int sock = rawConnect(otherPort);
+    rawSend(sock, AS_TypeFileData, -1, 0xFFFFFFFF, nullptr, 0); // '\0' behind the payload must not wrap around
+    CHECK(rawClosed(sock, 1000));
+    close(sock);
+    sock = rawConnect(otherPort);
+    rawSend(sock, AS_TypeFileData, -1, AS_MAXPAYLOAD + 1, nullptr, 0);
+    CHECK(rawClosed(sock, 1000) == (maxPayload != 0));
+    close(sock);
+    CHECK(AS_ServerIsRunning(otherPort));
+    AS::Loop loop;
+    AS::Connection con(loop, "127.0.0.1", std::to_string(otherPort)); // still serving
+    CHECK(!con.closed());
+  }
+}
+
+static void rawFragment(int sock, unsigned type, unsigned length, unsigned offset, unsigned len) { // broadcast a part of a frame
+  std::string part(sizeof(AS_Fragment_t) + len, 'x');
+  AS_Fragment_t fragment = {type, length, offset};
+  memcpy(part.data(), &fragment, sizeof(fragment));
+  rawSend(sock, AS_TypeFragment, -2, part.size(), part.data(), part.size());
+}
+
+static void testFragments() {
+  printf("fragments of other clients\n");
+  AS::Loop loop;
+  AS::Config config;
+  config.set(AS_OptMaxPayload, 2 * AS_FRAGMENT); // fragments pass, the frame of 4 does not
+  AS::Connection con(loop, "127.0.0.1", port, &config);
+  int sock = rawConnect(atoi(port.c_str()));
+  loop.runFor(100);
+  while(con.tryReceive());
+
+  rawFragment(sock, AS_TypeShutdown, 4, 0, 4);  // no control frames
+  rawFragment(sock, AS_TypeFragment, 4, 0, 4);
+  rawFragment(sock, AS_TypeFileData, 0xFFFFFFFF, 0, 4); // never allocated
+  rawFragment(sock, AS_TypeFileData, 10, 8, 4); // beyond the frame
+  for(int i = 0; i < 4; i++)  // above the limit of the receiver
+    rawFragment(sock, AS_TypeFileData, 4 * AS_FRAGMENT, i * AS_FRAGMENT, AS_FRAGMENT);
+  rawFragment(sock, AS_TypeFileData, 100, 0, 60);
+  rawFragment(sock, AS_TypeFileData, 100, 60, 40);
+  loop.runFor(200);
+  int frames = 0, complete = 0;
+  while(std::optional<AS::Frame> frame = con.tryReceive())  {
+    if(frame->type() < AS_TypeMessage && frame->type() != AS_TypeShutdown)
+      continue; // presence
+    frames++;
+    if(frame->type() == AS_TypeFileData && frame->payload().size() == 100)
+      complete++;
+  }
+  CHECK(frames == 1 && complete == 1);
+  CHECK(!con.closed());
+  CHECK(!rawClosed(sock, 0));
+  close(sock);
+}
+
+static std::atomic<int> hooked; // frames of the size sent by testHookedFragments seen by its hook
+
+static int hookSize(int port, AS_MessageHeader_t *header, void **payload) {
+  if(header->payloadLength == 3 * AS_FRAGMENT + 5)
+    hooked++;
+  return AS_HookForward;
+}
+
+static void testHookedFragments() {
+  printf("hooks of fragmented frames\n");
+  int otherPort = atoi(port.c_str()) + 2;
+  for(int direct : {0, 1})  {
+    hooked = 0;
+    AS_SetHook(AS_TypeFileData, hookSize, direct);
+    AS::Server server(otherPort);
+    AS_SetHook(AS_TypeFileData, NULL, 0);
+    AS::Loop loop;
+    AS::Connection a(loop, "127.0.0.1", std::to_string(otherPort)), b(loop, "127.0.0.1", std::to_string(otherPort));
+    std::string data(3 * AS_FRAGMENT + 5, 'd');
+    data[AS_FRAGMENT] = 'e';
+    a.send(b.id(), AS_TypeFileData, std::as_bytes(std::span<const char>(data)));
+    bool complete = false;
+    for(int i = 0; i < 200 && !complete; i++) {
+      while(std::optional<AS::Frame> frame = b.tryReceive())
+        if(frame->type() == AS_TypeFileData)
+          complete = frame->source() == a.id() && frame->payload().view() == data;
+      loop.poll(AS_TICK);
+    }
+    CHECK(complete);
+    CHECK(hooked == 1);
+  }
+}
+
+static void testDatagrams() {
+  printf("datagrams within the rate limit\n");
+  int otherPort = atoi(port.c_str()) + 2;
+  AS::Config config, clientConfig;
+  config.set(AS_OptDatagram, 1).set(AS_OptRateLimit, 2000).set(AS_OptRateBurst, 4000);
+  clientConfig.set(AS_OptDatagram, 1);
+  AS::Server server(otherPort, AS_IPunspec, &config);
+  AS::Loop loop;
+  AS::Connection a(loop, "127.0.0.1", std::to_string(otherPort), &clientConfig), b(loop, "127.0.0.1", std::to_string(otherPort), &clientConfig);
+  loop.runFor(200); // datagram channels are acknowledged
+  while(a.tryReceive() || b.tryReceive());
+
+  std::string large(2 * AS_DATAGRAM, 'l'), small(100, 's');
+  a.send(b.id(), AS_TypeMessage | AS_TypeUnreliable, std::as_bytes(std::span<const char>(large))); // too large: over TCP
+  loop.runFor(100);
+  for(int i = 0; i < 50; i++) // the burst lets some of them pass, the others are dropped (over TCP all would arrive)
+    a.send(b.id(), AS_TypeMessage | AS_TypeUnreliable, std::as_bytes(std::span<const char>(small)));
+  loop.runFor(300);
+  int larges = 0, smalls = 0;
+  while(std::optional<AS::Frame> frame = b.tryReceive())  {
+    if(frame->type() == AS_TypeMessage && frame->payload().view() == large)
+      larges++;
+    if(frame->type() == AS_TypeMessage && frame->payload().view() == small)
+      smalls++;
+  }
+  CHECK(larges == 1);
+  CHECK(smalls > 0 && smalls < 50 && smalls + server.stats().dropped == 50);
+}
+
+static const char *secret = "federation test";
+
+static bool received(AS::Loop &loop, AS::Connection &con, unsigned type, int id, const std::string &text = "") {
+  // frame of type within 2 s, id: source of a frame or client of a presence event
+  for(int i = 0; i < 200; i++)  {
+    while(std::optional<AS::Frame> frame = con.tryReceive())  {
+      int client = type == AS_TypeClientConnect || type == AS_TypeClientDisconnect ? frame->destination() : frame->source();
+      if(frame->type() == type && client == id && frame->payload().text() == text)
+        return true;
+    }
+    loop.poll(AS_TICK);
+  }
+  return false;
+}
+
+static void testPresenceFrames() {
+  printf("presence frames of a server\n");
+  int otherPort = atoi(port.c_str()) + 2, one = 1;
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(otherPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  CHECK(bind(listener, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0);
+  std::thread server([listener] { // server written by the test
+    int sock = accept(listener, nullptr, nullptr);
+    AS_PresenceDelta_t negative = {0, 1, -1000000, 1000000}; // counts add up to the length of the frame
+    struct {
+      AS_PresenceDelta_t delta;
+      int id;
+    } join = {{1, 2, 0, 1}, 7};
+    rawSend(sock, AS_TypeClientID, 5, 0, nullptr, 0);
+    rawSend(sock, AS_TypePresence, 5, sizeof(negative), &negative, sizeof(negative));
+    rawSend(sock, AS_TypeClientListDelta, 5, sizeof(negative), &negative, sizeof(negative));
+    rawSend(sock, AS_TypePresence, 5, sizeof(join), &join, sizeof(join));
+    rawClosed(sock, 2000);
+    close(sock);
+  });
+  {
+    AS::Loop loop;
+    AS::Connection con(loop, "127.0.0.1", std::to_string(otherPort));
+    CHECK(received(loop, con, AS_TypeClientConnect, 7)); // negative counts are ignored
+  }
+  server.join();
+  close(listener);
+}
+
+static int runNode(int port, int node, const char *dir) { // "test node": server of another process
+  AS::Config config;
+  config.set(AS_OptNodeId, node);
+  AS_SetPeerSecret((char *)secret);
+  AS_SetHandover((char *)dir);
+  AS::Server server(port, AS_IPunspec, &config);
+  pollfd pfd = {0, POLLIN, 0};
+  char c;
+  while(AS_ServerIsRunning(port) && (poll(&pfd, 1, 10) == 0 || read(0, &c, 1) > 0));
+  return 0;
+}
+
+static pid_t startNode(int port, int node, const char *dir, int &control) {
+  // control: write end of the stdin of the other process, it stops when it is closed
+  int fds[2];
+  if(pipe(fds) != 0)
+    return -1;
+  pid_t pid = fork();
+  if(pid == 0)  {
+    dup2(fds[0], 0);
+    close(fds[0]);
+    close(fds[1]);
+    execl("/proc/self/exe", "test", "node", std::to_string(port).c_str(), std::to_string(node).c_str(), dir, (char *)nullptr);
+    _exit(1);
+  }
+  close(fds[0]);
+  control = fds[1];
+  return pid;
+}
+
+static std::optional<AS::Connection> connectNode(AS::Loop &loop, int port) { // until the other process listens
+  std::optional<AS::Connection> con;
+  for(int i = 0; i < 200 && !con; i++)  {
+    try {
+      con.emplace(loop, "127.0.0.1", std::to_string(port));
+    } catch(const AS::Error &) {
+      msecsleep(10);
+    }
+  }
+  return con;
+}
+
+static void testFederation() {
+  printf("federation of two server processes\n");
+  int firstPort = atoi(port.c_str()) + 2, secondPort = firstPort + 1, status = -1, control = -1;
+  pid_t pid = startNode(secondPort, 2, nullptr, control);
+
+  AS::Config config;
+  config.set(AS_OptNodeId, 1);
+  AS_SetPeerSecret((char *)secret);
+  AS::Server server(firstPort, AS_IPunspec, &config);
+  AS_SetPeerSecret(NULL);
+  int sock = rawConnect(firstPort), hello = 3; // clients cannot pose as a peer
+  rawSend(sock, AS_TypePeerHello, -1, sizeof(hello), &hello, sizeof(hello));
+  CHECK(rawClosed(sock, 1000));
+  close(sock);
+
+  AS::Loop loop;
+  AS::Connection a(loop, "127.0.0.1", std::to_string(firstPort));
+  std::optional<AS::Connection> b = connectNode(loop, secondPort);
+  CHECK(b && server.peer("127.0.0.1", std::to_string(secondPort)));
+  if(b) {
+    CHECK(received(loop, a, AS_TypeClientConnect, b->id()));
+    CHECK(received(loop, *b, AS_TypeClientConnect, a.id()));
+    a.send(b->id(), std::string("unicast"));
+    CHECK(received(loop, *b, AS_TypeMessage, a.id(), "unicast"));
+    b->send(-2, std::string("broadcast"));
+    CHECK(received(loop, a, AS_TypeMessage, b->id(), "broadcast"));
+    int left = b->id();
+    b->close();
+    CHECK(received(loop, a, AS_TypeClientDisconnect, left));
+  }
+  close(control);
+  waitpid(pid, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void testHandover() {
+  printf("handover to a server of this process\n");
+  int otherPort = atoi(port.c_str()) + 3, status = -1, control = -1;
+  char dir[] = "/tmp/ASLibTestXXXXXX";
+  CHECK(mkdtemp(dir) != nullptr);
+  pid_t pid = startNode(otherPort, 0, dir, control);
+  {
+    AS::Loop loop;
+    std::optional<AS::Connection> a = connectNode(loop, otherPort);
+    CHECK(a.has_value());
+    loop.runFor(100);
+    AS_SetHandover(dir);
+    AS::Server server(otherPort); // takes over the clients of the other process (records are parsed here)
+    AS_SetHandover(NULL);
+    waitpid(pid, &status, 0); // the other process quits when its server has handed over
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    AS::Connection b(loop, "127.0.0.1", std::to_string(otherPort));
+    if(a) {
+      b.send(a->id(), std::string("after handover"));
+      CHECK(received(loop, *a, AS_TypeMessage, b.id(), "after handover"));
+      a->send(b.id(), std::string("back"));
+      CHECK(received(loop, b, AS_TypeMessage, a->id(), "back"));
+    }
+  }
+  close(control);
+  rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+  if(argc > 3 && strcmp(argv[1], "node") == 0)
+    return runNode(atoi(argv[2]), atoi(argv[3]), argc > 4 ? argv[4] : nullptr);
+  port = argc > 1 ? argv[1] : "20146";
+  AS::Server server(atoi(port.c_str()));
+
+  testBuffers();
+  testDispatch();
+  testConnectFailure();
+  testRequests();
+  testClosed();
+  testForeignEvents();
+  testOversized();
+  testFragments();
+  testHookedFragments();
+  testDatagrams();
+  testPresenceFrames();
+  testFederation();
+  testHandover();
+  if(failed)  {
+    printf("%d checks failed\n", failed);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}